@@ -38,6 +38,13 @@ typedef struct
     char name[IFNAMSIZ];
 
     bool up;
+
+    /* MSTI states are programmed into the kernel bridge (MST mode),
+     * see MSTP_OUT_set_state() */
+    bool mst_offload;
+    /* Some ports have changed MSTI states. When the VID-to-MSTID mapping
+     * changes, the states of all the ports are programmed again */
+    bool msti_states_changed, vid2mstid_changed;
 } sysdep_br_data_t;
 
 typedef struct
@@ -48,6 +55,8 @@ typedef struct
 
     bool up;
     int speed, duplex;
+
+    bool msti_states_changed; /* see sysdep_br_data_t */
 } sysdep_if_data_t;
 
 #define GET_PORT_SPEED(port)    ((port)->sysdeps.speed)
@@ -77,14 +86,55 @@ typedef struct
           __PRETTY_FUNCTION__, _ptp->port->bridge->sysdeps.name,     \
          _ptp->port->sysdeps.name, __be16_to_cpu(ptp->MSTID), ##_args)
 
-extern struct rtnl_handle rth_state;
+/* Requests for the kernel bridge, see br_nl_request() */
+typedef enum
+{
+    BR_NL_PORT_STATE, /* arg is the new state */
+    BR_NL_PORT_FLUSH,
+    BR_NL_AGEING_TIME, /* if_index is the bridge, arg is the ageing time */
+    BR_NL_MST_ENABLE, /* if_index is the bridge */
+    BR_NL_VLAN_MSTI, /* if_index is the bridge, arg is the VID */
+    BR_NL_MSTI_STATES,
+} br_nl_req_t;
+
+struct nlmsghdr;
 
 int init_bridge_ops(void);
 
-int bridge_notify(int br_index, int if_index, bool newlink, unsigned flags);
+/* Queue netlink request n (it is copied, sequence number and NLM_F_ACK
+ * are set here) for the kernel. Queued requests are sent by br_nl_flush();
+ * if the kernel refuses one, bridge_nl_request_failed() is called with
+ * type, if_index and arg of the request. It must not queue requests */
+int br_nl_request(struct nlmsghdr *n, br_nl_req_t type, int if_index,
+                  int arg);
+void br_nl_flush(void);
+
+/* Link event, parsed from RTM_NEWLINK/RTM_DELLINK by brmon.c. Pointers
+ * are into the netlink message and valid during bridge_notify() only */
+typedef struct
+{
+    int if_index;
+    /* Master bridge of the port, if_index for the bridge itself,
+     * -1 for other interfaces */
+    int br_index;
+    bool newlink;
+    unsigned flags; /* IFF_xxx */
+    const char *name;
+    const __u8 *macaddr; /* NULL if not in the message */
+    int port_no; /* -1 if not in the message */
+} bridge_link_event_t;
+
+int bridge_notify(const bridge_link_event_t *ev);
 
 void bridge_bpdu_rcv(int ifindex, const unsigned char *data, int len);
 
-void bridge_one_second(void);
+void bridge_bpdu_tx_failed(int ifindex);
+
+void bridge_nl_request_failed(br_nl_req_t type, int if_index, int arg,
+                              int err);
+
+void bridge_seconds_elapsed(unsigned int seconds);
+
+void bridge_run_pending(void);
 
 #endif /* BRIDGE_CTL_H */
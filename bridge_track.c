@@ -25,11 +25,10 @@
 ******************************************************************************/
 
 #include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
 #include <linux/param.h>
 #include <netinet/in.h>
 #include <linux/if_bridge.h>
+#include <linux/neighbour.h>
 #include <asm/byteorder.h>
 
 #include "bridge_ctl.h"
@@ -40,17 +39,134 @@
 #include "mstp.h"
 #include "driver.h"
 #include "libnetlink.h"
-
-#ifndef SYSFS_CLASS_NET
-#define SYSFS_CLASS_NET "/sys/class/net"
-#endif
+#include "worker_pool.h"
 
 static LIST_HEAD(bridges);
+static obj_pool_t br_pool = OBJ_POOL_INITIALIZER(bridge_t, 4);
+
+static void br_program_msti_states(void);
+
+/* All known interfaces (bridges and their ports) indexed by ifindex.
+ * Open addressing hash with linear probing. The size of the table is
+ * a power of 2 and the table is kept at most half full.
+ */
+struct if_slot
+{
+    int if_index; /* 0 for the empty slot, valid ifindex is always > 0 */
+    bridge_t *br;
+    port_t *prt; /* NULL if the interface is the bridge itself */
+};
+
+#define IF_TABLE_MIN_SIZE 64
+
+static struct if_slot *if_table;
+static unsigned int if_table_size, if_table_count;
+
+static inline unsigned int if_hash(int if_index)
+{
+    /* Fibonacci hashing, ifindexes are mostly sequential */
+    return ((unsigned int)if_index * 2654435761u) & (if_table_size - 1);
+}
+
+static struct if_slot * if_table_find(int if_index)
+{
+    unsigned int i;
+
+    if(0 == if_table_size)
+        return NULL;
+    for(i = if_hash(if_index); if_table[i].if_index;
+        i = (i + 1) & (if_table_size - 1))
+    {
+        if(if_table[i].if_index == if_index)
+            return &if_table[i];
+    }
+    return NULL;
+}
+
+static void if_table_put(int if_index, bridge_t *br, port_t *prt)
+{
+    unsigned int i;
+
+    for(i = if_hash(if_index); if_table[i].if_index;
+        i = (i + 1) & (if_table_size - 1))
+        ;
+    if_table[i].if_index = if_index;
+    if_table[i].br = br;
+    if_table[i].prt = prt;
+}
+
+static bool if_table_add(int if_index, bridge_t *br, port_t *prt)
+{
+    struct if_slot *slot, *old_table;
+    unsigned int i, old_size;
+
+    if((slot = if_table_find(if_index)))
+    {
+        if((slot->br == br) && (slot->prt == prt))
+            return true;
+        /* Stale entry, its owner has to be deleted first */
+        ERROR("Interface %d is already known as %s of bridge %s",
+              if_index, slot->prt ? "port" : "master",
+              slot->br->sysdeps.name);
+        return false;
+    }
+
+    if(2 * (if_table_count + 1) > if_table_size)
+    {
+        old_table = if_table;
+        old_size = if_table_size;
+        if_table_size = old_size ? 2 * old_size : IF_TABLE_MIN_SIZE;
+        if(!(if_table = calloc(if_table_size, sizeof(*if_table))))
+        {
+            ERROR("Couldn't grow interface table to %u entries",
+                  if_table_size);
+            if_table = old_table;
+            if_table_size = old_size;
+            return false;
+        }
+        for(i = 0; i < old_size; ++i)
+            if(old_table[i].if_index)
+                if_table_put(old_table[i].if_index, old_table[i].br,
+                             old_table[i].prt);
+        free(old_table);
+    }
+
+    if_table_put(if_index, br, prt);
+    ++if_table_count;
+    return true;
+}
+
+static void if_table_del(int if_index)
+{
+    struct if_slot *slot;
+    unsigned int i, j, k, mask = if_table_size - 1;
+
+    if(!(slot = if_table_find(if_index)))
+        return;
+    i = slot - if_table;
+    slot->if_index = 0;
+    --if_table_count;
+
+    /* Shift back the entries of the probe sequence, so that no
+     * tombstones are needed */
+    for(j = (i + 1) & mask; if_table[j].if_index; j = (j + 1) & mask)
+    {
+        k = if_hash(if_table[j].if_index);
+        /* Entry at j can fill the hole at i only if its home slot k
+         * is not cyclically within (i, j] */
+        if(((j - k) & mask) >= ((j - i) & mask))
+        {
+            if_table[i] = if_table[j];
+            if_table[j].if_index = 0;
+            i = j;
+        }
+    }
+}
 
 static bridge_t * create_br(int if_index)
 {
     bridge_t *br;
-    TST((br = calloc(1, sizeof(*br))) != NULL, NULL);
+    TST((br = obj_pool_alloc(&br_pool)) != NULL, NULL);
 
     /* Init system dependent info */
     br->sysdeps.if_index = if_index;
@@ -60,41 +176,59 @@ static bridge_t * create_br(int if_index)
         goto err;
 
     INFO("Add bridge %s", br->sysdeps.name);
+    if(!if_table_add(if_index, br, NULL))
+        goto err;
     if(!MSTP_IN_bridge_create(br, br->sysdeps.macaddr))
+    {
+        if_table_del(if_index);
         goto err;
+    }
 
     list_add_tail(&br->list, &bridges);
     return br;
 err:
-    free(br);
+    obj_pool_free(&br_pool, br);
     return NULL;
 }
 
 static bridge_t * find_br(int if_index)
 {
-    bridge_t *br;
-    list_for_each_entry(br, &bridges, list)
-    {
-        if(br->sysdeps.if_index == if_index)
-            return br;
-    }
-    return NULL;
+    struct if_slot *slot = if_table_find(if_index);
+
+    return (slot && !slot->prt) ? slot->br : NULL;
+}
+
+/* Find the port with given ifindex, whichever bridge it belongs to */
+static port_t * find_port(int if_index)
+{
+    struct if_slot *slot = if_table_find(if_index);
+
+    return slot ? slot->prt : NULL;
 }
 
-static port_t * create_if(bridge_t * br, int if_index)
+/* ev is the link event which brought the port, NULL if there is none.
+ * What is not in the event is read from the interface */
+static port_t * create_if(bridge_t * br, int if_index,
+                          const bridge_link_event_t *ev)
 {
     port_t *prt;
-    TST((prt = calloc(1, sizeof(*prt))) != NULL, NULL);
+    TST((prt = obj_pool_alloc(&br->port_pool)) != NULL, NULL);
 
     /* Init system dependent info */
     prt->sysdeps.if_index = if_index;
-    if (!index_to_port_name(if_index, prt->sysdeps.name))
+    if(ev)
+        strncpy(prt->sysdeps.name, ev->name, IFNAMSIZ - 1);
+    else if (!index_to_port_name(if_index, prt->sysdeps.name))
         goto err;
-    if (get_hwaddr(prt->sysdeps.name, prt->sysdeps.macaddr))
+    if(ev && ev->macaddr)
+        memcpy(prt->sysdeps.macaddr, ev->macaddr, ETH_ALEN);
+    else if (get_hwaddr(prt->sysdeps.name, prt->sysdeps.macaddr))
         goto err;
 
     int portno;
-    if(0 > (portno = get_bridge_portno(prt->sysdeps.name)))
+    if(ev && (0 <= ev->port_no))
+        portno = ev->port_no;
+    else if(0 > (portno = get_bridge_portno(prt->sysdeps.name)))
     {
         ERROR("Couldn't get port number for %s", prt->sysdeps.name);
         goto err;
@@ -108,83 +242,129 @@ static port_t * create_if(bridge_t * br, int if_index)
     INFO("Add iface %s as port#%d to bridge %s", prt->sysdeps.name,
          portno, br->sysdeps.name);
     prt->bridge = br;
+    if(!if_table_add(if_index, br, prt))
+        goto err;
     if(!MSTP_IN_port_create_and_add_tail(prt, portno))
+    {
+        if_table_del(if_index);
         goto err;
+    }
 
     return prt;
 err:
-    free(prt);
+    obj_pool_free(&br->port_pool, prt);
     return NULL;
 }
 
 static port_t * find_if(bridge_t * br, int if_index)
 {
-    port_t *prt;
-    list_for_each_entry(prt, &br->ports, br_list)
-    {
-        if(prt->sysdeps.if_index == if_index)
-            return prt;
-    }
-    return NULL;
+    port_t *prt = find_port(if_index);
+
+    return (prt && (prt->bridge == br)) ? prt : NULL;
 }
 
 static inline void delete_if(port_t *prt)
 {
+    if_table_del(prt->sysdeps.if_index);
     MSTP_IN_delete_port(prt);
-    free(prt);
-}
-
-static inline bool delete_if_byindex(bridge_t * br, int if_index)
-{
-    port_t *prt;
-    if(!(prt = find_if(br, if_index)))
-        return false;
-    delete_if(prt);
-    return true;
+    obj_pool_free(&prt->bridge->port_pool, prt);
 }
 
 static bool delete_br_byindex(int if_index)
 {
     bridge_t *br;
+    port_t *prt;
     if(!(br = find_br(if_index)))
         return false;
 
     INFO("Delete bridge %s (%d)", br->sysdeps.name, if_index);
 
+    list_for_each_entry(prt, &br->ports, br_list)
+        if_table_del(prt->sysdeps.if_index);
+    if_table_del(if_index);
     list_del(&br->list);
     MSTP_IN_delete_bridge(br);
-    free(br);
+    obj_pool_free(&br_pool, br);
     return true;
 }
 
-void bridge_one_second(void)
+void bridge_seconds_elapsed(unsigned int seconds)
 {
     bridge_t *br;
     list_for_each_entry(br, &bridges, list)
-        MSTP_IN_one_second(br);
+        MSTP_IN_seconds_elapsed(br, seconds);
+}
+
+static void bridge_run_pending_job(void *arg, int i)
+{
+    MSTP_IN_run_pending(((bridge_t **)arg)[i]);
+}
+
+/* Bridges share nothing in the protocol data, so when there are worker
+ * threads (see worker_pool.h) the bridges with pending work are run
+ * in parallel, one bridge per job */
+void bridge_run_pending(void)
+{
+    static bridge_t **pending;
+    static int pending_alloc;
+    bridge_t *br, **tmp;
+    int n = 0;
+
+    if(!worker_pool_size())
+        goto run_serial;
+
+    list_for_each_entry(br, &bridges, list)
+    {
+        if(!br->run_pending)
+            continue;
+        if(n == pending_alloc)
+        {
+            tmp = realloc(pending, (n + 16) * sizeof(*pending));
+            if(!tmp)
+                goto run_serial;
+            pending = tmp;
+            pending_alloc = n + 16;
+        }
+        pending[n++] = br;
+    }
+    worker_pool_run(bridge_run_pending_job, pending, n);
+    goto out;
+
+run_serial:
+    list_for_each_entry(br, &bridges, list)
+        MSTP_IN_run_pending(br);
+out:
+    br_program_msti_states();
 }
 
 /* New MAC address is stored in addr, which also holds the old value on entry.
+   new_addr is the address from the link event, if it is NULL the address
+   is read from the interface.
    Return true if the address changed */
-static bool check_mac_address(char *name, __u8 *addr)
+static bool check_mac_address(char *name, __u8 *addr, const __u8 *new_addr)
 {
     __u8 temp_addr[ETH_ALEN];
-    if(get_hwaddr(name, temp_addr))
+    if(!new_addr)
     {
-        LOG("Error getting hw address: %s", name);
-        /* Error. Ignore the new value */
-        return false;
+        if(get_hwaddr(name, temp_addr))
+        {
+            LOG("Error getting hw address: %s", name);
+            /* Error. Ignore the new value */
+            return false;
+        }
+        new_addr = temp_addr;
     }
-    if(memcmp(addr, temp_addr, sizeof(temp_addr)) == 0)
+    if(memcmp(addr, new_addr, ETH_ALEN) == 0)
         return false;
     else
     {
-        memcpy(addr, temp_addr, sizeof(temp_addr));
+        memcpy(addr, new_addr, ETH_ALEN);
         return true;
     }
 }
 
-static void set_br_up(bridge_t * br, bool up)
+/* ev is the link event of the bridge, NULL if there is none */
+static void set_br_up(bridge_t * br, bool up, const bridge_link_event_t *ev)
 {
     bool changed = false;
 
@@ -196,7 +376,8 @@ static void set_br_up(bridge_t * br, bool up)
         changed = true;
     }
 
-    if(check_mac_address(br->sysdeps.name, br->sysdeps.macaddr))
+    if(check_mac_address(br->sysdeps.name, br->sysdeps.macaddr,
+                         ev ? ev->macaddr : NULL))
     {
         /* MAC address changed */
         /* Notify bridge address change */
@@ -207,18 +388,20 @@ static void set_br_up(bridge_t * br, bool up)
         MSTP_IN_set_bridge_enable(br, br->sysdeps.up);
 }
 
-static void set_if_up(port_t *prt, bool up)
+/* ev is the link event of the port, NULL if there is none */
+static void set_if_up(port_t *prt, bool up, const bridge_link_event_t *ev)
 {
     INFO("Port %s : %s", prt->sysdeps.name, (up ? "up" : "down"));
     int speed = -1;
     int duplex = -1;
     bool changed = false;
 
-    if(check_mac_address(prt->sysdeps.name, prt->sysdeps.macaddr))
+    if(check_mac_address(prt->sysdeps.name, prt->sysdeps.macaddr,
+                         ev ? ev->macaddr : NULL))
     {
         /* MAC address changed */
         if(check_mac_address(prt->bridge->sysdeps.name,
-           prt->bridge->sysdeps.macaddr))
+           prt->bridge->sysdeps.macaddr, NULL))
         {
             /* Notify bridge address change */
             MSTP_IN_set_bridge_address(prt->bridge,
@@ -236,21 +419,28 @@ static void set_if_up(port_t *prt, bool up)
     }
     else
     { /* Up */
-        int r = ethtool_get_speed_duplex(prt->sysdeps.name, &speed, &duplex);
-        if((r < 0) || (speed < 0))
-            speed = 10;
-        if((r < 0) || (duplex < 0))
-            duplex = 0; /* Assume half duplex */
-
-        if(speed != prt->sysdeps.speed)
-        {
-            prt->sysdeps.speed = speed;
-            changed = true;
-        }
-        if(duplex != prt->sysdeps.duplex)
+        /* Speed and duplex are renegotiated along with the carrier, so
+         * they are not read again on the link events of a running port
+         * (e.g. the ones caused by our own port state changes) */
+        if(!ev || !prt->sysdeps.up)
         {
-            prt->sysdeps.duplex = duplex;
-            changed = true;
+            int r = ethtool_get_speed_duplex(prt->sysdeps.name,
+                                             &speed, &duplex);
+            if((r < 0) || (speed < 0))
+                speed = 10;
+            if((r < 0) || (duplex < 0))
+                duplex = 0; /* Assume half duplex */
+
+            if(speed != prt->sysdeps.speed)
+            {
+                prt->sysdeps.speed = speed;
+                changed = true;
+            }
+            if(duplex != prt->sysdeps.duplex)
+            {
+                prt->sysdeps.duplex = duplex;
+                changed = true;
+            }
         }
         if(!prt->sysdeps.up)
         {
@@ -263,24 +453,25 @@ static void set_if_up(port_t *prt, bool up)
                                 prt->sysdeps.duplex);
 }
 
-/* br_index == if_index means: interface is bridge master */
-int bridge_notify(int br_index, int if_index, bool newlink, unsigned flags)
+/* ev->br_index == ev->if_index means: interface is bridge master */
+int bridge_notify(const bridge_link_event_t *ev)
 {
     port_t *prt;
-    bridge_t *br = NULL, *other_br;
-    bool up = !!(flags & IFF_UP);
-    bool running = up && (flags & IFF_RUNNING);
+    bridge_t *br = NULL;
+    int br_index = ev->br_index, if_index = ev->if_index;
+    bool newlink = ev->newlink;
+    bool up = !!(ev->flags & IFF_UP);
+    bool running = up && (ev->flags & IFF_RUNNING);
 
     LOG("br_index %d, if_index %d, newlink %d, up %d, running %d",
         br_index, if_index, newlink, up, running);
 
+    /* Up state and address of the bridge are tracked by its own
+     * link events, see below */
     if((br_index >= 0) && (br_index != if_index))
     {
         if(!(br = find_br(br_index)))
             return -2; /* bridge not in list */
-        int br_flags = get_flags(br->sysdeps.name);
-        if(br_flags >= 0)
-            set_br_up(br, !!(br_flags & IFF_UP));
     }
 
     if(br)
@@ -294,18 +485,14 @@ int bridge_notify(int br_index, int if_index, bool newlink, unsigned flags)
                 return -1;
             }
             /* Check if this interface is slave of another bridge */
-            list_for_each_entry(other_br, &bridges, list)
+            if((prt = find_port(if_index)))
             {
-                if(other_br != br)
-                    if(delete_if_byindex(other_br, if_index))
-                    {
-                        INFO("Device %d has come to bridge %d. "
-                             "Missed notify for deletion from bridge %d",
-                             if_index, br_index, other_br->sysdeps.if_index);
-                        break;
-                    }
+                INFO("Device %d has come to bridge %d. "
+                     "Missed notify for deletion from bridge %d",
+                     if_index, br_index, prt->bridge->sysdeps.if_index);
+                delete_if(prt);
             }
-            prt = create_if(br, if_index);
+            prt = create_if(br, if_index, ev);
         }
         if(!prt)
         {
@@ -318,7 +505,7 @@ int bridge_notify(int br_index, int if_index, bool newlink, unsigned flags)
             delete_if(prt);
             return 0;
         }
-        set_if_up(prt, running); /* And speed and duplex */
+        set_if_up(prt, running, ev); /* And speed and duplex */
     }
     else
     { /* Interface is not a bridge slave */
@@ -327,11 +514,8 @@ int bridge_notify(int br_index, int if_index, bool newlink, unsigned flags)
             /* DELLINK not from bridge means interface unregistered. */
             /* Cleanup removed bridge or removed bridge slave */
             if(!delete_br_byindex(if_index))
-                list_for_each_entry(br, &bridges, list)
-                {
-                    if(delete_if_byindex(br, if_index))
-                        break;
-                }
+                if((prt = find_port(if_index)))
+                    delete_if(prt);
             return 0;
         }
         else
@@ -340,7 +524,7 @@ int bridge_notify(int br_index, int if_index, bool newlink, unsigned flags)
             {
                 if(!(br = find_br(br_index)))
                     return -2; /* bridge not in list */
-                set_br_up(br, up);
+                set_br_up(br, up, ev);
             }
         }
     }
@@ -370,22 +554,14 @@ static const __u8 bridge_group_address[ETH_ALEN] =
 
 void bridge_bpdu_rcv(int if_index, const unsigned char *data, int len)
 {
-    port_t *prt = NULL;
-    bridge_t *br;
+    port_t *prt;
 
     LOG("ifindex %d, len %d", if_index, len);
 
-    list_for_each_entry(br, &bridges, list)
-    {
-        if((prt = find_if(br, if_index)))
-            break;
-    }
-    if(!prt)
+    if(!(prt = find_port(if_index)))
         return;
 
     /* sanity checks */
-    TSTM(br == prt->bridge,, "Bridge mismatch. This bridge is '%s' but port "
-        "'%s' belongs to bridge '%s'", br->sysdeps.name, prt->bridge->sysdeps.name);
     TSTM(prt->sysdeps.up,, "Port '%s' should be up", prt->sysdeps.name);
 
     /* Validate Ethernet and LLC header,
@@ -407,10 +583,21 @@ void bridge_bpdu_rcv(int if_index, const unsigned char *data, int len)
 
     MSTP_IN_rx_bpdu(prt,
                     /* Don't include LLC header */
-                    (bpdu_t *)(data + sizeof(*h)), l - LLC_PDU_LEN_U);
+                    (const bpdu_t *)(data + sizeof(*h)), l - LLC_PDU_LEN_U);
 }
 
-static int br_set_state(struct rtnl_handle *rth, unsigned ifindex, __u8 state)
+void bridge_bpdu_tx_failed(int if_index)
+{
+    port_t *prt;
+
+    if(!(prt = find_port(if_index)))
+        return;
+
+    /* The queue can be flushed by a worker thread running another bridge */
+    __atomic_fetch_add(&prt->num_tx_failed, 1, __ATOMIC_RELAXED);
+}
+
+static int br_set_state(unsigned ifindex, __u8 state)
 {
     struct
     {
@@ -429,33 +616,331 @@ static int br_set_state(struct rtnl_handle *rth, unsigned ifindex, __u8 state)
 
     addattr8(&req.n, sizeof(req.buf), IFLA_PROTINFO, state);
 
-    return rtnl_talk(rth, &req.n, 0, 0, NULL, NULL, NULL);
+    return br_nl_request(&req.n, BR_NL_PORT_STATE, ifindex, state);
 }
 
-static int br_flush_port(char *ifname)
+static int br_flush_port(unsigned ifindex)
 {
-    char fname[128];
-    snprintf(fname, sizeof(fname), SYSFS_CLASS_NET "/%s/brport/flush", ifname);
-    int fd = open(fname, O_WRONLY);
-    TSTM(0 <= fd, -1, "Couldn't open flush file %s for write: %m", fname);
-    int write_result = write(fd, "1", 1);
-    close(fd);
-    TST(1 == write_result, -1);
-    return 0;
+    struct
+    {
+        struct nlmsghdr n;
+        struct ifinfomsg ifi;
+        char buf[64];
+    } req;
+    struct rtattr *protinfo;
+
+    memset(&req, 0, sizeof(req));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.n.nlmsg_type = RTM_SETLINK;
+    req.ifi.ifi_family = AF_BRIDGE;
+    req.ifi.ifi_index = ifindex;
+
+    if(!(protinfo = addattr_nest(&req.n, sizeof(req),
+                                 IFLA_PROTINFO | NLA_F_NESTED)))
+        return -1;
+    addattr_l(&req.n, sizeof(req), IFLA_BRPORT_FLUSH, NULL, 0);
+    addattr_nest_end(&req.n, protinfo);
+
+    return br_nl_request(&req.n, BR_NL_PORT_FLUSH, ifindex, 0);
 }
 
-static int br_set_ageing_time(char *brname, unsigned int ageing_time)
+/* Set when the kernel refuses bulk FDB deletion (it is there since 5.19),
+ * then whole ports are flushed instead of VLANs */
+static bool fdb_bulk_unsupported;
+
+/* Each per-VLAN flush walks the whole kernel FDB, so trees with more VLANs
+ * than this flush the whole port in one go */
+#define FDB_FLUSH_MAX_VLANS 64
+
+/* Flush the dynamic entries of the given VLAN on the port */
+static int br_flush_port_vlan(unsigned ifindex, __u16 vid)
 {
-    char fname[128], str_time[32];
-    snprintf(fname, sizeof(fname), SYSFS_CLASS_NET "/%s/bridge/ageing_time",
-             brname);
-    int fd = open(fname, O_WRONLY);
-    TSTM(0 <= fd, -1, "Couldn't open file %s for write: %m", fname);
-    int len = sprintf(str_time, "%u", ageing_time * HZ);
-    int write_result = write(fd, str_time, len);
-    close(fd);
-    TST(len == write_result, -1);
-    return 0;
+    struct
+    {
+        struct nlmsghdr n;
+        struct ndmsg ndm;
+        char buf[64];
+    } req;
+    __u16 state_mask = NUD_PERMANENT | NUD_NOARP;
+
+    memset(&req, 0, sizeof(req));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+    req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_BULK;
+    req.n.nlmsg_type = RTM_DELNEIGH;
+    req.ndm.ndm_family = AF_BRIDGE;
+    req.ndm.ndm_ifindex = ifindex;
+    req.ndm.ndm_flags = NTF_MASTER;
+    /* ndm_state == 0 under this mask means "neither local nor static",
+     * same entries as IFLA_BRPORT_FLUSH removes */
+    req.ndm.ndm_state = 0;
+    addattr_l(&req.n, sizeof(req), NDA_NDM_STATE_MASK,
+              &state_mask, sizeof(state_mask));
+    addattr_l(&req.n, sizeof(req), NDA_VLAN, &vid, sizeof(vid));
+
+    return br_nl_request(&req.n, BR_NL_PORT_FLUSH, ifindex, vid);
+}
+
+static int br_set_ageing_time(unsigned ifindex, unsigned int ageing_time)
+{
+    struct
+    {
+        struct nlmsghdr n;
+        struct ifinfomsg ifi;
+        char buf[128];
+    } req;
+    struct rtattr *linkinfo, *data;
+
+    memset(&req, 0, sizeof(req));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.n.nlmsg_type = RTM_NEWLINK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = ifindex;
+
+    if(!(linkinfo = addattr_nest(&req.n, sizeof(req), IFLA_LINKINFO)))
+        return -1;
+    addattr_l(&req.n, sizeof(req), IFLA_INFO_KIND, "bridge", strlen("bridge"));
+    if(!(data = addattr_nest(&req.n, sizeof(req), IFLA_INFO_DATA)))
+        return -1;
+    /* In clock_t units, same as in sysfs */
+    addattr32(&req.n, sizeof(req), IFLA_BR_AGEING_TIME, ageing_time * HZ);
+    addattr_nest_end(&req.n, data);
+    addattr_nest_end(&req.n, linkinfo);
+
+    return br_nl_request(&req.n, BR_NL_AGEING_TIME, ifindex, ageing_time);
+}
+
+/* Kernel bridge in MST mode (Linux 5.18+) keeps a state per port per MSTI,
+ * the VLANs take the state of the MSTI they are mapped to */
+static int br_set_mst_enabled(unsigned ifindex)
+{
+    struct
+    {
+        struct nlmsghdr n;
+        struct ifinfomsg ifi;
+        char buf[128];
+    } req;
+    struct rtattr *linkinfo, *data;
+    struct br_boolopt_multi bm;
+
+    memset(&req, 0, sizeof(req));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.n.nlmsg_type = RTM_NEWLINK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = ifindex;
+
+    bm.optval = bm.optmask = 1 << BR_BOOLOPT_MST_ENABLE;
+
+    if(!(linkinfo = addattr_nest(&req.n, sizeof(req), IFLA_LINKINFO)))
+        return -1;
+    addattr_l(&req.n, sizeof(req), IFLA_INFO_KIND, "bridge", strlen("bridge"));
+    if(!(data = addattr_nest(&req.n, sizeof(req), IFLA_INFO_DATA)))
+        return -1;
+    addattr_l(&req.n, sizeof(req), IFLA_BR_MULTI_BOOLOPT, &bm, sizeof(bm));
+    addattr_nest_end(&req.n, data);
+    addattr_nest_end(&req.n, linkinfo);
+
+    return br_nl_request(&req.n, BR_NL_MST_ENABLE, ifindex, 0);
+}
+
+static int br_set_vlan_msti(unsigned ifindex, __u16 vid, __u16 mstid)
+{
+    struct
+    {
+        struct nlmsghdr n;
+        struct br_vlan_msg bvm;
+        char buf[64];
+    } req;
+    struct rtattr *opts;
+
+    memset(&req, 0, sizeof(req));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct br_vlan_msg));
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.n.nlmsg_type = RTM_NEWVLAN;
+    req.bvm.family = AF_BRIDGE;
+    req.bvm.ifindex = ifindex;
+
+    if(!(opts = addattr_nest(&req.n, sizeof(req),
+                             BRIDGE_VLANDB_GLOBAL_OPTIONS | NLA_F_NESTED)))
+        return -1;
+    addattr_l(&req.n, sizeof(req), BRIDGE_VLANDB_GOPTS_ID, &vid, sizeof(vid));
+    addattr_l(&req.n, sizeof(req), BRIDGE_VLANDB_GOPTS_MSTI,
+              &mstid, sizeof(mstid));
+    addattr_nest_end(&req.n, opts);
+
+    return br_nl_request(&req.n, BR_NL_VLAN_MSTI, ifindex, vid);
+}
+
+/* States of all the MSTIs of the port go in one request */
+static int br_set_msti_states(port_t *prt)
+{
+    struct
+    {
+        struct nlmsghdr n;
+        struct ifinfomsg ifi;
+        char buf[64 + 32 * MAX_IMPLEMENTATION_MSTIS];
+    } req;
+    struct rtattr *afspec, *mst, *entry;
+    per_tree_port_t *ptp;
+    __u16 mstid;
+    int num_mstis = 0;
+
+    memset(&req, 0, sizeof(req));
+
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.n.nlmsg_type = RTM_SETLINK;
+    req.ifi.ifi_family = AF_BRIDGE;
+    req.ifi.ifi_index = prt->sysdeps.if_index;
+
+    if(!(afspec = addattr_nest(&req.n, sizeof(req),
+                               IFLA_AF_SPEC | NLA_F_NESTED)))
+        return -1;
+    if(!(mst = addattr_nest(&req.n, sizeof(req),
+                            IFLA_BRIDGE_MST | NLA_F_NESTED)))
+        return -1;
+    list_for_each_entry(ptp, &prt->trees, port_list)
+    {
+        if(0 == ptp->MSTID)
+            continue; /* CIST state is the port state, see br_set_state() */
+        if(!(entry = addattr_nest(&req.n, sizeof(req),
+                                  IFLA_BRIDGE_MST_ENTRY | NLA_F_NESTED)))
+            return -1;
+        mstid = __be16_to_cpu(ptp->MSTID);
+        addattr_l(&req.n, sizeof(req), IFLA_BRIDGE_MST_ENTRY_MSTI,
+                  &mstid, sizeof(mstid));
+        addattr8(&req.n, sizeof(req), IFLA_BRIDGE_MST_ENTRY_STATE,
+                 ptp->state);
+        addattr_nest_end(&req.n, entry);
+        ++num_mstis;
+    }
+    addattr_nest_end(&req.n, mst);
+    addattr_nest_end(&req.n, afspec);
+
+    if(!num_mstis)
+        return 0;
+    return br_nl_request(&req.n, BR_NL_MSTI_STATES, prt->sysdeps.if_index, 0);
+}
+
+/* Program the MSTI states changed by MSTP_OUT_set_state() since the last
+ * call, one request per port. Called from the main thread only */
+static void br_program_msti_states(void)
+{
+    bridge_t *br;
+    port_t *prt;
+    bool all;
+
+    list_for_each_entry(br, &bridges, list)
+    {
+        if(!br->sysdeps.msti_states_changed && !br->sysdeps.vid2mstid_changed)
+            continue;
+        all = br->sysdeps.vid2mstid_changed;
+        br->sysdeps.msti_states_changed = false;
+        br->sysdeps.vid2mstid_changed = false;
+        if(!__atomic_load_n(&br->sysdeps.mst_offload, __ATOMIC_RELAXED))
+            continue;
+        list_for_each_entry(prt, &br->ports, br_list)
+        {
+            if(!all && !prt->sysdeps.msti_states_changed)
+                continue;
+            prt->sysdeps.msti_states_changed = false;
+            if(0 > br_set_msti_states(prt))
+                ERROR_PRTNAME(br, prt,
+                              "Couldn't set kernel bridge MSTI states");
+        }
+    }
+}
+
+static const char *br_state_names[] =
+{
+    [BR_STATE_DISABLED] = "disabled",
+    [BR_STATE_LISTENING] = "listening",
+    [BR_STATE_LEARNING] = "learning",
+    [BR_STATE_FORWARDING] = "forwarding",
+    [BR_STATE_BLOCKING] = "blocking",
+};
+
+void bridge_nl_request_failed(br_nl_req_t type, int if_index, int arg,
+                              int err)
+{
+    port_t *prt;
+    bridge_t *br;
+
+    /* Port or bridge could have gone meanwhile */
+    switch(type)
+    {
+        case BR_NL_PORT_STATE:
+            if(!(prt = find_port(if_index)))
+                break;
+            ERROR_PRTNAME(prt->bridge, prt,
+                          "Couldn't set kernel bridge state %s: %s",
+                          (BR_STATE_BLOCKING >= arg) ?
+                            br_state_names[arg] : "unknown",
+                          strerror(err));
+            break;
+        case BR_NL_PORT_FLUSH:
+            if(arg && (ENODEV == err)) /* VLAN is not on the port */
+                break;
+            if(arg && ((EOPNOTSUPP == err) || (EINVAL == err))
+               && !__atomic_exchange_n(&fdb_bulk_unsupported, true,
+                                       __ATOMIC_RELAXED))
+                ERROR("Kernel can't flush forwarding database by VLAN: %s. "
+                      "Whole ports will be flushed", strerror(err));
+            if(!(prt = find_port(if_index)))
+                break;
+            if(arg)
+                ERROR_PRTNAME(prt->bridge, prt,
+                              "Couldn't flush kernel bridge forwarding "
+                              "database for VLAN %d: %s", arg, strerror(err));
+            else
+                ERROR_PRTNAME(prt->bridge, prt,
+                              "Couldn't flush kernel bridge forwarding "
+                              "database: %s", strerror(err));
+            break;
+        case BR_NL_AGEING_TIME:
+            if(!(br = find_br(if_index)))
+                break;
+            ERROR_BRNAME(br, "Couldn't set ageing time %d in kernel bridge: "
+                         "%s", arg, strerror(err));
+            break;
+        case BR_NL_MST_ENABLE:
+            if(!(br = find_br(if_index)))
+                break;
+            /* Not an error: the kernel refuses to change MST mode
+             * while STP is on or the ports have VLANs, so it has to be
+             * enabled by the administrator beforehand (mst_enabled) */
+            __atomic_store_n(&br->sysdeps.mst_offload, false,
+                             __ATOMIC_RELAXED);
+            INFO_BRNAME(br, "Kernel bridge is not in MST mode (%s), "
+                        "MSTI states are not programmed into it",
+                        strerror(err));
+            break;
+        case BR_NL_VLAN_MSTI:
+            if(ENOENT == err) /* VLAN is not configured on the bridge */
+                break;
+            if(!(br = find_br(if_index))
+               || !__atomic_load_n(&br->sysdeps.mst_offload, __ATOMIC_RELAXED))
+                break;
+            ERROR_BRNAME(br, "Couldn't map VLAN %d to MSTI in kernel bridge: "
+                         "%s", arg, strerror(err));
+            break;
+        case BR_NL_MSTI_STATES:
+            if(!(prt = find_port(if_index))
+               || !__atomic_load_n(&prt->bridge->sysdeps.mst_offload,
+                                   __ATOMIC_RELAXED))
+                break;
+            ERROR_PRTNAME(prt->bridge, prt,
+                          "Couldn't set kernel bridge MSTI states: %s",
+                          strerror(err));
+            break;
+    }
 }
 
 /* External actions for MSTP protocol */
@@ -493,13 +978,35 @@ void MSTP_OUT_set_state(per_tree_port_t *ptp, int new_state)
     }
     INFO_MSTINAME(br, prt, ptp, "entering %s state", state_name);
 
-    /* Translate new CIST state to the kernel bridge code */
+    /* Translate new CIST state to the kernel bridge code.
+     * The request is sent from the main loop, see br_nl_request() */
     if(0 == ptp->MSTID)
     { /* CIST */
-        if(0 > br_set_state(&rth_state, prt->sysdeps.if_index, ptp->state))
+        if(0 > br_set_state(prt->sysdeps.if_index, ptp->state))
             ERROR_PRTNAME(br, prt, "Couldn't set kernel bridge state %s",
                           state_name);
     }
+    else if(__atomic_load_n(&br->sysdeps.mst_offload, __ATOMIC_RELAXED))
+    { /* MSTI: the MSTIs of a port can run in parallel, their states are
+       * programmed together after the run, see br_program_msti_states() */
+        __atomic_store_n(&prt->sysdeps.msti_states_changed, true,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&br->sysdeps.msti_states_changed, true,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+void MSTP_OUT_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
+{
+    if(!__atomic_load_n(&br->sysdeps.mst_offload, __ATOMIC_RELAXED))
+        return;
+    if(0 > br_set_vlan_msti(br->sysdeps.if_index, vid, mstid))
+        ERROR_BRNAME(br, "Couldn't map VLAN %hu to MSTI %hu in kernel bridge",
+                     vid, mstid);
+    /* A VLAN takes the state of its new MSTI in the kernel only if some
+     * other VLAN of the port is already in that MSTI, so program the
+     * states again */
+    br->sysdeps.vid2mstid_changed = true;
 }
 
 /* This function initiates process of flushing
@@ -512,14 +1019,31 @@ void MSTP_OUT_flush_all_fids(per_tree_port_t * ptp)
 {
     port_t *prt = ptp->port;
     bridge_t *br = prt->bridge;
+    __u16 vids[FDB_FLUSH_MAX_VLANS];
+    int i, num_vids, r;
 
-    /* Translate CIST flushing to the kernel bridge code */
-    if(0 == ptp->MSTID)
-    { /* CIST */
-        if(0 > br_flush_port(prt->sysdeps.name))
-            ERROR_PRTNAME(br, prt,
-                          "Couldn't flush kernel bridge forwarding database");
+    /* Translate flushing to the kernel bridge code. Only the VLANs
+     * allocated to the tree are flushed, so that other trees don't have
+     * to relearn. The trees with many VLANs (e.g. the CIST when there
+     * are no MSTIs) flush whole port.
+     */
+    num_vids = MSTP_IN_get_tree_vids(br, ptp->MSTID, vids,
+                                     FDB_FLUSH_MAX_VLANS);
+    if(!num_vids)
+        r = 0;
+    else if((FDB_FLUSH_MAX_VLANS < num_vids)
+            || __atomic_load_n(&fdb_bulk_unsupported, __ATOMIC_RELAXED))
+        r = br_flush_port(prt->sysdeps.if_index);
+    else
+    {
+        r = 0;
+        for(i = 0; i < num_vids; ++i)
+            if(0 > (r = br_flush_port_vlan(prt->sysdeps.if_index, vids[i])))
+                break;
     }
+    if(0 > r)
+        ERROR_PRTNAME(br, prt,
+                      "Couldn't flush kernel bridge forwarding database");
     /* Completion signal MSTP_IN_all_fids_flushed will be called by driver */
     INFO_MSTINAME(br, prt, ptp, "Flushing forwarding database");
     driver_flush_all_fids(ptp);
@@ -538,7 +1062,7 @@ void MSTP_OUT_set_ageing_time(port_t *prt, unsigned int ageingTime)
      * Kernel bridging code does not support per-port ageing time,
      * so set ageing time for the whole bridge.
      */
-    if(0 > br_set_ageing_time(br->sysdeps.name, actual_ageing_time))
+    if(0 > br_set_ageing_time(br->sysdeps.if_index, actual_ageing_time))
         ERROR_BRNAME(br, "Couldn't set new ageing time in kernel bridge");
 }
 
@@ -784,7 +1308,7 @@ int CTL_delete_msti(int br_index, __u16 mstid)
 int CTL_get_mstconfid(int br_index, mst_configuration_identifier_t *cfg)
 {
     CTL_CHECK_BRIDGE;
-    *cfg = br->MstConfigId;
+    MSTP_IN_get_mst_config_id(br, cfg);
     return 0;
 }
 
@@ -835,10 +1359,249 @@ int CTL_set_fids2mstids(int br_index, __u16 *fids2mstids)
     return MSTP_IN_set_all_fids2mstids(br, fids2mstids) ? 0 : -1;
 }
 
+/* Check the operations of the batch in order against the configuration
+ * they will see when applied, so that a bad batch is rejected before
+ * anything is changed */
+static bool check_config_batch(bridge_t *br, int num_ops, config_op_t *ops)
+{
+    bool msti_exists[MAX_MSTID + 1];
+    __u16 fid2mstid[MAX_FID + 1];
+    __u8 max_age, forward_delay;
+    int i, fid, num_mstis;
+    tree_t *tree;
+    port_t *prt;
+    config_op_t *op;
+
+    max_age = br->Max_Age;
+    forward_delay = br->Forward_Delay;
+    memset(msti_exists, 0, sizeof(msti_exists));
+    num_mstis = 0;
+    list_for_each_entry(tree, &br->trees, bridge_list)
+    {
+        msti_exists[__be16_to_cpu(tree->MSTID)] = true;
+        ++num_mstis;
+    }
+    for(fid = 0; fid <= MAX_FID; ++fid)
+        fid2mstid[fid] = __be16_to_cpu(br->fid2mstid[fid]);
+
+    for(i = 0, op = ops; i < num_ops; ++i, ++op)
+    {
+        switch(op->type)
+        {
+            case CONFIG_OP_cist_bridge:
+                if(MSTP_IN_check_cist_bridge_config(br, &op->cist_bridge,
+                                                    &max_age, &forward_delay))
+                    return false;
+                break;
+            case CONFIG_OP_mstconfid:
+                break;
+            case CONFIG_OP_msti_bridge:
+                if((MAX_MSTID < op->mstid) || !msti_exists[op->mstid])
+                {
+                    ERROR_BRNAME(br, "Couldn't find MSTI with ID %hu",
+                                 op->mstid);
+                    return false;
+                }
+                if(15 < op->bridge_priority)
+                {
+                    ERROR_BRNAME(br, "MSTI %hu: Bridge Priority must be "
+                                 "between 0 and 15", op->mstid);
+                    return false;
+                }
+                break;
+            case CONFIG_OP_cist_port:
+            case CONFIG_OP_msti_port:
+                if(NULL == (prt = find_if(br, op->port_index)))
+                {
+                    ERROR_BRNAME(br, "Couldn't find port with index %d",
+                                 op->port_index);
+                    return false;
+                }
+                if(CONFIG_OP_cist_port == op->type)
+                {
+                    if(MSTP_IN_check_cist_port_config(prt, &op->cist_port))
+                        return false;
+                    break;
+                }
+                if((MAX_MSTID < op->mstid) || !msti_exists[op->mstid])
+                {
+                    ERROR_BRNAME(br, "Couldn't find MSTI with ID %hu",
+                                 op->mstid);
+                    return false;
+                }
+                if(MSTP_IN_check_msti_port_config(prt, op->mstid,
+                                                  &op->msti_port))
+                    return false;
+                break;
+            case CONFIG_OP_create_msti:
+                if((1 > op->mstid) || (MAX_MSTID < op->mstid))
+                {
+                    ERROR_BRNAME(br, "Bad MSTID(%hu)", op->mstid);
+                    return false;
+                }
+                if(msti_exists[op->mstid])
+                    break;
+                /* Check for "<", not for "<=", as num_mstis include CIST */
+                if(MAX_IMPLEMENTATION_MSTIS < num_mstis)
+                {
+                    ERROR_BRNAME(br,
+                        "Can't add MSTID(%hu): maximum count(%u) reached",
+                        op->mstid, MAX_IMPLEMENTATION_MSTIS);
+                    return false;
+                }
+                msti_exists[op->mstid] = true;
+                ++num_mstis;
+                break;
+            case CONFIG_OP_delete_msti:
+                if((1 > op->mstid) || (MAX_MSTID < op->mstid))
+                {
+                    ERROR_BRNAME(br, "Bad MSTID(%hu)", op->mstid);
+                    return false;
+                }
+                for(fid = 0; fid <= MAX_FID; ++fid)
+                {
+                    if(fid2mstid[fid] == op->mstid)
+                    {
+                        ERROR_BRNAME(br, "Can't delete MSTID(%hu): "
+                                     "there are FIDs allocated to it",
+                                     op->mstid);
+                        return false;
+                    }
+                }
+                if(msti_exists[op->mstid])
+                {
+                    msti_exists[op->mstid] = false;
+                    --num_mstis;
+                }
+                break;
+            case CONFIG_OP_vids2fid:
+                if((1 > op->first) || (op->first > op->last)
+                   || (MAX_VID < op->last) || (MAX_FID < op->value))
+                {
+                    ERROR_BRNAME(br, "Error allocating VIDs(%hu-%hu) "
+                                 "to FID(%hu)", op->first, op->last,
+                                 op->value);
+                    return false;
+                }
+                break;
+            case CONFIG_OP_fids2mstid:
+                if((op->first > op->last) || (MAX_FID < op->last))
+                {
+                    ERROR_BRNAME(br, "Bad FIDs(%hu-%hu)",
+                                 op->first, op->last);
+                    return false;
+                }
+                if((MAX_MSTID < op->value) || !msti_exists[op->value])
+                {
+                    ERROR_BRNAME(br, "MSTID(%hu) not found", op->value);
+                    return false;
+                }
+                for(fid = op->first; fid <= op->last; ++fid)
+                    fid2mstid[fid] = op->value;
+                break;
+            default:
+                ERROR_BRNAME(br, "Bad configuration operation %d", op->type);
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static int apply_config_op(bridge_t *br, config_op_t *op)
+{
+    __be16 MSTID = __cpu_to_be16(op->mstid);
+    tree_t *tree;
+    port_t *prt;
+    per_tree_port_t *ptp;
+    int i;
+
+    switch(op->type)
+    {
+        case CONFIG_OP_cist_bridge:
+            return MSTP_IN_set_cist_bridge_config(br, &op->cist_bridge);
+        case CONFIG_OP_msti_bridge:
+            list_for_each_entry(tree, &br->trees, bridge_list)
+                if(tree->MSTID == MSTID)
+                    return MSTP_IN_set_msti_bridge_config(tree,
+                                                          op->bridge_priority);
+            return -1;
+        case CONFIG_OP_cist_port:
+            if(NULL == (prt = find_if(br, op->port_index)))
+                return -1;
+            return MSTP_IN_set_cist_port_config(prt, &op->cist_port);
+        case CONFIG_OP_msti_port:
+            if(NULL == (prt = find_if(br, op->port_index)))
+                return -1;
+            list_for_each_entry(ptp, &prt->trees, port_list)
+                if(ptp->MSTID == MSTID)
+                    return MSTP_IN_set_msti_port_config(ptp, &op->msti_port);
+            return -1;
+        case CONFIG_OP_create_msti:
+            if((!driver_create_msti(br, op->mstid))
+               || (!MSTP_IN_create_msti(br, op->mstid)))
+                return -1;
+            return 0;
+        case CONFIG_OP_delete_msti:
+            if((!driver_delete_msti(br, op->mstid))
+               || (!MSTP_IN_delete_msti(br, op->mstid)))
+                return -1;
+            return 0;
+        case CONFIG_OP_mstconfid:
+            op->mstconfid.name[CONFIGURATION_NAME_LEN] = '\0';
+            MSTP_IN_set_mst_config_id(br, op->mstconfid.revision,
+                                      op->mstconfid.name);
+            return 0;
+        case CONFIG_OP_vids2fid:
+            for(i = op->first; i <= op->last; ++i)
+                if(!MSTP_IN_set_vid2fid(br, i, op->value))
+                    return -1;
+            return 0;
+        case CONFIG_OP_fids2mstid:
+            for(i = op->first; i <= op->last; ++i)
+                if(!MSTP_IN_set_fid2mstid(br, i, op->value))
+                    return -1;
+            return 0;
+    }
+
+    return -1;
+}
+
+int CTL_set_config_batch(int br_index, int num_ops, config_op_t *ops)
+{
+    CTL_CHECK_BRIDGE;
+    int i, r = 0;
+
+    if((0 > num_ops) || (MAX_CONFIG_BATCH_OPS < num_ops))
+    {
+        ERROR_BRNAME(br, "Bad number of configuration operations %d",
+                     num_ops);
+        return -1;
+    }
+    if(!check_config_batch(br, num_ops, ops))
+        return -1;
+
+    /* State machines are restarted (or run) once, on commit */
+    MSTP_IN_config_begin(br);
+    for(i = 0; i < num_ops; ++i)
+    {
+        if((r = apply_config_op(br, &ops[i])))
+        {
+            ERROR_BRNAME(br, "Configuration operation %d of %d failed, "
+                         "the rest of the batch is not applied",
+                         i + 1, num_ops);
+            break;
+        }
+    }
+    MSTP_IN_config_commit(br);
+
+    return r;
+}
+
 int CTL_add_bridges(int *br_array, int* *ifaces_lists)
 {
     int i, j, ifcount, brcount = br_array[0];
-    bridge_t *br, *other_br;
+    bridge_t *br;
     port_t *prt, *nxt;
     int br_flags, if_flags;
     int *if_array;
@@ -854,8 +1617,12 @@ int CTL_add_bridges(int *br_array, int* *ifaces_lists)
                       br_array[i]);
                 return -1;
             }
+            /* Offload MSTIs if the kernel bridge is in MST mode,
+             * the failure of the request turns the offload off */
+            br->sysdeps.mst_offload =
+                (0 <= br_set_mst_enabled(br->sysdeps.if_index));
             if(0 <= (br_flags = get_flags(br->sysdeps.name)))
-                set_br_up(br, !!(br_flags & IFF_UP));
+                set_br_up(br, !!(br_flags & IFF_UP), NULL);
         }
         if_array = ifaces_lists[i - 1];
         ifcount = if_array[0];
@@ -880,19 +1647,15 @@ int CTL_add_bridges(int *br_array, int* *ifaces_lists)
             if(NULL != find_if(br, if_array[j]))
                 continue;
             /* Check if this interface is slave of another bridge */
-            list_for_each_entry(other_br, &bridges, list)
+            if((prt = find_port(if_array[j])))
             {
-                if(other_br != br)
-                    if(delete_if_byindex(other_br, if_array[j]))
-                    {
-                        INFO("Device %d has come to bridge %s. "
-                             "Missed notify for deletion from bridge %s",
-                             if_array[j], br->sysdeps.name,
-                             other_br->sysdeps.name);
-                        break;
-                    }
+                INFO("Device %d has come to bridge %s. "
+                     "Missed notify for deletion from bridge %s",
+                     if_array[j], br->sysdeps.name,
+                     prt->bridge->sysdeps.name);
+                delete_if(prt);
             }
-            if(NULL == (prt = create_if(br, if_array[j])))
+            if(NULL == (prt = create_if(br, if_array[j], NULL)))
             {
                 INFO("Couldn't create data for interface %d (master %s)",
                      if_array[j], br->sysdeps.name);
@@ -900,8 +1663,8 @@ int CTL_add_bridges(int *br_array, int* *ifaces_lists)
             }
             if(0 <= (if_flags = get_flags(prt->sysdeps.name)))
                 set_if_up(prt, (IFF_UP | IFF_RUNNING) ==
-                               (if_flags & (IFF_UP | IFF_RUNNING))
-                         );
+                               (if_flags & (IFF_UP | IFF_RUNNING)),
+                          NULL);
         }
     }
 
@@ -924,7 +1687,13 @@ int bridge_track_fini(void)
     bridge_t *br;
     list_for_each_entry(br, &bridges, list)
     {
-        set_br_up(br, false);
+        set_br_up(br, false, NULL);
     }
+    br_program_msti_states();
+    br_nl_flush();
+
+    free(if_table);
+    if_table = NULL;
+    if_table_size = if_table_count = 0;
     return 0;
 }
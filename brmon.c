@@ -15,7 +15,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <linux/if_bridge.h>
 
@@ -56,18 +60,220 @@ static const char *port_states[] =
 static struct rtnl_handle rth;
 static struct epoll_event_handler br_handler;
 
-struct rtnl_handle rth_state;
+/* Kernel bridge programming (port states and so on) goes over rth_state
+ * asynchronously: br_nl_request() queues the request, br_nl_flush() sends
+ * all the queued requests with one sendmsg() and the ACKs are read from
+ * the main loop and matched to the requests by the sequence number.
+ * The bridges can be run on the worker threads (see bridge_run_pending),
+ * hence the lock */
+#define NL_TX_BUF_LEN       (64 * 1024)
+#define NL_RX_BUF_LEN       (32 * 1024)
+/* Power of 2. ACKs of all the outstanding requests must fit into the
+ * receive buffer of the socket (see RTNL_RCV_BUFSIZE) */
+#define NL_MAX_OUTSTANDING  256
+#define NL_ACK_TIMEOUT      1000 /* ms */
+
+static struct rtnl_handle rth_state;
+static struct epoll_event_handler state_handler;
+
+static char nl_tx_buf[NL_TX_BUF_LEN] __attribute__((aligned(NLMSG_ALIGNTO)));
+static int nl_tx_len;     /* bytes queued in nl_tx_buf */
+static int nl_tx_count;   /* requests queued in nl_tx_buf */
+static int nl_outstanding; /* requests queued or waiting for the ACK */
+static char nl_rx_buf[NL_RX_BUF_LEN] __attribute__((aligned(NLMSG_ALIGNTO)));
+static pthread_mutex_t nl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Outstanding requests, indexed by seq % NL_MAX_OUTSTANDING */
+static struct br_nl_req
+{
+    __u32 seq;
+    bool outstanding;
+    br_nl_req_t type;
+    int if_index;
+    int arg;
+} nl_reqs[NL_MAX_OUTSTANDING];
+
+static inline struct br_nl_req *nl_req_slot(__u32 seq)
+{
+    return &nl_reqs[seq & (NL_MAX_OUTSTANDING - 1)];
+}
+
+static void nl_req_done(struct br_nl_req *req, int err)
+{
+    req->outstanding = false;
+    --nl_outstanding;
+    if(err)
+        bridge_nl_request_failed(req->type, req->if_index, req->arg, err);
+}
+
+static void __br_nl_flush(void)
+{
+    struct sockaddr_nl nladdr = { .nl_family = AF_NETLINK };
+    struct iovec iov = { .iov_base = nl_tx_buf, .iov_len = nl_tx_len };
+    struct msghdr msg =
+    {
+        .msg_name = &nladdr,
+        .msg_namelen = sizeof(nladdr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    __u32 seq;
+    int r;
+
+    if(!nl_tx_count)
+        return;
+
+    while(0 > (r = sendmsg(rth_state.fd, &msg, 0)) && (EINTR == errno))
+        ;
+    if(0 > r)
+    {
+        /* None of the queued requests will be ACKed */
+        r = errno;
+        ERROR("Couldn't send %d netlink requests: %m", nl_tx_count);
+        for(seq = rth_state.seq - nl_tx_count + 1;
+            seq != rth_state.seq + 1; ++seq)
+            nl_req_done(nl_req_slot(seq), r);
+    }
+    nl_tx_len = nl_tx_count = 0;
+}
+
+/* Process the ACKs which are already there. Returns -1 if the socket
+ * has overrun and the ACKs of the sent requests are lost */
+static int __br_nl_recv_acks(void)
+{
+    struct nlmsghdr *h;
+    struct nlmsgerr *err;
+    struct br_nl_req *req;
+    int len;
+
+    while(1)
+    {
+        len = recv(rth_state.fd, nl_rx_buf, sizeof(nl_rx_buf), MSG_DONTWAIT);
+        if(0 > len)
+        {
+            if(EINTR == errno)
+                continue;
+            if(EAGAIN == errno || EWOULDBLOCK == errno)
+                return 0;
+            ERROR("Error receiving netlink ACKs: %m");
+            return (ENOBUFS == errno) ? -1 : 0;
+        }
+        for(h = (struct nlmsghdr *)nl_rx_buf; NLMSG_OK(h, len);
+            h = NLMSG_NEXT(h, len))
+        {
+            if(NLMSG_ERROR != h->nlmsg_type)
+                continue;
+            req = nl_req_slot(h->nlmsg_seq);
+            if(!req->outstanding || req->seq != h->nlmsg_seq)
+                continue;
+            err = NLMSG_DATA(h);
+            if(h->nlmsg_len < NLMSG_LENGTH(sizeof(*err)))
+                nl_req_done(req, EINVAL);
+            else
+                nl_req_done(req, -err->error);
+        }
+    }
+}
+
+/* ACKs of the sent requests are lost, forget about the requests */
+static void nl_drop_sent(int err)
+{
+    __u32 first_queued = rth_state.seq - nl_tx_count + 1;
+    int i;
+
+    for(i = 0; i < NL_MAX_OUTSTANDING; ++i)
+    {
+        if(nl_reqs[i].outstanding
+           && (0 > (__s32)(nl_reqs[i].seq - first_queued)))
+            nl_req_done(&nl_reqs[i], err);
+    }
+}
+
+/* Make room for one more outstanding request */
+static void nl_wait_slot(void)
+{
+    struct pollfd pfd = { .fd = rth_state.fd, .events = POLLIN };
+    struct br_nl_req *req = nl_req_slot(rth_state.seq + 1);
+    int r;
+
+    __br_nl_flush();
+    while(req->outstanding)
+    {
+        r = poll(&pfd, 1, NL_ACK_TIMEOUT);
+        if((0 == r) || ((0 > r) && (EINTR != errno)))
+        {
+            /* The ACKs are lost, don't wait for the rest of them */
+            ERROR("Timeout waiting for netlink ACK, seq %u", req->seq);
+            nl_drop_sent(ETIMEDOUT);
+            break;
+        }
+        if(__br_nl_recv_acks())
+            nl_drop_sent(ENOBUFS);
+    }
+}
+
+int br_nl_request(struct nlmsghdr *n, br_nl_req_t type, int if_index,
+                  int arg)
+{
+    struct br_nl_req *req;
+    __u32 len = NLMSG_ALIGN(n->nlmsg_len);
+
+    if(NL_TX_BUF_LEN < len)
+    {
+        ERROR("Netlink request too long: %u", len);
+        return -1;
+    }
+
+    pthread_mutex_lock(&nl_lock);
+    if(NL_TX_BUF_LEN - nl_tx_len < len)
+        __br_nl_flush();
+    req = nl_req_slot(rth_state.seq + 1);
+    if(req->outstanding)
+        nl_wait_slot();
+
+    n->nlmsg_seq = ++rth_state.seq;
+    n->nlmsg_flags |= NLM_F_ACK;
+    memcpy(nl_tx_buf + nl_tx_len, n, n->nlmsg_len);
+    nl_tx_len += len;
+    ++nl_tx_count;
+
+    req->seq = n->nlmsg_seq;
+    req->outstanding = true;
+    req->type = type;
+    req->if_index = if_index;
+    req->arg = arg;
+    ++nl_outstanding;
+    pthread_mutex_unlock(&nl_lock);
+    return 0;
+}
+
+void br_nl_flush(void)
+{
+    pthread_mutex_lock(&nl_lock);
+    __br_nl_flush();
+    pthread_mutex_unlock(&nl_lock);
+}
+
+static void state_ev_handler(uint32_t events, struct epoll_event_handler *h)
+{
+    pthread_mutex_lock(&nl_lock);
+    if(__br_nl_recv_acks())
+        nl_drop_sent(ENOBUFS);
+    pthread_mutex_unlock(&nl_lock);
+}
 
 static int dump_msg(const struct sockaddr_nl *who, struct nlmsghdr *n,
                     void *arg)
 {
     struct ifinfomsg *ifi = NLMSG_DATA(n);
     struct rtattr * tb[IFLA_MAX + 1];
+    struct rtattr * li[IFLA_INFO_MAX + 1];
+    struct rtattr * pi[IFLA_BRPORT_MAX + 1];
     int len = n->nlmsg_len;
-    char b1[IFNAMSIZ];
     int af_family;
-    bool newlink;
-    int br_index;
+    int state = -1;
+    bool bridge;
+    bridge_link_event_t ev;
 
     if(n->nlmsg_type == NLMSG_DONE)
         return 0;
@@ -138,30 +344,57 @@ static int dump_msg(const struct sockaddr_nl *who, struct nlmsghdr *n,
         LOG("mtu %u ", *(int*)RTA_DATA(tb[IFLA_MTU]));
 
     if(tb[IFLA_MASTER])
-    {
-        LOG("master %s ",
-                if_indextoname(*(int*)RTA_DATA(tb[IFLA_MASTER]), b1));
-    }
+        LOG("master %d ", *(int*)RTA_DATA(tb[IFLA_MASTER]));
+
+    /* Everything bridge_notify() needs is taken from the message,
+     * so that a storm of link events costs no extra syscalls */
+    ev.if_index = ifi->ifi_index;
+    ev.newlink = (n->nlmsg_type == RTM_NEWLINK);
+    ev.flags = ifi->ifi_flags;
+    ev.name = (char*)RTA_DATA(tb[IFLA_IFNAME]);
+    if(tb[IFLA_ADDRESS] && (ETH_ALEN == RTA_PAYLOAD(tb[IFLA_ADDRESS])))
+        ev.macaddr = RTA_DATA(tb[IFLA_ADDRESS]);
+    else
+        ev.macaddr = NULL;
+    ev.port_no = -1;
 
     if(tb[IFLA_PROTINFO])
     {
-        uint8_t state = *(uint8_t *)RTA_DATA(tb[IFLA_PROTINFO]);
-        if(state <= BR_STATE_BLOCKING)
-            LOG("state %s", port_states[state]);
+        /* Old kernels put just the port state here */
+        if(RTA_PAYLOAD(tb[IFLA_PROTINFO]) < sizeof(struct rtattr))
+            state = *(__u8*)RTA_DATA(tb[IFLA_PROTINFO]);
         else
+        {
+            parse_rtattr_nested(pi, IFLA_BRPORT_MAX, tb[IFLA_PROTINFO]);
+            if(pi[IFLA_BRPORT_STATE])
+                state = *(__u8*)RTA_DATA(pi[IFLA_BRPORT_STATE]);
+            if(pi[IFLA_BRPORT_NO])
+                ev.port_no = *(__u16*)RTA_DATA(pi[IFLA_BRPORT_NO]);
+        }
+        if((0 <= state) && (state <= BR_STATE_BLOCKING))
+            LOG("state %s", port_states[state]);
+        else if(0 <= state)
             LOG("state (%d)", state);
     }
 
-    newlink = (n->nlmsg_type == RTM_NEWLINK);
-
     if(tb[IFLA_MASTER])
-        br_index = *(int*)RTA_DATA(tb[IFLA_MASTER]);
-    else if(is_bridge((char*)RTA_DATA(tb[IFLA_IFNAME])))
-        br_index = ifi->ifi_index;
+        ev.br_index = *(int*)RTA_DATA(tb[IFLA_MASTER]);
     else
-        br_index = -1;
+    {
+        /* The kind of the link is there in all AF_UNSPEC messages */
+        if(tb[IFLA_LINKINFO])
+        {
+            parse_rtattr_nested(li, IFLA_INFO_MAX, tb[IFLA_LINKINFO]);
+            bridge = li[IFLA_INFO_KIND]
+                     && !strncmp((char*)RTA_DATA(li[IFLA_INFO_KIND]),
+                                 "bridge", RTA_PAYLOAD(li[IFLA_INFO_KIND]));
+        }
+        else
+            bridge = is_bridge((char*)RTA_DATA(tb[IFLA_IFNAME]));
+        ev.br_index = bridge ? ifi->ifi_index : -1;
+    }
 
-    bridge_notify(br_index, ifi->ifi_index, newlink, ifi->ifi_flags);
+    bridge_notify(&ev);
 
     return 0;
 }
@@ -187,6 +420,14 @@ int init_bridge_ops(void)
         ERROR("Couldn't open rtnl socket for setting state\n");
         return -1;
     }
+#ifdef NETLINK_CAP_ACK
+    {
+        /* ACKs don't need to carry the whole request back */
+        int one = 1;
+        setsockopt(rth_state.fd, SOL_NETLINK, NETLINK_CAP_ACK,
+                   &one, sizeof(one));
+    }
+#endif
 
     if(rtnl_wilddump_request(&rth, PF_BRIDGE, RTM_GETLINK) < 0)
     {
@@ -213,5 +454,12 @@ int init_bridge_ops(void)
     if(add_epoll(&br_handler) < 0)
         return -1;
 
+    state_handler.fd = rth_state.fd;
+    state_handler.arg = NULL;
+    state_handler.handler = state_ev_handler;
+
+    if(add_epoll(&state_handler) < 0)
+        return -1;
+
     return 0;
 }
@@ -461,6 +461,60 @@ CTL_DECLARE(add_bridges);
 #define del_bridges_ARGS (int *br_array)
 CTL_DECLARE(del_bridges);
 
+/* set_config_batch: the operations are checked all together and then
+ * applied as one configuration transaction (see MSTP_IN_config_begin) */
+#define MAX_CONFIG_BATCH_OPS    128
+typedef enum
+{
+    CONFIG_OP_cist_bridge,  /* cist_bridge */
+    CONFIG_OP_msti_bridge,  /* mstid, bridge_priority */
+    CONFIG_OP_cist_port,    /* port_index, cist_port */
+    CONFIG_OP_msti_port,    /* port_index, mstid, msti_port */
+    CONFIG_OP_create_msti,  /* mstid */
+    CONFIG_OP_delete_msti,  /* mstid */
+    CONFIG_OP_mstconfid,    /* mstconfid */
+    CONFIG_OP_vids2fid,     /* VIDs first..last to FID value */
+    CONFIG_OP_fids2mstid,   /* FIDs first..last to MSTID value */
+} config_op_type_t;
+
+typedef struct
+{
+    config_op_type_t type;
+    int port_index;
+    __u16 mstid;
+    __u16 first, last, value;
+    union
+    {
+        CIST_BridgeConfig cist_bridge;
+        __u8 bridge_priority;
+        CIST_PortConfig cist_port;
+        MSTI_PortConfig msti_port;
+        struct
+        {
+            __u16 revision;
+            __u8 name[CONFIGURATION_NAME_LEN + 1];
+        } mstconfid;
+    };
+} config_op_t;
+
+#define CMD_CODE_set_config_batch   124
+#define set_config_batch_ARGS (int br_index, int num_ops, config_op_t *ops)
+struct set_config_batch_IN
+{
+    int br_index;
+    int num_ops;
+    config_op_t ops[MAX_CONFIG_BATCH_OPS];
+};
+struct set_config_batch_OUT
+{
+};
+#define set_config_batch_COPY_IN  ({ in->br_index = br_index; \
+    in->num_ops = num_ops; \
+    memcpy(in->ops, ops, num_ops * sizeof(*ops)); })
+#define set_config_batch_COPY_OUT ({ (void)0; })
+#define set_config_batch_CALL (in->br_index, in->num_ops, in->ops)
+CTL_DECLARE(set_config_batch);
+
 /* General case part in ctl command server switch */
 #define SERVER_MESSAGE_CASE(name)                            \
     case CMD_CODE_ ## name : do                              \
@@ -167,6 +167,7 @@ typedef enum {
     PARAM_NUMTRANSFWD,
     PARAM_NUMTRANSBLK,
     PARAM_NUMBPDUFILTERED,
+    PARAM_NUMTXFAILED,
     PARAM_RCVDBPDU,
     PARAM_RCVDSTP,
     PARAM_RCVDRSTP,
@@ -715,6 +716,7 @@ static const cmd_param_t cist_port_params[] = {
     { PARAM_NUMTRANSFWD,    "num-transition-fwd" },
     { PARAM_NUMTRANSBLK,    "num-transition-blk" },
     { PARAM_NUMBPDUFILTERED,"num-rx-bpdu-filtered" },
+    { PARAM_NUMTXFAILED,    "num-tx-failed" },
     { PARAM_RCVDBPDU,       "received-bpdu" },
     { PARAM_RCVDSTP,        "received-stp" },
     { PARAM_RCVDRSTP,       "received-rstp" },
@@ -800,6 +802,7 @@ static int do_showport_fmt_plain(const CIST_PortStatus *s,
                 printf("Send RSTP            %s\n", BOOL_STR(s->sendRSTP));
                 printf("  Rcvd TC Ack        %-23s ", BOOL_STR(s->rcvdTcAck));
                 printf("Rcvd TCN             %s\n", BOOL_STR(s->rcvdTcn));
+                printf("  Num TX Failed      %u\n", s->num_tx_failed);
             }
             else
             {
@@ -924,6 +927,9 @@ static int do_showport_fmt_plain(const CIST_PortStatus *s,
         case PARAM_NUMBPDUFILTERED:
             printf("%u\n", s->num_rx_bpdu_filtered);
             break;
+        case PARAM_NUMTXFAILED:
+            printf("%u\n", s->num_tx_failed);
+            break;
         case PARAM_RCVDBPDU:
             printf("%s\n", BOOL_STR(s->rcvdBpdu));
             break;
@@ -1027,6 +1033,7 @@ static int do_showport_fmt_json(const CIST_PortStatus *s,
                        s->num_trans_fwd);
                 printf("\"num-transition-blk\":\"%u\",",
                        s->num_trans_blk);
+                printf("\"num-tx-failed\":\"%u\",", s->num_tx_failed);
                 printf("\"received-bpdu\":\"%s\",",
                        BOOL_STR(s->rcvdBpdu));
                 printf("\"received-stp\":\"%s\",",
@@ -1104,6 +1111,7 @@ static int do_showport_fmt_json(const CIST_PortStatus *s,
         case PARAM_NUMTRANSFWD:
         case PARAM_NUMTRANSBLK:
         case PARAM_NUMBPDUFILTERED:
+        case PARAM_NUMTXFAILED:
         case PARAM_RCVDBPDU:
         case PARAM_RCVDSTP:
         case PARAM_RCVDRSTP:
@@ -1445,6 +1453,164 @@ static int getyesno(const char *s, const char *yes, const char *no)
     return 1 - getenum(s, opt);
 }
 
+/* Configuration transaction (see the --transaction option): instead of
+ * being sent one by one, the configuration commands of the batch are
+ * queued per bridge and sent as one set_config_batch per bridge when the
+ * whole batch has been processed */
+static bool transaction;
+static struct config_batch
+{
+    struct config_batch *next;
+    int br_index;
+    int num_ops;
+    config_op_t ops[MAX_CONFIG_BATCH_OPS];
+} *config_batches;
+
+static config_op_t *config_batch_add(int br_index, config_op_type_t type)
+{
+    struct config_batch *batch, **pbatch;
+    config_op_t *op;
+
+    for(pbatch = &config_batches; (batch = *pbatch); pbatch = &batch->next)
+        if(batch->br_index == br_index)
+            break;
+    if(!batch)
+    {
+        if(!(batch = calloc(1, sizeof(*batch))))
+        {
+            fprintf(stderr, "Out of memory\n");
+            return NULL;
+        }
+        batch->br_index = br_index;
+        *pbatch = batch;
+    }
+    if(MAX_CONFIG_BATCH_OPS <= batch->num_ops)
+    {
+        fprintf(stderr, "Too many configuration operations in transaction, "
+                "maximum is %d per bridge\n", MAX_CONFIG_BATCH_OPS);
+        return NULL;
+    }
+    op = &batch->ops[batch->num_ops++];
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    return op;
+}
+
+/* Queue one operation for each run of equal values in table[first..last],
+ * 0xFFFF entries (not set) are skipped */
+static int config_batch_add_table(int br_index, config_op_type_t type,
+                                  const __u16 *table, int first, int last)
+{
+    config_op_t *op;
+    int i, j;
+
+    for(i = first; i <= last; i = j)
+    {
+        for(j = i + 1; (j <= last) && (table[j] == table[i]); ++j)
+            ;
+        if(0xFFFF == table[i])
+            continue;
+        if(!(op = config_batch_add(br_index, type)))
+            return -1;
+        op->first = i;
+        op->last = j - 1;
+        op->value = table[i];
+    }
+    return 0;
+}
+
+/* Send (or just drop if !apply) the queued transactions */
+static int config_batches_commit(bool apply)
+{
+    struct config_batch *batch;
+    char br_name[IFNAMSIZ];
+    int r = 0;
+
+    while((batch = config_batches))
+    {
+        config_batches = batch->next;
+        if(apply && CTL_set_config_batch(batch->br_index, batch->num_ops,
+                                         batch->ops))
+        {
+            if(!if_indextoname(batch->br_index, br_name))
+                sprintf(br_name, "%d", batch->br_index);
+            fprintf(stderr, "Couldn't apply configuration of bridge %s\n",
+                    br_name);
+            r = -1;
+        }
+        free(batch);
+    }
+    return r;
+}
+
+static int config_set_cist_bridge(int br_index, CIST_BridgeConfig *cfg)
+{
+    config_op_t *op;
+
+    if(!transaction)
+        return CTL_set_cist_bridge_config(br_index, cfg);
+    if(!(op = config_batch_add(br_index, CONFIG_OP_cist_bridge)))
+        return -1;
+    op->cist_bridge = *cfg;
+    return 0;
+}
+
+static int config_set_msti_bridge(int br_index, __u16 mstid,
+                                  __u8 bridge_priority)
+{
+    config_op_t *op;
+
+    if(!transaction)
+        return CTL_set_msti_bridge_config(br_index, mstid, bridge_priority);
+    if(!(op = config_batch_add(br_index, CONFIG_OP_msti_bridge)))
+        return -1;
+    op->mstid = mstid;
+    op->bridge_priority = bridge_priority;
+    return 0;
+}
+
+static int config_set_cist_port(int br_index, int port_index,
+                                CIST_PortConfig *cfg)
+{
+    config_op_t *op;
+
+    if(!transaction)
+        return CTL_set_cist_port_config(br_index, port_index, cfg);
+    if(!(op = config_batch_add(br_index, CONFIG_OP_cist_port)))
+        return -1;
+    op->port_index = port_index;
+    op->cist_port = *cfg;
+    return 0;
+}
+
+static int config_set_msti_port(int br_index, int port_index, __u16 mstid,
+                                MSTI_PortConfig *cfg)
+{
+    config_op_t *op;
+
+    if(!transaction)
+        return CTL_set_msti_port_config(br_index, port_index, mstid, cfg);
+    if(!(op = config_batch_add(br_index, CONFIG_OP_msti_port)))
+        return -1;
+    op->port_index = port_index;
+    op->mstid = mstid;
+    op->msti_port = *cfg;
+    return 0;
+}
+
+static int config_set_mstconfid(int br_index, __u16 revision, __u8 *name)
+{
+    config_op_t *op;
+
+    if(!transaction)
+        return CTL_set_mstconfid(br_index, revision, name);
+    if(!(op = config_batch_add(br_index, CONFIG_OP_mstconfid)))
+        return -1;
+    op->mstconfid.revision = revision;
+    strncpy((char *)op->mstconfid.name, (char *)name, CONFIGURATION_NAME_LEN);
+    return 0;
+}
+
 static int cmd_setmstconfid(int argc, char *const *argv)
 {
     int br_index = get_index(argv[1], "bridge");
@@ -1456,7 +1622,7 @@ static int cmd_setmstconfid(int argc, char *const *argv)
         fprintf(stderr, "Bad revision %s\n", argv[2]);
         return -1;
     }
-    return CTL_set_mstconfid(br_index, revision, (__u8 *)argv[3]);
+    return config_set_mstconfid(br_index, revision, (__u8 *)argv[3]);
 }
 
 #define set_bridge_cfg(field, value)                       \
@@ -1465,7 +1631,7 @@ static int cmd_setmstconfid(int argc, char *const *argv)
         memset(&c, 0, sizeof(c));                          \
         c.field = value;                                   \
         c.set_ ## field = true;                            \
-        int r = CTL_set_cist_bridge_config(br_index, &c);  \
+        int r = config_set_cist_bridge(br_index, &c);      \
         if(r)                                              \
             printf("Couldn't change bridge " #field "\n"); \
         r;                                                 \
@@ -1477,7 +1643,7 @@ static int cmd_setmstconfid(int argc, char *const *argv)
         memset(&c, 0, sizeof(c));                                   \
         c.field = value;                                            \
         c.set_ ## field = true;                                     \
-        int r = CTL_set_cist_port_config(br_index, port_index, &c); \
+        int r = config_set_cist_port(br_index, port_index, &c);     \
         if(r)                                                       \
             printf("Couldn't change port " #field "\n");            \
         r;                                                          \
@@ -1489,7 +1655,7 @@ static int cmd_setmstconfid(int argc, char *const *argv)
         memset(&c, 0, sizeof(c));                                          \
         c.field = value;                                                   \
         c.set_ ## field = true;                                            \
-        int r = CTL_set_msti_port_config(br_index, port_index, mstid, &c); \
+        int r = config_set_msti_port(br_index, port_index, mstid, &c);     \
         if(r)                                                              \
             printf("Couldn't change per-tree port " #field "\n");          \
         r;                                                                 \
@@ -1576,7 +1742,7 @@ static int cmd_settreeprio(int argc, char *const *argv)
     unsigned int prio = getuint(argv[3]);
     if(prio > 255)
         prio = 255;
-    return CTL_set_msti_bridge_config(br_index,  mstid, prio);
+    return config_set_msti_bridge(br_index, mstid, prio);
 }
 
 static int cmd_setportpathcost(int argc, char *const *argv)
@@ -1864,6 +2030,14 @@ static int cmd_createtree(int argc, char *const *argv)
     int mstid = get_id(argv[2], "mstid", MAX_MSTID);
     if(0 > mstid)
         return mstid;
+    if(transaction)
+    {
+        config_op_t *op = config_batch_add(br_index, CONFIG_OP_create_msti);
+        if(!op)
+            return -1;
+        op->mstid = mstid;
+        return 0;
+    }
     return CTL_create_msti(br_index, mstid);
 }
 
@@ -1875,6 +2049,14 @@ static int cmd_deletetree(int argc, char *const *argv)
     int mstid = get_id(argv[2], "mstid", MAX_MSTID);
     if(0 > mstid)
         return mstid;
+    if(transaction)
+    {
+        config_op_t *op = config_batch_add(br_index, CONFIG_OP_delete_msti);
+        if(!op)
+            return -1;
+        op->mstid = mstid;
+        return 0;
+    }
     return CTL_delete_msti(br_index, mstid);
 }
 
@@ -2151,6 +2333,9 @@ static int cmd_setvid2fid(int argc, char *const *argv)
         if(0 > (ret = ParseList(argv[i], vids2fids, MAX_VID, "VID",
                                 MAX_FID, "FID", true)))
             return ret;
+    if(transaction)
+        return config_batch_add_table(br_index, CONFIG_OP_vids2fid,
+                                      vids2fids, 1, MAX_VID);
     return CTL_set_vids2fids(br_index, vids2fids);
 }
 
@@ -2166,6 +2351,9 @@ static int cmd_setfid2mstid(int argc, char *const *argv)
         if(0 > (ret = ParseList(argv[i], fids2mstids, MAX_FID, "FID",
                                 MAX_MSTID, "mstid", false)))
             return ret;
+    if(transaction)
+        return config_batch_add_table(br_index, CONFIG_OP_fids2mstid,
+                                      fids2mstids, 0, MAX_FID);
     return CTL_set_fids2mstids(br_index, fids2mstids);
 }
 
@@ -2316,6 +2504,9 @@ static void help(void)
     printf("                           commands. Won't work if `batch` is used\n");
     printf("  -i | --ignore            Ignore failing commands during batch\n");
     printf("                           processing\n");
+    printf("  -t | --transaction       Apply configuration commands of the\n");
+    printf("                           batch at once, as one transaction per\n");
+    printf("                           bridge, after all commands are read\n");
     printf("  -f | --format <format>   Select output format (json, plain)\n");
     printf("commands:\n");
     command_helpall();
@@ -2437,7 +2628,13 @@ static int process_batch_cmds(FILE *batch_file, bool ignore, bool is_stdin)
 
 skip_batch_validation:
     rc = __process_batch_cmds(batch_file, true, ignore);
-    if (rc < 0)
+    if (rc < 0) {
+        /* Nothing of the transaction is applied */
+        config_batches_commit(false);
+        return 1;
+    }
+
+    if (config_batches_commit(true))
         return 1;
 
     return 0;
@@ -2454,6 +2651,7 @@ int main(int argc, char *const *argv)
         {.name = "batch",   .val = 'b', .has_arg = 1},
         {.name = "stdin",   .val = 's'},
         {.name = "ignore",  .val = 'i'},
+        {.name = "transaction", .val = 't'},
         {.name = "format",  .val = 'f', .has_arg = 1},
         {0}
     };
@@ -2461,7 +2659,7 @@ int main(int argc, char *const *argv)
     bool is_stdin = false;
     bool ignore = false;
 
-    while(EOF != (f = getopt_long(argc, argv, "Vhf:b:is", options, NULL)))
+    while(EOF != (f = getopt_long(argc, argv, "Vhf:b:ist", options, NULL)))
         switch(f)
         {
             case 'h':
@@ -2496,6 +2694,9 @@ int main(int argc, char *const *argv)
             case 'i':
                 ignore = true;
                 break;
+            case 't':
+                transaction = true;
+                break;
             case 'f':
                 if (!strcmp(optarg, "json"))
                     format = FORMAT_JSON;
@@ -2515,6 +2716,12 @@ int main(int argc, char *const *argv)
     if((argc == optind) && !batch_file)
         goto help;
 
+    if(transaction && !batch_file)
+    {
+        fprintf(stderr, "Transaction needs batch file or stdin\n");
+        goto help;
+    }
+
     if(ctl_client_init())
     {
         fprintf(stderr, "can't setup control connection\n");
@@ -2564,6 +2771,7 @@ CLIENT_SIDE_FUNCTION(set_vid2fid)
 CLIENT_SIDE_FUNCTION(set_fid2mstid)
 CLIENT_SIDE_FUNCTION(set_vids2fids)
 CLIENT_SIDE_FUNCTION(set_fids2mstids)
+CLIENT_SIDE_FUNCTION(set_config_batch)
 
 CTL_DECLARE(add_bridges)
 {
@@ -29,15 +29,178 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
 
 #include "log.h"
 #include "epoll_loop.h"
 #include "bridge_ctl.h"
-#include "clock_gettime.h"
+#include "packet.h"
 
 /* globals */
 static int epoll_fd = -1;
-static struct timespec nexttimeout;
+static unsigned int tick_msec = 1000;
+static unsigned int tick_hz = 1;
+static unsigned int second_ticks; /* ticks since the last one-second event */
+
+/* Timer wheel: TW_LEVELS levels of TW_SLOTS slots each.
+ * Slot of level 0 holds timers expiring exactly at that tick, slot of level
+ * n holds timers expiring within TW_SLOTS^n ticks. When level n wraps,
+ * the next slot of level n+1 is cascaded down.
+ */
+#define TW_BITS     6
+#define TW_SLOTS    (1 << TW_BITS)
+#define TW_MASK     (TW_SLOTS - 1)
+#define TW_LEVELS   3
+#define TW_MAX_TICKS ((1u << (TW_BITS * TW_LEVELS)) - 1)
+#define TW_INDEX(tick, level) (((tick) >> (TW_BITS * (level))) & TW_MASK)
+
+static struct list_head tw_slots[TW_LEVELS][TW_SLOTS];
+static unsigned int tw_now;
+
+static void wheel_init(void)
+{
+    int level, i;
+
+    for(level = 0; level < TW_LEVELS; ++level)
+        for(i = 0; i < TW_SLOTS; ++i)
+            INIT_LIST_HEAD(&tw_slots[level][i]);
+}
+
+static void wheel_enqueue(struct wheel_timer *t)
+{
+    unsigned int delta = t->expires - tw_now;
+    int level;
+
+    if(delta > TW_MAX_TICKS)
+    {
+        t->expires = tw_now + TW_MAX_TICKS;
+        delta = TW_MAX_TICKS;
+    }
+    for(level = 0; level < TW_LEVELS - 1; ++level)
+        if(delta < (1u << (TW_BITS * (level + 1))))
+            break;
+    list_add_tail(&t->list, &tw_slots[level][TW_INDEX(t->expires, level)]);
+}
+
+static void wheel_cascade(int level)
+{
+    struct list_head *slot = &tw_slots[level][TW_INDEX(tw_now, level)];
+    struct list_head work;
+    struct wheel_timer *t, *nxt;
+
+    INIT_LIST_HEAD(&work);
+    list_splice_init(slot, &work);
+    list_for_each_entry_safe(t, nxt, &work, list)
+        wheel_enqueue(t);
+}
+
+static void wheel_fire(struct list_head *expired)
+{
+    struct wheel_timer *t;
+
+    while(!list_empty(expired))
+    {
+        t = list_entry(expired->next, struct wheel_timer, list);
+        list_del_init(&t->list);
+        t->handler(t);
+    }
+}
+
+static void wheel_tick(void)
+{
+    struct list_head work;
+    int level;
+
+    ++tw_now;
+    for(level = 1; level < TW_LEVELS; ++level)
+        if(TW_INDEX(tw_now, level - 1))
+            break;
+    while(--level > 0)
+        wheel_cascade(level);
+
+    INIT_LIST_HEAD(&work);
+    list_splice_init(&tw_slots[0][TW_INDEX(tw_now, 0)], &work);
+    wheel_fire(&work);
+}
+
+/* Advance the wheel by the given number of ticks at once.
+ * For a long stall, instead of walking every missed tick, take all the
+ * timers off the wheel, requeue those which are still running and fire
+ * the expired ones (in no particular order). The cost then depends only
+ * on the number of armed timers, not on the length of the stall.
+ */
+static void wheel_advance(unsigned int ticks)
+{
+    struct list_head work, expired;
+    struct wheel_timer *t, *nxt;
+    unsigned int then = tw_now;
+    int level, i;
+
+    if(ticks < TW_SLOTS)
+    {
+        while(ticks--)
+            wheel_tick();
+        return;
+    }
+
+    INIT_LIST_HEAD(&work);
+    INIT_LIST_HEAD(&expired);
+    for(level = 0; level < TW_LEVELS; ++level)
+        for(i = 0; i < TW_SLOTS; ++i)
+            list_splice_init(&tw_slots[level][i], &work);
+
+    tw_now += ticks;
+    list_for_each_entry_safe(t, nxt, &work, list)
+    {
+        if((t->expires - then) <= ticks)
+            list_move_tail(&t->list, &expired);
+        else
+        {
+            list_del(&t->list);
+            wheel_enqueue(t);
+        }
+    }
+    wheel_fire(&expired);
+}
+
+void wheel_timer_init(struct wheel_timer *t,
+                      void (*handler) (struct wheel_timer *t))
+{
+    INIT_LIST_HEAD(&t->list);
+    t->expires = 0;
+    t->handler = handler;
+}
+
+/* Bridges can be run on the worker threads (see bridge_run_pending), and
+ * they (re)arm their port timers. The wheel itself only moves in the main
+ * thread, while no bridge is running. */
+static pthread_mutex_t tw_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void wheel_timer_mod(struct wheel_timer *t, unsigned int ticks)
+{
+    pthread_mutex_lock(&tw_lock);
+    if(wheel_timer_pending(t))
+        list_del(&t->list);
+    t->expires = tw_now + (ticks ? ticks : 1);
+    wheel_enqueue(t);
+    pthread_mutex_unlock(&tw_lock);
+}
+
+void wheel_timer_del(struct wheel_timer *t)
+{
+    pthread_mutex_lock(&tw_lock);
+    if(wheel_timer_pending(t))
+        list_del_init(&t->list);
+    pthread_mutex_unlock(&tw_lock);
+}
+
+unsigned int wheel_now(void)
+{
+    return tw_now;
+}
 
 int init_epoll(void)
 {
@@ -48,6 +211,7 @@ int init_epoll(void)
         return -1;
     }
     epoll_fd = r;
+    wheel_init();
     return 0;
 }
 
@@ -90,49 +254,103 @@ void clear_epoll(void)
         close(epoll_fd);
 }
 
-static inline int time_diff(struct timespec *second, struct timespec *first)
+int set_tick_length(unsigned int msec)
+{
+    if(!msec || (1000 % msec))
+        return -1;
+    tick_msec = msec;
+    tick_hz = 1000 / msec;
+    return 0;
+}
+
+unsigned int ticks_per_second(void)
 {
-    return (second->tv_sec - first->tv_sec) * 1000
-            + (second->tv_nsec - first->tv_nsec) / 1000000;
+    return tick_hz;
 }
 
-static inline void run_timeouts(void)
+/* All the missed ticks are applied in one step: MSTP port timers are
+ * advanced lazily by the number of elapsed ticks (see PTSM_advance), so
+ * the state machines are run once no matter how long the loop stalled.
+ */
+static void run_timeouts(unsigned int ticks)
 {
-    bridge_one_second();
-    ++(nexttimeout.tv_sec);
+    unsigned int seconds;
+
+    wheel_advance(ticks);
+    second_ticks += ticks;
+    seconds = second_ticks / tick_hz;
+    second_ticks %= tick_hz;
+    if(seconds)
+        bridge_seconds_elapsed(seconds);
+}
+
+static void tick_rcv(uint32_t events, struct epoll_event_handler *h)
+{
+    uint64_t expirations;
+
+    if(read(h->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        if(errno != EAGAIN)
+            ERROR("timerfd read: %m\n");
+        return;
+    }
+    if(expirations > 1)
+        LOG("Main loop stalled, %llu ticks missed",
+            (unsigned long long)(expirations - 1));
+    if(expirations > UINT_MAX)
+        expirations = UINT_MAX;
+    run_timeouts(expirations);
+}
+
+static int tick_timer_init(struct epoll_event_handler *h)
+{
+    struct itimerspec its =
+    {
+        .it_interval =
+        {
+            .tv_sec = tick_msec / 1000,
+            .tv_nsec = (tick_msec % 1000) * 1000000,
+        },
+    };
+    its.it_value = its.it_interval;
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(fd < 0)
+    {
+        ERROR("timerfd_create failed: %m\n");
+        return -1;
+    }
+    if(timerfd_settime(fd, 0, &its, NULL) < 0)
+    {
+        ERROR("timerfd_settime failed: %m\n");
+        close(fd);
+        return -1;
+    }
+    h->fd = fd;
+    h->arg = NULL;
+    h->handler = tick_rcv;
+    if(add_epoll(h))
+    {
+        close(fd);
+        return -1;
+    }
+    return 0;
 }
 
 int epoll_main_loop(volatile bool *quit)
 {
-    clock_gettime(CLOCK_MONOTONIC, &nexttimeout);
-    ++(nexttimeout.tv_sec);
+    struct epoll_event_handler tick_handler;
 #define EV_SIZE 8
     struct epoll_event ev[EV_SIZE];
 
+    if(tick_timer_init(&tick_handler))
+        return -1;
+
     while(!*quit)
     {
         int r, i;
-        int timeout;
-
-        struct timespec tv;
-        clock_gettime(CLOCK_MONOTONIC, &tv);
-        timeout = time_diff(&nexttimeout, &tv);
-        if(timeout < 0 || timeout > 1000)
-        {
-            run_timeouts();
-            /*
-             * Check if system time has changed.
-             */
-            if(timeout < -4000 || timeout > 1000)
-            {
-                /* Most probably, system time has changed */
-                nexttimeout.tv_nsec = tv.tv_nsec;
-                nexttimeout.tv_sec = tv.tv_sec + 1;
-            }
-            timeout = 0;
-        }
 
-        r = epoll_wait(epoll_fd, ev, EV_SIZE, timeout);
+        r = epoll_wait(epoll_fd, ev, EV_SIZE, -1);
         if(r < 0 && errno != EINTR)
         {
             ERROR("epoll_wait: %m\n");
@@ -156,7 +374,15 @@ int epoll_main_loop(volatile bool *quit)
             if(p != NULL)
                 p->ref_ev = NULL;
         }
+        /* Run the state machines once for all the BPDUs received and
+         * timers expired while handling the events. The BPDUs and the
+         * kernel bridge requests generated by them go out together */
+        bridge_run_pending();
+        br_nl_flush();
+        packet_tx_flush();
     }
 
+    remove_epoll(&tick_handler);
+    close(tick_handler.fd);
     return 0;
 }
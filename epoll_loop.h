@@ -30,6 +30,9 @@
 #include <sys/epoll.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <stdbool.h>
+
+#include "list.h"
 
 struct epoll_event_handler
 {
@@ -46,8 +49,42 @@ void clear_epoll(void);
 
 int epoll_main_loop(volatile bool *quit);
 
+/* Set length of the main loop tick, must be a divisor of 1000 ms.
+ * Should be called before epoll_main_loop() */
+int set_tick_length(unsigned int msec);
+
+unsigned int ticks_per_second(void);
+
 int add_epoll(struct epoll_event_handler *h);
 
 int remove_epoll(struct epoll_event_handler *h);
 
+/*
+ * Hierarchical timer wheel driven by the main loop tick.
+ * Timers are one-shot; handler is called from the main loop after the
+ * timer has been removed from the wheel, so it may re-arm the timer.
+ */
+struct wheel_timer
+{
+    struct list_head list;
+    unsigned int expires; /* absolute tick number */
+    void (*handler) (struct wheel_timer *t);
+};
+
+void wheel_timer_init(struct wheel_timer *t,
+                      void (*handler) (struct wheel_timer *t));
+
+/* (Re)arm timer to expire in ticks from now. ticks == 0 is treated as 1 */
+void wheel_timer_mod(struct wheel_timer *t, unsigned int ticks);
+
+void wheel_timer_del(struct wheel_timer *t);
+
+static inline bool wheel_timer_pending(const struct wheel_timer *t)
+{
+    return !list_empty(&t->list);
+}
+
+/* Number of ticks elapsed since the start of the main loop */
+unsigned int wheel_now(void);
+
 #endif /* EPOLL_LOOP_H */
@@ -33,6 +33,7 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
 
 #include "epoll_loop.h"
@@ -44,6 +45,7 @@
 #include "ctl_socket_server.h"
 #include "driver.h"
 #include "bridge_track.h"
+#include "worker_pool.h"
 
 #define APP_NAME    "mstpd"
 
@@ -116,14 +118,19 @@ int main(int argc, char *argv[])
 {
     int c;
     int daemonize = 1;
+    bool rx_ring = false;
+    int nthreads = 0;
 
-    while((c = getopt(argc, argv, "Vdsv:")) != -1)
+    while((c = getopt(argc, argv, "Vdrsv:t:T:")) != -1)
     {
         switch (c)
         {
             case 'd':
                 daemonize = 0;
                 break;
+            case 'r':
+                rx_ring = true;
+                break;
             case 's':
                 print_to_syslog = 1;
                 break;
@@ -140,6 +147,34 @@ int main(int argc, char *argv[])
                 log_level = l;
                 break;
             }
+            case 't':
+            {
+                /* Length of the timer tick in milliseconds */
+                char *end;
+                unsigned long l;
+                l = strtoul(optarg, &end, 0);
+                if(*optarg == 0 || *end != 0 || l > 1000
+                   || set_tick_length(l))
+                {
+                    ERROR("Invalid tick length %s", optarg);
+                    exit(1);
+                }
+                break;
+            }
+            case 'T':
+            {
+                /* Number of worker threads for parallel MSTI evaluation */
+                char *end;
+                unsigned long l;
+                l = strtoul(optarg, &end, 0);
+                if(*optarg == 0 || *end != 0 || l > INT_MAX)
+                {
+                    ERROR("Invalid number of worker threads %s", optarg);
+                    exit(1);
+                }
+                nthreads = l;
+                break;
+            }
             case 'V':
                 printf(PACKAGE_VERSION "\n");
                 return 0;
@@ -178,15 +213,17 @@ int main(int argc, char *argv[])
     }
 
     TST(signal_init() == 0, -1);
+    TST(worker_pool_init(nthreads) == 0, -1);
     TST(driver_mstp_init() == 0, -1);
     TST(init_epoll() == 0, -1);
     TST(ctl_socket_init() == 0, -1);
-    TST(packet_sock_init() == 0, -1);
+    TST(packet_sock_init(rx_ring) == 0, -1);
     TST(netsock_init() == 0, -1);
     TST(init_bridge_ops() == 0, -1);
 
     c = epoll_main_loop(&quit);
     bridge_track_fini();
+    packet_sock_cleanup();
     ctl_socket_cleanup();
     driver_mstp_fini();
 
@@ -208,10 +245,10 @@ void vDprintf(int level, const char *fmt, va_list ap)
         char logbuf[256];
         logbuf[255] = 0;
         time_t clock;
-        struct tm *local_tm;
+        struct tm local_tm;
         time(&clock);
-        local_tm = localtime(&clock);
-        int l = strftime(logbuf, sizeof(logbuf) - 1, "%F %T ", local_tm);
+        localtime_r(&clock, &local_tm);
+        int l = strftime(logbuf, sizeof(logbuf) - 1, "%F %T ", &local_tm);
         vsnprintf(logbuf + l, sizeof(logbuf) - l - 1, fmt, ap);
         printf("%s\n", logbuf);
     }
@@ -279,7 +316,7 @@ static bool test_ports_trees_mesh(void)
 
     for(i = 0; i < 5; ++i)
     {
-        if(!(prt[i] = calloc(1, sizeof(port_t))))
+        if(!(prt[i] = obj_pool_alloc(&br->port_pool)))
             return false;
         prt[i]->bridge = br;
     }
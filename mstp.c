@@ -33,6 +33,11 @@
  *   return value convention:
  *      They should return true if state change detected during dry run.
  *      Otherwise (!dry_run || !state_change) they return false.
+ *   The state machines are not dry run as a whole any more, instead every
+ *   state transition marks the port (or the tree) dirty and only the dirty
+ *   ones are run again (see sm_mark_port). The dry run is still used by
+ *   the global transitions which would otherwise re-enter the same state
+ *   on every run (see PTSM_run).
  */
 
 #include <config.h>
@@ -46,15 +51,28 @@
 #include "log.h"
 #include "driver.h"
 #include "clock_gettime.h"
+#include "worker_pool.h"
 
-static void PTSM_tick(port_t *prt);
+static void PTSM_advance(port_t *prt);
+static void PTSM_schedule(port_t *prt);
+static void PTSM_timer_expired(struct wheel_timer *t);
 static bool TCSM_run(per_tree_port_t *ptp, bool dry_run);
 static void BDSM_begin(port_t *prt);
 static void br_state_machines_begin(bridge_t *br);
 static void prt_state_machines_begin(port_t *prt);
 static void tree_state_machines_begin(tree_t *tree);
 static void br_state_machines_run(bridge_t *br);
+static void br_dirty_state_machines_run(bridge_t *br);
 static void updtbrAssuRcvdInfoWhile(port_t *prt);
+static void priority_key(priority_key_t *key, cist_priority_key_t *ckey,
+                         const port_priority_vector_t *vec,
+                         port_identifier_t pId);
+static void priority_vector(port_priority_vector_t *vec,
+                            const priority_key_t *key,
+                            const cist_priority_key_t *ckey);
+
+/* Protocol times are in seconds, while port timers count main loop ticks */
+#define TICKS(seconds) ((seconds) * ticks_per_second())
 
 #define FOREACH_PORT_IN_BRIDGE(port, bridge) \
     list_for_each_entry((port), &(bridge)->ports, br_list)
@@ -64,6 +82,30 @@ static void updtbrAssuRcvdInfoWhile(port_t *prt);
     list_for_each_entry((ptp), &(tree)->ports, tree_list)
 #define FOREACH_PTP_IN_PORT(ptp, port) \
     list_for_each_entry((ptp), &(port)->trees, port_list)
+/* Linear sweep over the hot variables of all the ports of the tree */
+#define FOREACH_HOT_IN_TREE(h, tree)                                    \
+    for((h) = (tree)->hot; (h) < (tree)->hot + (tree)->bridge->num_slots; \
+        ++(h))                                                          \
+        if(!(h)->present)                                               \
+            continue;                                                   \
+        else
+
+/* Priority vectors of the per-tree port are kept as keys only, with the
+ * CIST-only part of the key in ptp->ext (see per_tree_port_t).
+ * PTP_KEY() gives the (key, ckey) pair of arguments for the priority_key()
+ * and the comparison helpers, ckey is NULL for the MSTIs.
+ */
+#define PTP_KEY(ptp, name) \
+    &(ptp)->name, ((ptp)->MSTID ? NULL : &(ptp)->ext->name)
+#define TREE_ROOT_KEY(tree) \
+    &(tree)->rootKey, ((tree)->MSTID ? NULL : &(tree)->rootCistKey)
+#define PTP_PRIORITY(vec, ptp, name) priority_vector((vec), PTP_KEY(ptp, name))
+#define SET_PTP_PRIORITY(ptp, name, vec, pId) \
+    priority_key(PTP_KEY(ptp, name), (vec), (pId))
+#define COPY_PTP_KEY(ptp, to, from) ({     \
+    (ptp)->to = (ptp)->from;               \
+    if(0 == (ptp)->MSTID)                  \
+        (ptp)->ext->to = (ptp)->ext->from; })
 
 /* 17.20.11 of 802.1D */
 #define rstpVersion(br) ((br)->ForceProtocolVersion >= protoRSTP)
@@ -72,21 +114,232 @@ static void updtbrAssuRcvdInfoWhile(port_t *prt);
  */
 #define assurancePort(prt) ((prt)->NetworkPort && (prt)->operPointToPointMAC \
                             && (prt)->sendRSTP)
+/* The cached BPDU of the port (see txMstp) must be dropped whenever any
+ * of the data it was built from changes: port role and flags, tcWhile,
+ * designated priority and times, Hello_Time, the set of MSTIs,
+ * the MST Configuration Identifier or the force protocol version.
+ */
+static inline void txBpdu_invalidate(port_t *prt)
+{
+    prt->txBpduValid = false;
+}
+
+static void br_txBpdu_invalidate(bridge_t *br)
+{
+    port_t *prt;
+
+    FOREACH_PORT_IN_BRIDGE(prt, br)
+        txBpdu_invalidate(prt);
+}
+
+/* State machines are run only for the ports and trees which are marked
+ * dirty, i.e. some of the variables their conditions depend on could
+ * have changed (see __br_state_machines_run).
+ * The port is marked on every state transition of its per-port and
+ * per-tree-port state machines, on timer expiration and on BPDU receipt.
+ * The tree is marked when its Port Role Selection state machine has work.
+ */
+static void sm_mark_port(port_t *prt)
+{
+    prt->sm_dirty = true;
+    if(list_empty(&prt->sm_list))
+    {
+        list_add_tail(&prt->sm_list, &prt->bridge->sm_ports);
+        /* Timers must be up to date before the state machines
+         * of the port restart any of them */
+        PTSM_advance(prt);
+    }
+}
+
+static void sm_mark_tree(tree_t *tree)
+{
+    tree->sm_dirty = true;
+    if(list_empty(&tree->sm_list))
+        list_add_tail(&tree->sm_list, &tree->bridge->sm_trees);
+}
+
+static void sm_mark_tree_ports(tree_t *tree)
+{
+    per_tree_port_t *ptp;
+
+    FOREACH_PTP_IN_TREE(ptp, tree)
+        sm_mark_port(ptp->port);
+}
+
+static void br_sm_mark_all(bridge_t *br)
+{
+    port_t *prt;
+    tree_t *tree;
+
+    FOREACH_PORT_IN_BRIDGE(prt, br)
+        sm_mark_port(prt);
+    FOREACH_TREE_IN_BRIDGE(tree, br)
+        sm_mark_tree(tree);
+}
+
+/* The Port Role Transitions state machine looks at these variables
+ * of all the ports of the tree (allSynced, reRooted), and the Port Role
+ * Selection state machine looks at reselect. When any of them changes,
+ * the state machines of the other ports (or the PRSSM) must be run again.
+ */
+#define SM_SHARED_SELECTED      (1 << 0)
+#define SM_SHARED_UPDTINFO      (1 << 1)
+#define SM_SHARED_SYNCED        (1 << 2)
+#define SM_SHARED_RRWHILE_ZERO  (1 << 3)
+#define SM_SHARED_RESELECT      (1 << 4)
+#define SM_SHARED_ROLE_SHIFT            8
+#define SM_SHARED_SELECTEDROLE_SHIFT    16
+
+static void sm_publish(port_t *prt)
+{
+    per_tree_port_t *ptp;
+    unsigned int shared, changed;
+
+    FOREACH_PTP_IN_PORT(ptp, prt)
+    {
+        shared = (ptp->hot->selected ? SM_SHARED_SELECTED : 0)
+                 | (ptp->hot->updtInfo ? SM_SHARED_UPDTINFO : 0)
+                 | (ptp->hot->synced ? SM_SHARED_SYNCED : 0)
+                 | ((0 == ptp->hot->rrWhile) ? SM_SHARED_RRWHILE_ZERO : 0)
+                 | (ptp->hot->reselect ? SM_SHARED_RESELECT : 0)
+                 | (ptp->hot->role << SM_SHARED_ROLE_SHIFT)
+                 | (ptp->hot->selectedRole << SM_SHARED_SELECTEDROLE_SHIFT);
+        changed = shared ^ ptp->sm_shared;
+        if(!changed)
+            continue;
+        ptp->sm_shared = shared;
+        if(changed & shared & SM_SHARED_RESELECT)
+            sm_mark_tree(ptp->tree);
+        if(changed & ~SM_SHARED_RESELECT)
+            sm_mark_tree_ports(ptp->tree);
+    }
+}
+
+/* updtRolesTree() recalculates the root path priority vectors, designated
+ * priority vectors and roles only for the per-tree ports queued here,
+ * as long as the root priority vector and root times stay the same.
+ * The port is queued when any of the variables these depend on changes.
+ * Changes of unknown scope (configuration, ports and trees coming and
+ * going) make the next updtRolesTree() recalculate the whole tree.
+ */
+static void rolesStale_ptp(per_tree_port_t *ptp)
+{
+    if(list_empty(&ptp->rolesStale_list))
+        list_add_tail(&ptp->rolesStale_list, &ptp->tree->rolesStale);
+}
+
+static void rolesStale_port(port_t *prt)
+{
+    per_tree_port_t *ptp;
+
+    FOREACH_PTP_IN_PORT(ptp, prt)
+        rolesStale_ptp(ptp);
+}
+
+/* MSTI roles of the boundary port follow CIST information of the port
+ * (13.26.23 g), so CIST changes queue the MSTIs too */
+static void rolesStale_info(per_tree_port_t *ptp)
+{
+    if(0 == ptp->MSTID)
+        rolesStale_port(ptp->port);
+    else
+        rolesStale_ptp(ptp);
+}
+
+static void br_roles_invalidate(bridge_t *br)
+{
+    tree_t *tree;
+
+    FOREACH_TREE_IN_BRIDGE(tree, br)
+        tree->rootHeapValid = false;
+}
+
 /*
  * Recalculate configuration digest. (13.7)
  */
 static void RecalcConfigDigest(bridge_t *br)
 {
-    __be16 vid2mstid[MAX_VID + 2];
     unsigned char mstp_key[] = HMAC_KEY;
-    int vid;
 
-    vid2mstid[0] = vid2mstid[MAX_VID + 1] = 0;
-    for(vid = 1; vid <= MAX_VID; ++vid)
-        vid2mstid[vid] = br->fid2mstid[br->vid2fid[vid]];
-
-    hmac_md5((void *)vid2mstid, sizeof(vid2mstid), mstp_key, sizeof(mstp_key),
+    hmac_md5((void *)br->vid2mstid, sizeof(br->vid2mstid),
+             mstp_key, sizeof(mstp_key),
              (caddr_t)br->MstConfigId.s.configuration_digest);
+    br->configDigestValid = true;
+}
+
+/* The MST Configuration Table has changed, the digest will be
+ * recalculated when it is needed next time */
+static void ConfigDigestChanged(bridge_t *br)
+{
+    br->configDigestValid = false;
+    br_txBpdu_invalidate(br);
+}
+
+static mst_configuration_identifier_t *get_MstConfigId(bridge_t *br)
+{
+    if(!br->configDigestValid)
+        RecalcConfigDigest(br);
+    return &br->MstConfigId;
+}
+
+/* Lists of the VIDs allocated to each FID */
+#define FOREACH_VID_IN_FID(vid, br, fid) \
+    for((vid) = (br)->fid_first_vid[fid]; (vid); (vid) = (br)->vid_next[vid])
+
+static void fid_del_vid(bridge_t *br, __u16 vid)
+{
+    __u16 next = br->vid_next[vid], prev = br->vid_prev[vid];
+
+    if(prev)
+        br->vid_next[prev] = next;
+    else
+        br->fid_first_vid[br->vid2fid[vid]] = next;
+    if(next)
+        br->vid_prev[next] = prev;
+}
+
+static void fid_add_vid(bridge_t *br, __u16 vid)
+{
+    __u16 fid = br->vid2fid[vid], next = br->fid_first_vid[fid];
+
+    br->vid_prev[vid] = 0;
+    br->vid_next[vid] = next;
+    if(next)
+        br->vid_prev[next] = vid;
+    br->fid_first_vid[fid] = vid;
+}
+
+/* Move VID to another FID, returns true if the VID-to-MSTID mapping
+ * has changed */
+static bool set_vid2fid(bridge_t *br, __u16 vid, __u16 fid)
+{
+    if(br->vid2fid[vid] == fid)
+        return false;
+    fid_del_vid(br, vid);
+    br->vid2fid[vid] = fid;
+    fid_add_vid(br, vid);
+    if(br->vid2mstid[vid] == br->fid2mstid[fid])
+        return false;
+    br->vid2mstid[vid] = br->fid2mstid[fid];
+    MSTP_OUT_set_vid2mstid(br, vid, __be16_to_cpu(br->vid2mstid[vid]));
+    return true;
+}
+
+/* Allocate FID to another MSTID, returns true if the VID-to-MSTID
+ * mapping has changed, i.e. there are VIDs allocated to the FID */
+static bool set_fid2mstid(bridge_t *br, __u16 fid, __be16 MSTID)
+{
+    __u16 vid;
+
+    if(br->fid2mstid[fid] == MSTID)
+        return false;
+    br->fid2mstid[fid] = MSTID;
+    FOREACH_VID_IN_FID(vid, br, fid)
+    {
+        br->vid2mstid[vid] = MSTID;
+        MSTP_OUT_set_vid2mstid(br, vid, __be16_to_cpu(MSTID));
+    }
+    return 0 != br->fid_first_vid[fid];
 }
 
 /*
@@ -104,6 +357,7 @@ static __u32 compute_pcost(int speed)
 static void bridge_default_internal_vars(bridge_t *br)
 {
     br->uptime = 0;
+    br->run_pending = false;
 }
 
 static void tree_default_internal_vars(tree_t *tree)
@@ -134,8 +388,10 @@ static void port_default_internal_vars(port_t *prt)
     prt->num_rx_tcn = 0;
     prt->num_tx_bpdu = 0;
     prt->num_tx_tcn = 0;
+    prt->num_tx_failed = 0;
     prt->num_trans_fwd = 0;
     prt->num_trans_blk = 0;
+    prt->txBpduValid = false;
 
     /* The following are initialized in BEGIN state:
      * - mdelayWhile. mcheck, sendRSTP: in Port Protocol Migration SM
@@ -150,12 +406,14 @@ static void ptp_default_internal_vars(per_tree_port_t *ptp)
 {
     ptp->rcvdTc = false;
     ptp->tcProp = false;
-    ptp->updtInfo = false;
+    ptp->hot->updtInfo = false;
     ptp->master = false; /* 13.24.5 */
     ptp->disputed = false;
     assign(ptp->rcvdInfo, (port_info_t)0);
     ptp->mastered = false;
-    memset(&ptp->msgPriority, 0, sizeof(ptp->msgPriority));
+    memset(&ptp->msgKey, 0, sizeof(ptp->msgKey));
+    if(0 == ptp->MSTID)
+        memset(&ptp->ext->msgKey, 0, sizeof(ptp->ext->msgKey));
     memset(&ptp->msgTimes, 0, sizeof(ptp->msgTimes));
 
     /* The following are initialized in BEGIN state:
@@ -173,7 +431,7 @@ static void ptp_default_internal_vars(per_tree_port_t *ptp)
 static tree_t * create_tree(bridge_t *br, __u8 *macaddr, __be16 MSTID)
 {
     /* Initialize all fields except anchor */
-    tree_t *tree = calloc(1, sizeof(*tree));
+    tree_t *tree = obj_pool_alloc(&br->tree_pool);
     if(!tree)
     {
         ERROR_BRNAME(br, "Out of memory");
@@ -182,6 +440,15 @@ static tree_t * create_tree(bridge_t *br, __u8 *macaddr, __be16 MSTID)
     tree->bridge = br;
     tree->MSTID = MSTID;
     INIT_LIST_HEAD(&tree->ports);
+    INIT_LIST_HEAD(&tree->sm_list);
+    INIT_LIST_HEAD(&tree->rolesStale);
+    if(br->slots_alloc
+       && !(tree->hot = calloc(br->slots_alloc, sizeof(*tree->hot))))
+    {
+        ERROR_BRNAME(br, "Out of memory");
+        obj_pool_free(&br->tree_pool, tree);
+        return NULL;
+    }
 
     memcpy(tree->BridgeIdentifier.s.mac_address, macaddr, ETH_ALEN);
     /* 0x8000 = default bridge priority (17.14 of 802.1D) */
@@ -204,7 +471,9 @@ static tree_t * create_tree(bridge_t *br, __u8 *macaddr, __be16 MSTID)
 static per_tree_port_t * create_ptp(tree_t *tree, port_t *prt)
 {
     /* Initialize all fields except anchors */
-    per_tree_port_t *ptp = calloc(1, sizeof(*ptp));
+    per_tree_port_t *ptp = obj_pool_alloc(tree->MSTID
+                                          ? &prt->bridge->ptp_pool
+                                          : &prt->bridge->cist_ptp_pool);
     if(!ptp)
     {
         ERROR_PRTNAME(prt->bridge, prt, "Out of memory");
@@ -213,6 +482,9 @@ static per_tree_port_t * create_ptp(tree_t *tree, port_t *prt)
     ptp->port = prt;
     ptp->tree = tree;
     ptp->MSTID = tree->MSTID;
+    ptp->hot = &tree->hot[prt->slot];
+    memset(ptp->hot, 0, sizeof(*ptp->hot));
+    ptp->hot->present = true;
 
     ptp->state = BR_STATE_DISABLED;
     /* 0x80 = default port priority (17.14 of 802.1D) */
@@ -220,21 +492,58 @@ static per_tree_port_t * create_ptp(tree_t *tree, port_t *prt)
     assign(ptp->AdminInternalPortPathCost, 0u);
     assign(ptp->InternalPortPathCost, compute_pcost(GET_PORT_SPEED(prt)));
     /* 802.1Q leaves portPriority and portTimes uninitialized */
-    assign(ptp->portPriority, tree->BridgePriority);
+    SET_PTP_PRIORITY(ptp, portKey, &tree->BridgePriority, 0);
     assign(ptp->portTimes, tree->BridgeTimes);
 
-    ptp->calledFromFlushRoutine = false;
+    ptp->rootHeapIndex = -1;
+    INIT_LIST_HEAD(&ptp->rolesStale_list);
 
     ptp_default_internal_vars(ptp);
 
     return ptp;
 }
 
+static void free_ptp(bridge_t *br, per_tree_port_t *ptp)
+{
+    obj_pool_free(ptp->MSTID ? &br->ptp_pool : &br->cist_ptp_pool, ptp);
+}
+
+/* Make room for num_slots ports in the hot arrays of all the trees */
+static bool br_grow_slots(bridge_t *br, unsigned int num_slots)
+{
+    tree_t *tree;
+    per_tree_port_t *ptp;
+    per_tree_port_hot_t *hot;
+    unsigned int slots_alloc = br->slots_alloc ? br->slots_alloc : 16;
+
+    while(slots_alloc < num_slots)
+        slots_alloc *= 2;
+    if(slots_alloc == br->slots_alloc)
+        return true;
+
+    FOREACH_TREE_IN_BRIDGE(tree, br)
+    {
+        if(!(hot = realloc(tree->hot, slots_alloc * sizeof(*hot))))
+        {
+            ERROR_BRNAME(br, "Out of memory");
+            return false;
+        }
+        memset(hot + br->slots_alloc, 0,
+               (slots_alloc - br->slots_alloc) * sizeof(*hot));
+        tree->hot = hot;
+        FOREACH_PTP_IN_TREE(ptp, tree)
+            ptp->hot = &hot[ptp->port->slot];
+    }
+    br->slots_alloc = slots_alloc;
+    return true;
+}
+
 /* External events */
 
 bool MSTP_IN_bridge_create(bridge_t *br, __u8 *macaddr)
 {
     tree_t *cist;
+    __u16 vid;
 
     if (!driver_create_bridge(br, macaddr))
         return false;
@@ -242,16 +551,22 @@ bool MSTP_IN_bridge_create(bridge_t *br, __u8 *macaddr)
     /* Initialize all fields except sysdeps and anchor */
     INIT_LIST_HEAD(&br->ports);
     INIT_LIST_HEAD(&br->trees);
+    INIT_LIST_HEAD(&br->sm_ports);
+    INIT_LIST_HEAD(&br->sm_trees);
     br->bridgeEnabled = false;
     memset(br->vid2fid, 0, sizeof(br->vid2fid));
     memset(br->fid2mstid, 0, sizeof(br->fid2mstid));
+    memset(br->vid2mstid, 0, sizeof(br->vid2mstid));
+    memset(br->fid_first_vid, 0, sizeof(br->fid_first_vid));
+    for(vid = MAX_VID; vid > 0; --vid)
+        fid_add_vid(br, vid);
     assign(br->MstConfigId.s.selector, (__u8)0);
     sprintf((char *)br->MstConfigId.s.configuration_name,
             "%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
             macaddr[0], macaddr[1], macaddr[2],
             macaddr[3], macaddr[4], macaddr[5]);
     assign(br->MstConfigId.s.revision_level, __constant_cpu_to_be16(0));
-    RecalcConfigDigest(br); /* set br->MstConfigId.s.configuration_digest */
+    br->configDigestValid = false; /* see get_MstConfigId */
     br->ForceProtocolVersion = protoRSTP;
     assign(br->MaxHops, (__u8)20);       /* 13.37.3 */
     assign(br->Forward_Delay, (__u8)15); /* 17.14 of 802.1D */
@@ -262,6 +577,12 @@ bool MSTP_IN_bridge_create(bridge_t *br, __u8 *macaddr)
     assign(br->Hello_Time, (__u8)2);     /* 17.14 of 802.1D */
 
     bridge_default_internal_vars(br);
+    br->num_slots = br->slots_alloc = 0;
+    obj_pool_init(&br->port_pool, sizeof(port_t), 16);
+    obj_pool_init(&br->tree_pool, sizeof(tree_t), 8);
+    obj_pool_init(&br->ptp_pool, sizeof(per_tree_port_t), 64);
+    obj_pool_init(&br->cist_ptp_pool, sizeof(per_tree_port_t)
+                  + sizeof(((per_tree_port_t *)0)->ext[0]), 16);
 
     /* Create CIST */
     if(!(cist = create_tree(br, macaddr, 0)))
@@ -273,7 +594,7 @@ bool MSTP_IN_bridge_create(bridge_t *br, __u8 *macaddr)
 
 bool MSTP_IN_port_create_and_add_tail(port_t *prt, __u16 portno)
 {
-    tree_t *tree;
+    tree_t *tree, *cist;
     per_tree_port_t *ptp, *nxt;
     bridge_t *br = prt->bridge;
 
@@ -282,6 +603,7 @@ bool MSTP_IN_port_create_and_add_tail(port_t *prt, __u16 portno)
 
     /* Initialize all fields except sysdeps and bridge */
     INIT_LIST_HEAD(&prt->trees);
+    INIT_LIST_HEAD(&prt->sm_list);
     prt->port_number = __cpu_to_be16(portno);
 
     assign(prt->AdminExternalPortPathCost, 0u);
@@ -303,9 +625,26 @@ bool MSTP_IN_port_create_and_add_tail(port_t *prt, __u16 portno)
     prt->dontTxmtBpdu = false;
     prt->bpduFilterPort = false;
     prt->deleted = false;
+    memset(prt->rcvdBpduQueue, 0, sizeof(prt->rcvdBpduQueue));
+    prt->rcvdBpduHead = 0;
+    prt->rcvdBpduCount = 0;
+    wheel_timer_init(&prt->tick_timer, PTSM_timer_expired);
+    prt->last_tick = wheel_now();
 
     port_default_internal_vars(prt);
 
+    /* Take the first free slot in the hot arrays of the trees */
+    cist = GET_CIST_TREE(br);
+    for(prt->slot = 0; prt->slot < br->num_slots; ++prt->slot)
+        if(!cist->hot[prt->slot].present)
+            break;
+    if(prt->slot == br->num_slots)
+    {
+        if(!br_grow_slots(br, br->num_slots + 1))
+            return false;
+        ++br->num_slots;
+    }
+
     /* Create PerTreePort structures for all existing trees */
     FOREACH_TREE_IN_BRIDGE(tree, br)
     {
@@ -316,7 +655,8 @@ bool MSTP_IN_port_create_and_add_tail(port_t *prt, __u16 portno)
             {
                 list_del(&ptp->port_list);
                 list_del(&ptp->tree_list);
-                free(ptp);
+                ptp->hot->present = false;
+                free_ptp(br, ptp);
             }
             return false;
         }
@@ -331,6 +671,7 @@ bool MSTP_IN_port_create_and_add_tail(port_t *prt, __u16 portno)
      */
     list_add_tail(&prt->br_list, &br->ports);
 
+    br_roles_invalidate(br);
     prt_state_machines_begin(prt);
     return true;
 }
@@ -339,6 +680,7 @@ void MSTP_IN_delete_port(port_t *prt)
 {
     per_tree_port_t *ptp, *nxt;
     bridge_t *br = prt->bridge;
+    int i;
 
     driver_delete_port(prt);
 
@@ -353,10 +695,25 @@ void MSTP_IN_delete_port(port_t *prt)
     {
         list_del(&ptp->port_list);
         list_del(&ptp->tree_list);
-        free(ptp);
+        list_del(&ptp->rolesStale_list);
+        ptp->hot->present = false;
+        free_ptp(br, ptp);
     }
+    while(br->num_slots
+          && !GET_CIST_TREE(br)->hot[br->num_slots - 1].present)
+        --br->num_slots;
+    br_roles_invalidate(br);
 
     list_del(&prt->br_list);
+    list_del_init(&prt->sm_list);
+    wheel_timer_del(&prt->tick_timer);
+    for(i = 0; i < RCVD_BPDU_QUEUE_LEN; ++i)
+    {
+        free(prt->rcvdBpduQueue[i].mstis);
+        prt->rcvdBpduQueue[i].mstis = NULL;
+        prt->rcvdBpduQueue[i].mstis_alloc = 0;
+    }
+    prt->rcvdBpduCount = 0;
     br_state_machines_run(br);
 }
 
@@ -379,14 +736,21 @@ void MSTP_IN_delete_bridge(bridge_t *br)
     list_for_each_entry_safe(prt, nxt_prt, &br->ports, br_list)
     {
         MSTP_IN_delete_port(prt);
-        free(prt);
+        obj_pool_free(&br->port_pool, prt);
     }
 
     list_for_each_entry_safe(tree, nxt_tree, &br->trees, bridge_list)
     {
         list_del(&tree->bridge_list);
-        free(tree);
+        list_del(&tree->sm_list);
+        free(tree->rootHeap);
+        free(tree->hot);
+        obj_pool_free(&br->tree_pool, tree);
     }
+    obj_pool_destroy(&br->port_pool);
+    obj_pool_destroy(&br->tree_pool);
+    obj_pool_destroy(&br->ptp_pool);
+    obj_pool_destroy(&br->cist_ptp_pool);
 }
 
 void MSTP_IN_set_bridge_address(bridge_t *br, __u8 *macaddr)
@@ -416,6 +780,9 @@ void MSTP_IN_set_bridge_enable(bridge_t *br, bool up)
 
     if(br->bridgeEnabled == up)
         return;
+    /* Timers run only while bridge is enabled */
+    FOREACH_PORT_IN_BRIDGE(prt, br)
+        PTSM_advance(prt);
     br->bridgeEnabled = up;
 
     /* Reset all internal states and variables,
@@ -455,6 +822,9 @@ void MSTP_IN_set_port_enable(port_t *prt, bool up, int speed, int duplex)
     bool new_p2p;
     bool changed = false;
 
+    /* Timers held by the state machines depend on portEnabled */
+    PTSM_advance(prt);
+
     if(up)
     {
         computed_pcost = compute_pcost(speed);
@@ -507,6 +877,7 @@ void MSTP_IN_set_port_enable(port_t *prt, bool up, int speed, int duplex)
             prt->num_rx_tcn = 0;
             prt->num_tx_bpdu = 0;
             prt->num_tx_tcn = 0;
+            prt->num_tx_failed = 0;
             changed = true;
             /* When port is enabled, initialize bridge assurance timer,
              * so that enough time is given before port is put in
@@ -528,35 +899,35 @@ void MSTP_IN_set_port_enable(port_t *prt, bool up, int speed, int duplex)
         br_state_machines_run(prt->bridge);
 }
 
-void MSTP_IN_one_second(bridge_t *br)
+void MSTP_IN_seconds_elapsed(bridge_t *br, unsigned int seconds)
 {
-    port_t *prt;
     tree_t *tree;
 
-    ++(br->uptime);
+    br->uptime += seconds;
 
     if(!br->bridgeEnabled)
         return;
 
     FOREACH_TREE_IN_BRIDGE(tree, br)
         if(!(tree->topology_change))
-            ++(tree->time_since_topology_change);
+            tree->time_since_topology_change += seconds;
+}
 
-    FOREACH_PORT_IN_BRIDGE(prt, br)
+/* Called once per main loop iteration, after all the events are handled */
+void MSTP_IN_run_pending(bridge_t *br)
+{
+    if(!br->bridgeEnabled)
+        return;
+
+    /* Port timers are advanced lazily (see PTSM_advance) and received
+     * BPDUs are queued, so there is nothing to do unless some timer has
+     * expired or some BPDU has arrived. Only the ports and trees which
+     * were marked dirty by these events are run */
+    if(br->run_pending)
     {
-        PTSM_tick(prt);
-        /* support for rapid ageing */
-        if(prt->rapidAgeingWhile)
-        {
-            if((--(prt->rapidAgeingWhile)) == 0)
-            {
-                if(!prt->deleted)
-                    MSTP_OUT_set_ageing_time(prt, br->Ageing_Time);
-            }
-        }
+        br->run_pending = false;
+        br_dirty_state_machines_run(br);
     }
-
-    br_state_machines_run(br);
 }
 
 void MSTP_IN_all_fids_flushed(per_tree_port_t *ptp)
@@ -568,16 +939,47 @@ void MSTP_IN_all_fids_flushed(per_tree_port_t *ptp)
     if(!ptp->calledFromFlushRoutine)
     {
         TCSM_run(ptp, false /* actual run */);
-        br_state_machines_run(br);
+        sm_mark_port(ptp->port);
+        br_dirty_state_machines_run(br);
     }
 }
 
+/* The head of the receive queue is still in use by the state machines */
+static bool rcvdBpdu_busy(port_t *prt)
+{
+    per_tree_port_t *ptp;
+
+    if(prt->rcvdBpdu)
+        return true;
+    FOREACH_PTP_IN_PORT(ptp, prt)
+        if(ptp->rcvdMsg)
+            return true;
+    return false;
+}
+
+/* Hand the next queued BPDU over to the state machines,
+ * once they are done with the previous one */
+static bool rcvdBpdu_next(port_t *prt)
+{
+    if((prt->rcvdBpduCount < 2) || rcvdBpdu_busy(prt))
+        return false;
+    prt->rcvdBpduHead = (prt->rcvdBpduHead + 1) % RCVD_BPDU_QUEUE_LEN;
+    --(prt->rcvdBpduCount);
+    prt->rcvdBpdu = true;
+    sm_mark_port(prt);
+    return true;
+}
+
 /* NOTE: bpdu pointer is unaligned, but it works because
  * bpdu_t is packed. Don't try to cast bpdu to non-packed type ;)
+ * The BPDU is validated in place, it is not modified. Only its fixed part
+ * and the MSTI messages it conveys are copied to the port.
  */
-void MSTP_IN_rx_bpdu(port_t *prt, bpdu_t *bpdu, int size)
+void MSTP_IN_rx_bpdu(port_t *prt, const bpdu_t *bpdu, int size)
 {
-    int mstis_size;
+    int mstis_size, num_mstis = 0;
+    __u8 protocolVersion;
+    rcvd_bpdu_t *rb;
     bridge_t *br = prt->bridge;
 
     ++(prt->num_rx_bpdu);
@@ -605,11 +1007,19 @@ void MSTP_IN_rx_bpdu(port_t *prt, bpdu_t *bpdu, int size)
         return;
     }
 
-    if(prt->rcvdBpdu)
+    /* Drop the head of the queue if the state machines are done with it.
+     * If a BPDU is waiting behind it, hand that one over instead, even if
+     * the new one turns out to be invalid */
+    if(1 == prt->rcvdBpduCount)
     {
-        ERROR_PRTNAME(br, prt, "Port hasn't processed previous BPDU");
-        return;
+        if(!rcvdBpdu_busy(prt))
+        {
+            prt->rcvdBpduHead = (prt->rcvdBpduHead + 1) % RCVD_BPDU_QUEUE_LEN;
+            --(prt->rcvdBpduCount);
+        }
     }
+    else if(rcvdBpdu_next(prt))
+        br->run_pending = true;
 
     /* 14.4 Validation */
     if((TCN_BPDU_SIZE > size) || (0 != bpdu->protocolIdentifier))
@@ -623,7 +1033,7 @@ bpdu_validation_failed:
         case bpduTypeTCN:
             /* 14.4.b) */
             /* Valid TCN BPDU */
-            bpdu->protocolVersion = protoSTP;
+            protocolVersion = protoSTP;
             LOG_PRTNAME(br, prt, "received TCN BPDU");
             break;
         case bpduTypeConfig:
@@ -631,7 +1041,7 @@ bpdu_validation_failed:
             if(CONFIG_BPDU_SIZE > size)
                 goto bpdu_validation_failed;
             /* Valid Config BPDU */
-            bpdu->protocolVersion = protoSTP;
+            protocolVersion = protoSTP;
             LOG_PRTNAME(br, prt, "received Config BPDU%s",
                         (bpdu->flags & (1 << offsetTc)) ? ", tcFlag" : ""
                        );
@@ -642,7 +1052,7 @@ bpdu_validation_failed:
                 if(RST_BPDU_SIZE > size)
                     goto bpdu_validation_failed;
                 /* Valid RST BPDU */
-                /* bpdu->protocolVersion = protoRSTP; */
+                protocolVersion = protoRSTP;
                 LOG_PRTNAME(br, prt, "received RST BPDU%s",
                             (bpdu->flags & (1 << offsetTc)) ? ", tcFlag" : ""
                            );
@@ -667,25 +1077,32 @@ bpdu_validation_failed:
               )
             { /* 14.4.d) */
                 /* Valid RST BPDU */
-                bpdu->protocolVersion = protoRSTP;
+                protocolVersion = protoRSTP;
                 LOG_PRTNAME(br, prt, "received RST BPDU");
                 break;
             }
             /* 14.4.e) */
             /* Valid MST BPDU */
-            bpdu->protocolVersion = protoMSTP;
-            prt->rcvdBpduNumOfMstis = mstis_size
-                                      / sizeof(msti_configuration_message_t);
+            protocolVersion = protoMSTP;
+            num_mstis = mstis_size / sizeof(msti_configuration_message_t);
+            if(MST_BPDU_SIZE_WO_MSTI_MSGS + mstis_size > size)
+            {
+                /* Do not read past the end of the frame */
+                num_mstis = (size - MST_BPDU_SIZE_WO_MSTI_MSGS)
+                            / sizeof(msti_configuration_message_t);
+                INFO_PRTNAME(br, prt, "MST BPDU is truncated, "
+                             "only %d MSTI messages present", num_mstis);
+            }
             LOG_PRTNAME(br, prt, "received MST BPDU%s with %d MSTIs",
                         (bpdu->flags & (1 << offsetTc)) ? ", tcFlag" : "",
-                        prt->rcvdBpduNumOfMstis
+                        num_mstis
                        );
             break;
         default:
             goto bpdu_validation_failed;
     }
 
-    if((protoSTP == bpdu->protocolVersion) && (bpduTypeTCN == bpdu->bpduType))
+    if((protoSTP == protocolVersion) && (bpduTypeTCN == bpdu->bpduType))
     {
         ++(prt->num_rx_tcn);
     }
@@ -695,8 +1112,39 @@ bpdu_validation_failed:
             ++(prt->num_rx_tcn);
     }
 
-    assign(prt->rcvdBpduData, *bpdu);
-    prt->rcvdBpdu = true;
+    if(RCVD_BPDU_QUEUE_LEN == prt->rcvdBpduCount)
+    {
+        /* The newest information supersedes the one which is still
+         * waiting, so overwrite the last queued BPDU */
+        LOG_PRTNAME(br, prt, "Receive queue is full, replace last BPDU");
+        --(prt->rcvdBpduCount);
+    }
+    rb = &prt->rcvdBpduQueue[(prt->rcvdBpduHead + prt->rcvdBpduCount)
+                             % RCVD_BPDU_QUEUE_LEN];
+    if(num_mstis > rb->mstis_alloc)
+    {
+        msti_configuration_message_t *mstis;
+
+        mstis = realloc(rb->mstis, num_mstis * sizeof(*mstis));
+        if(!mstis)
+        {
+            ERROR_PRTNAME(br, prt, "Out of memory, BPDU dropped");
+            return;
+        }
+        rb->mstis = mstis;
+        rb->mstis_alloc = num_mstis;
+    }
+    memset(rb->hdr, 0, sizeof(rb->hdr));
+    memcpy(rb->hdr, bpdu,
+           (size < sizeof(rb->hdr)) ? size : sizeof(rb->hdr));
+    ((bpdu_t *)rb->hdr)->protocolVersion = protocolVersion;
+    memcpy(rb->mstis, bpdu->mstConfiguration,
+           num_mstis * sizeof(msti_configuration_message_t));
+    rb->num_mstis = num_mstis;
+    /* If the queue was empty, the BPDU goes to the state machines right
+     * away. Otherwise rcvdBpdu_next() will hand it over later */
+    if(0 == prt->rcvdBpduCount++)
+        prt->rcvdBpdu = true;
 
     /* Reset bridge assurance on receipt of valid BPDU */
     if(prt->BaInconsistent)
@@ -706,7 +1154,10 @@ bpdu_validation_failed:
     }
     updtbrAssuRcvdInfoWhile(prt);
 
-    br_state_machines_run(br);
+    sm_mark_port(prt);
+    /* State machines will run once for all the BPDUs received
+     * in this main loop iteration (see MSTP_IN_run_pending) */
+    br->run_pending = true;
 }
 
 /* 12.8.1.1 Read CIST Bridge Protocol Parameters */
@@ -759,17 +1210,15 @@ void MSTP_IN_get_msti_bridge_status(tree_t *tree, MSTI_BridgeStatus *status)
     assign(status->root_port_id, tree->rootPortId);
 }
 
-/* 12.8.1.3 Set CIST Bridge Protocol Parameters */
-int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg)
+/* Validate CIST Bridge Protocol Parameters against the Bridge Times
+ * *max_age and *forward_delay, which are updated to the values the
+ * bridge would have after the change */
+int MSTP_IN_check_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg,
+                                     __u8 *max_age, __u8 *forward_delay)
 {
-    bool changed, changedBridgeTimes, init;
     int r = 0;
     __u8 new_forward_delay, new_max_age;
-    tree_t *tree;
-    port_t *prt;
-    per_tree_port_t *ptp;
 
-    /* Firstly, validation */
     if(cfg->set_bridge_max_age)
     {
         new_max_age = cfg->bridge_max_age;
@@ -781,7 +1230,7 @@ int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg)
         }
     }
     else
-        new_max_age = br->Max_Age;
+        new_max_age = *max_age;
 
     if(cfg->set_bridge_forward_delay)
     {
@@ -794,7 +1243,7 @@ int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg)
         }
     }
     else
-        new_forward_delay = br->Forward_Delay;
+        new_forward_delay = *forward_delay;
 
     if(cfg->set_bridge_max_age || cfg->set_bridge_forward_delay)
     {
@@ -862,6 +1311,29 @@ int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg)
     if(r)
         return r;
 
+    *max_age = new_max_age;
+    *forward_delay = new_forward_delay;
+    return 0;
+}
+
+/* 12.8.1.3 Set CIST Bridge Protocol Parameters */
+int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg)
+{
+    bool changed, changedBridgeTimes, init;
+    int r;
+    __u8 new_forward_delay, new_max_age;
+    tree_t *tree;
+    port_t *prt;
+    per_tree_port_t *ptp;
+
+    /* Firstly, validation */
+    new_max_age = br->Max_Age;
+    new_forward_delay = br->Forward_Delay;
+    r = MSTP_IN_check_cist_bridge_config(br, cfg, &new_max_age,
+                                         &new_forward_delay);
+    if(r)
+        return r;
+
     /* Secondly, do set */
     changed = changedBridgeTimes = init = false;
 
@@ -882,6 +1354,7 @@ int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg)
       )
     {
         br->ForceProtocolVersion = cfg->protocol_version;
+        br_txBpdu_invalidate(br);
         changed = init = true;
     }
 
@@ -943,13 +1416,14 @@ int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg)
          */
             FOREACH_PTP_IN_TREE(ptp, tree)
             {
-                ptp->selected = false;
-                ptp->reselect = true;
+                ptp->hot->selected = false;
+                ptp->hot->reselect = true;
                 /* TODO: change this when Hello_Time will be configurable
                  *   per-port. For now, copy Bridge's Hello_Time
                  *   to the port's Hello_Time.
                  */
                 assign(ptp->portTimes.Hello_Time, br->Hello_Time);
+                txBpdu_invalidate(ptp->port);
             }
         }
     }
@@ -989,8 +1463,8 @@ int MSTP_IN_set_msti_bridge_config(tree_t *tree, __u8 bridge_priority)
      *  because 12.8.1.3.4.c) requires it */
     FOREACH_PTP_IN_TREE(ptp, tree)
     {
-        ptp->selected = false;
-        ptp->reselect = true;
+        ptp->hot->selected = false;
+        ptp->hot->reselect = true;
     }
     return 0;
 }
@@ -999,6 +1473,9 @@ int MSTP_IN_set_msti_bridge_config(tree_t *tree, __u8 bridge_priority)
 void MSTP_IN_get_cist_port_status(port_t *prt, CIST_PortStatus *status)
 {
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
+    port_priority_vector_t portPriority;
+
+    PTP_PRIORITY(&portPriority, cist, portKey);
     /* 12.8.2.2.3 b) */
     status->uptime = (signed int)((prt->bridge)->uptime)
                      - (signed int)(cist->start_time);
@@ -1007,14 +1484,14 @@ void MSTP_IN_get_cist_port_status(port_t *prt, CIST_PortStatus *status)
     assign(status->admin_external_port_path_cost,
            prt->AdminExternalPortPathCost);
     assign(status->external_port_path_cost, prt->ExternalPortPathCost);
-    assign(status->designated_root, cist->portPriority.RootID);
+    assign(status->designated_root, portPriority.RootID);
     assign(status->designated_external_cost,
-           __be32_to_cpu(cist->portPriority.ExtRootPathCost));
-    assign(status->designated_bridge, cist->portPriority.DesignatedBridgeID);
-    assign(status->designated_port, cist->portPriority.DesignatedPortID);
-    assign(status->designated_regional_root, cist->portPriority.RRootID);
+           __be32_to_cpu(portPriority.ExtRootPathCost));
+    assign(status->designated_bridge, portPriority.DesignatedBridgeID);
+    assign(status->designated_port, portPriority.DesignatedPortID);
+    assign(status->designated_regional_root, portPriority.RRootID);
     assign(status->designated_internal_cost,
-           __be32_to_cpu(cist->portPriority.IntRootPathCost));
+           __be32_to_cpu(portPriority.IntRootPathCost));
     status->tc_ack = prt->tcAck;
     assign(status->port_hello_time, cist->portTimes.Hello_Time);
     status->admin_edge_port = prt->AdminEdgePort;
@@ -1025,7 +1502,7 @@ void MSTP_IN_get_cist_port_status(port_t *prt, CIST_PortStatus *status)
     status->oper_p2p = prt->operPointToPointMAC;
     status->restricted_role = prt->restrictedRole;
     status->restricted_tcn = prt->restrictedTcn;
-    status->role = cist->role;
+    status->role = cist->hot->role;
     status->disputed = cist->disputed;
     assign(status->admin_internal_port_path_cost,
            cist->AdminInternalPortPathCost);
@@ -1040,6 +1517,7 @@ void MSTP_IN_get_cist_port_status(port_t *prt, CIST_PortStatus *status)
     status->num_rx_tcn = prt->num_rx_tcn;
     status->num_tx_bpdu = prt->num_tx_bpdu;
     status->num_tx_tcn = prt->num_tx_tcn;
+    status->num_tx_failed = prt->num_tx_failed;
     status->num_trans_fwd = prt->num_trans_fwd;
     status->num_trans_blk = prt->num_trans_blk;
     status->rcvdBpdu = prt->rcvdBpdu;
@@ -1054,6 +1532,8 @@ void MSTP_IN_get_cist_port_status(port_t *prt, CIST_PortStatus *status)
 void MSTP_IN_get_msti_port_status(per_tree_port_t *ptp,
                                   MSTI_PortStatus *status)
 {
+    port_priority_vector_t portPriority;
+
     status->uptime = (signed int)((ptp->port->bridge)->uptime)
                      - (signed int)(ptp->start_time);
     status->state = ptp->state;
@@ -1061,25 +1541,20 @@ void MSTP_IN_get_msti_port_status(per_tree_port_t *ptp,
     assign(status->admin_internal_port_path_cost,
            ptp->AdminInternalPortPathCost);
     assign(status->internal_port_path_cost, ptp->InternalPortPathCost);
-    assign(status->designated_regional_root, ptp->portPriority.RRootID);
+    PTP_PRIORITY(&portPriority, ptp, portKey);
+    assign(status->designated_regional_root, portPriority.RRootID);
     assign(status->designated_internal_cost,
-           __be32_to_cpu(ptp->portPriority.IntRootPathCost));
-    assign(status->designated_bridge, ptp->portPriority.DesignatedBridgeID);
-    assign(status->designated_port, ptp->portPriority.DesignatedPortID);
-    status->role = ptp->role;
+           __be32_to_cpu(portPriority.IntRootPathCost));
+    assign(status->designated_bridge, portPriority.DesignatedBridgeID);
+    assign(status->designated_port, portPriority.DesignatedPortID);
+    status->role = ptp->hot->role;
     status->disputed = ptp->disputed;
 }
 
-/* 12.8.2.3 Set CIST port parameters */
-int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
+/* Validate CIST port parameters. Out-of-range values which are not
+ * errors are replaced with the defaults */
+int MSTP_IN_check_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
 {
-    bool changed;
-    __u32 new_ExternalPathCost;
-    bool new_p2p;
-    per_tree_port_t *cist;
-    bridge_t *br = prt->bridge;
-
-    /* Firstly, validation */
     if(cfg->set_admin_p2p)
     {
         switch(cfg->admin_p2p)
@@ -1093,6 +1568,23 @@ int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
         }
     }
 
+    return 0;
+}
+
+/* 12.8.2.3 Set CIST port parameters */
+int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
+{
+    bool changed;
+    __u32 new_ExternalPathCost;
+    bool new_p2p;
+    per_tree_port_t *cist;
+    bridge_t *br = prt->bridge;
+    int r;
+
+    /* Firstly, validation */
+    if((r = MSTP_IN_check_cist_port_config(prt, cfg)))
+        return r;
+
     /* Secondly, do set */
     changed = false;
 
@@ -1108,8 +1600,8 @@ int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
             changed = true;
             /* 12.8.2.3.4 */
             cist = GET_CIST_PTP_FROM_PORT(prt);
-            cist->selected = false;
-            cist->reselect = true;
+            cist->hot->selected = false;
+            cist->hot->reselect = true;
         }
     }
 
@@ -1225,6 +1717,22 @@ int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg)
     return 0;
 }
 
+/* Validate MSTI port parameters of the port prt in the tree mstid */
+int MSTP_IN_check_msti_port_config(port_t *prt, __u16 mstid,
+                                   MSTI_PortConfig *cfg)
+{
+    bridge_t *br = prt->bridge;
+
+    if(cfg->set_port_priority && (15 < cfg->port_priority))
+    {
+        ERROR("%s:%s:%hu Port Priority must be between 0 and 15",
+              br->sysdeps.name, prt->sysdeps.name, mstid);
+        return -1;
+    }
+
+    return 0;
+}
+
 /* 12.8.2.4 Set MSTI port parameters */
 int MSTP_IN_set_msti_port_config(per_tree_port_t *ptp, MSTI_PortConfig *cfg)
 {
@@ -1233,15 +1741,14 @@ int MSTP_IN_set_msti_port_config(per_tree_port_t *ptp, MSTI_PortConfig *cfg)
     bool changed = false;
     port_t *prt = ptp->port;
     bridge_t *br = prt->bridge;
+    int r;
+
+    if((r = MSTP_IN_check_msti_port_config(prt, __be16_to_cpu(ptp->MSTID),
+                                           cfg)))
+        return r;
 
     if(cfg->set_port_priority)
     {
-        if(15 < cfg->port_priority)
-        {
-            ERROR_MSTINAME(br, prt, ptp,
-                           "Port Priority must be between 0 and 15");
-            return -1;
-        }
         valuePri = cfg->port_priority << 4;
         if(GET_PRIORITY_FROM_IDENTIFIER(ptp->portId) != valuePri)
         {
@@ -1266,8 +1773,8 @@ int MSTP_IN_set_msti_port_config(per_tree_port_t *ptp, MSTI_PortConfig *cfg)
     if(changed && prt->portEnabled)
     {
         /* 12.8.2.4.4 */
-        ptp->selected = false;
-        ptp->reselect = true;
+        ptp->hot->selected = false;
+        ptp->hot->reselect = true;
 
         br_state_machines_run(br);
     }
@@ -1285,6 +1792,7 @@ int MSTP_IN_port_mcheck(port_t *prt)
     {
         prt->mcheck = true;
         cist->proposing = true;
+        txBpdu_invalidate(prt);
         br_state_machines_run(br);
     }
 
@@ -1294,20 +1802,15 @@ int MSTP_IN_port_mcheck(port_t *prt)
 /* 12.10.3.8 Set VID to FID allocation */
 bool MSTP_IN_set_vid2fid(bridge_t *br, __u16 vid, __u16 fid)
 {
-    bool vid2mstid_changed;
-
     if((vid < 1) || (vid > MAX_VID) || (fid > MAX_FID))
     {
         ERROR_BRNAME(br, "Error allocating VID(%hu) to FID(%hu)", vid, fid);
         return false;
     }
 
-    vid2mstid_changed =
-        (br->fid2mstid[fid] != br->fid2mstid[br->vid2fid[vid]]);
-    br->vid2fid[vid] = fid;
-    if(vid2mstid_changed)
+    if(set_vid2fid(br, vid, fid))
     {
-        RecalcConfigDigest(br);
+        ConfigDigestChanged(br);
         br_state_machines_begin(br);
     }
 
@@ -1321,6 +1824,7 @@ bool MSTP_IN_set_all_vids2fids(bridge_t *br, __u16 *vids2fids)
     int vid;
 
     vid2mstid_changed = false;
+    br->vid2fid[0] = vids2fids[0];
     for(vid = 1; vid <= MAX_VID; ++vid)
     {
         if(vids2fids[vid] > MAX_FID)
@@ -1328,13 +1832,12 @@ bool MSTP_IN_set_all_vids2fids(bridge_t *br, __u16 *vids2fids)
             vids2fids[vid] = br->vid2fid[vid];
             continue;
         }
-        if(br->fid2mstid[vids2fids[vid]] != br->fid2mstid[br->vid2fid[vid]])
+        if(set_vid2fid(br, vid, vids2fids[vid]))
             vid2mstid_changed = true;
     }
-    memcpy(br->vid2fid, vids2fids, sizeof(br->vid2fid));
     if(vid2mstid_changed)
     {
-        RecalcConfigDigest(br);
+        ConfigDigestChanged(br);
         br_state_machines_begin(br);
     }
 
@@ -1347,7 +1850,6 @@ bool MSTP_IN_set_fid2mstid(bridge_t *br, __u16 fid, __u16 mstid)
     tree_t *tree;
     __be16 MSTID;
     bool found;
-    int vid;
 
     if(fid > MAX_FID)
     {
@@ -1371,19 +1873,10 @@ bool MSTP_IN_set_fid2mstid(bridge_t *br, __u16 fid, __u16 mstid)
         return false;
     }
 
-    if(br->fid2mstid[fid] != MSTID)
+    if(set_fid2mstid(br, fid, MSTID))
     {
-        br->fid2mstid[fid] = MSTID;
-        /* check if there are VLANs using this FID */
-        for(vid = 1; vid <= MAX_VID; ++vid)
-        {
-            if(br->vid2fid[vid] == fid)
-            {
-                RecalcConfigDigest(br);
-                br_state_machines_begin(br);
-                break;
-            }
-        }
+        ConfigDigestChanged(br);
+        br_state_machines_begin(br);
     }
 
     return true;
@@ -1395,8 +1888,7 @@ bool MSTP_IN_set_all_fids2mstids(bridge_t *br, __u16 *fids2mstids)
     tree_t *tree;
     __be16 MSTID[MAX_FID + 1];
     bool found, vid2mstid_changed;
-    int fid, vid;
-    __be16 prev_vid2mstid[MAX_VID + 2];
+    int fid;
 
     for(fid = 0; fid <= MAX_FID; ++fid)
     {
@@ -1424,21 +1916,15 @@ bool MSTP_IN_set_all_fids2mstids(bridge_t *br, __u16 *fids2mstids)
         }
     }
 
-    for(vid = 1; vid <= MAX_VID; ++vid)
-        prev_vid2mstid[vid] = br->fid2mstid[br->vid2fid[vid]];
-    memcpy(br->fid2mstid, MSTID, sizeof(br->fid2mstid));
     vid2mstid_changed = false;
-    for(vid = 1; vid <= MAX_VID; ++vid)
+    for(fid = 0; fid <= MAX_FID; ++fid)
     {
-        if(prev_vid2mstid[vid] != br->fid2mstid[br->vid2fid[vid]])
-        {
+        if(set_fid2mstid(br, fid, MSTID[fid]))
             vid2mstid_changed = true;
-            break;
-        }
     }
     if(vid2mstid_changed)
     {
-        RecalcConfigDigest(br);
+        ConfigDigestChanged(br);
         br_state_machines_begin(br);
     }
 
@@ -1524,8 +2010,10 @@ bool MSTP_IN_create_msti(bridge_t *br, __u16 mstid)
             {
                 list_del(&ptp->port_list);
                 list_del(&ptp->tree_list);
-                free(ptp);
+                free_ptp(br, ptp);
             }
+            free(new_tree->hot);
+            obj_pool_free(&br->tree_pool, new_tree);
             return false;
         }
         list_add(&new_ptp->port_list, &ptp_after->port_list);
@@ -1533,6 +2021,7 @@ bool MSTP_IN_create_msti(bridge_t *br, __u16 mstid)
     }
 
     list_add(&new_tree->bridge_list, &tree_after->bridge_list);
+    br_txBpdu_invalidate(br);
     /* There are no FIDs allocated to this MSTID, so VID-to-MSTID mapping
      *  did not change. So, no need in RecalcConfigDigest.
      * Just initialize state machines for this tree.
@@ -1584,13 +2073,17 @@ bool MSTP_IN_delete_msti(bridge_t *br, __u16 mstid)
     }
 
     list_del(&tree->bridge_list);
+    list_del(&tree->sm_list);
     list_for_each_entry_safe(ptp, nxt, &tree->ports, tree_list)
     {
         list_del(&ptp->port_list);
         list_del(&ptp->tree_list);
-        free(ptp);
+        free_ptp(br, ptp);
     }
-    free(tree);
+    free(tree->rootHeap);
+    free(tree->hot);
+    obj_pool_free(&br->tree_pool, tree);
+    br_txBpdu_invalidate(br);
 
     /* There are no FIDs allocated to this MSTID, so VID-to-MSTID mapping
      *  did not change. So, no need in RecalcConfigDigest.
@@ -1616,10 +2109,61 @@ void MSTP_IN_set_mst_config_id(bridge_t *br, __u16 revision, __u8 *name)
                sizeof(br->MstConfigId.s.configuration_name));
         strncpy((char *)br->MstConfigId.s.configuration_name, (char *)name,
                 sizeof(br->MstConfigId.s.configuration_name) - 1);
+        br_txBpdu_invalidate(br);
         br_state_machines_begin(br);
     }
 }
 
+void MSTP_IN_config_begin(bridge_t *br)
+{
+    ++br->config_txn;
+}
+
+void MSTP_IN_config_commit(bridge_t *br)
+{
+    bool begin, run;
+
+    if(!br->config_txn || --br->config_txn)
+        return;
+
+    begin = br->config_txn_begin;
+    run = br->config_txn_run;
+    br->config_txn_begin = br->config_txn_run = false;
+    if(begin)
+        br_state_machines_begin(br);
+    else if(run)
+        br_state_machines_run(br);
+}
+
+void MSTP_IN_get_mst_config_id(bridge_t *br,
+                               mst_configuration_identifier_t *cfg)
+{
+    *cfg = *get_MstConfigId(br);
+}
+
+/* Get the VIDs allocated to the tree with MSTID, walking the VID lists
+ * of its FIDs. At most max_vids VIDs are stored; the walk stops once
+ * there are more, and then max_vids + 1 is returned */
+int MSTP_IN_get_tree_vids(bridge_t *br, __be16 MSTID, __u16 *vids,
+                          int max_vids)
+{
+    int fid, num_vids = 0;
+    __u16 vid;
+
+    for(fid = 0; fid <= MAX_FID; ++fid)
+    {
+        if(br->fid2mstid[fid] != MSTID)
+            continue;
+        FOREACH_VID_IN_FID(vid, br, fid)
+        {
+            if(max_vids <= num_vids)
+                return max_vids + 1;
+            vids[num_vids++] = vid;
+        }
+    }
+    return num_vids;
+}
+
 /*
  * If hint_SetToYes == true, some tcWhile in this tree has non-zero value.
  * If hint_SetToYes == false, some tcWhile in this tree has just became zero,
@@ -1659,9 +2203,91 @@ static void set_TopologyChange(tree_t *tree, bool hint_SetToYes, port_t *port)
     }
 }
 
-/* Helper functions, compare two priority vectors */
-static bool samePriorityAndTimers(port_priority_vector_t *vec1,
-                                  port_priority_vector_t *vec2,
+/* Helper functions, compare two priority vectors.
+ * All the components of the vectors are compared as unsigned big-endian
+ * numbers, most significant first (13.10), so it is enough to convert
+ * them to host order and pack them one after another into the key.
+ */
+static void priority_key(priority_key_t *key, cist_priority_key_t *ckey,
+                         const port_priority_vector_t *vec,
+                         port_identifier_t pId)
+{
+    __u64 DesignatedBridgeID = __be64_to_cpu(vec->DesignatedBridgeID.u);
+
+    key->w[0] = __be64_to_cpu(vec->RRootID.u);
+    key->w[1] = ((__u64)__be32_to_cpu(vec->IntRootPathCost) << 32)
+                | (DesignatedBridgeID >> 32);
+    key->w[2] = (DesignatedBridgeID << 32)
+                | ((__u64)__be16_to_cpu(vec->DesignatedPortID) << 16)
+                | __be16_to_cpu(pId);
+    if(ckey)
+    {
+        ckey->w[0] = __be64_to_cpu(vec->RootID.u);
+        ckey->w[1] = __be32_to_cpu(vec->ExtRootPathCost);
+    }
+}
+
+/* Unpack the priority vector from its key */
+static void priority_vector(port_priority_vector_t *vec,
+                            const priority_key_t *key,
+                            const cist_priority_key_t *ckey)
+{
+    vec->RRootID.u = __cpu_to_be64(key->w[0]);
+    vec->IntRootPathCost = __cpu_to_be32(key->w[1] >> 32);
+    vec->DesignatedBridgeID.u =
+        __cpu_to_be64((key->w[1] << 32) | (key->w[2] >> 32));
+    vec->DesignatedPortID = __cpu_to_be16(key->w[2] >> 16);
+    vec->RootID.u = ckey ? __cpu_to_be64(ckey->w[0]) : 0;
+    vec->ExtRootPathCost = ckey ? __cpu_to_be32(ckey->w[1]) : 0;
+}
+
+/* DesignatedBridgeID and DesignatedPortID of the key, in host order */
+static inline __u64 key_DesignatedBridgeID(const priority_key_t *key)
+{
+    return (key->w[1] << 32) | (key->w[2] >> 32);
+}
+
+static inline __u16 key_DesignatedPortID(const priority_key_t *key)
+{
+    return key->w[2] >> 16;
+}
+
+static inline bool samePriority(const priority_key_t *key1,
+                                const cist_priority_key_t *ckey1,
+                                const priority_key_t *key2,
+                                const cist_priority_key_t *ckey2)
+{
+    __u64 diff = (key1->w[0] ^ key2->w[0]) | (key1->w[1] ^ key2->w[1])
+                 | (key1->w[2] ^ key2->w[2]);
+
+    if(ckey1)
+        diff |= (ckey1->w[0] ^ ckey2->w[0]) | (ckey1->w[1] ^ ckey2->w[1]);
+    return !diff;
+}
+
+static inline bool betterorsamePriority(const priority_key_t *key1,
+                                        const cist_priority_key_t *ckey1,
+                                        const priority_key_t *key2,
+                                        const cist_priority_key_t *ckey2)
+{
+    if(ckey1)
+    {
+        if(ckey1->w[0] != ckey2->w[0])
+            return ckey1->w[0] < ckey2->w[0];
+        if(ckey1->w[1] != ckey2->w[1])
+            return ckey1->w[1] < ckey2->w[1];
+    }
+    if(key1->w[0] != key2->w[0])
+        return key1->w[0] < key2->w[0];
+    if(key1->w[1] != key2->w[1])
+        return key1->w[1] < key2->w[1];
+    return key1->w[2] <= key2->w[2];
+}
+
+static bool samePriorityAndTimers(const priority_key_t *key1,
+                                  const cist_priority_key_t *ckey1,
+                                  const priority_key_t *key2,
+                                  const cist_priority_key_t *ckey2,
                                   times_t *time1,
                                   times_t *time2,
                                   bool cist)
@@ -1676,89 +2302,23 @@ static bool samePriorityAndTimers(port_priority_vector_t *vec1,
             return false;
         if(cmp(time1->Hello_Time, !=, time2->Hello_Time))
             return false;
-
-        if(cmp(vec1->RootID, !=, vec2->RootID))
-            return false;
-        if(cmp(vec1->ExtRootPathCost, !=, vec2->ExtRootPathCost))
-            return false;
     }
 
     if(cmp(time1->remainingHops, !=, time2->remainingHops))
         return false;
 
-    if(cmp(vec1->RRootID, !=, vec2->RRootID))
-        return false;
-    if(cmp(vec1->IntRootPathCost, !=, vec2->IntRootPathCost))
-        return false;
-    if(cmp(vec1->DesignatedBridgeID, !=, vec2->DesignatedBridgeID))
-        return false;
-    if(cmp(vec1->DesignatedPortID, !=, vec2->DesignatedPortID))
-        return false;
-
-    return true;
-}
-
-static bool betterorsamePriority(port_priority_vector_t *vec1,
-                                 port_priority_vector_t *vec2,
-                                 port_identifier_t pId1,
-                                 port_identifier_t pId2,
-                                 bool cist)
-{
-    int result;
-
-    if(cist)
-    {
-        if(0 < (result = _ncmp(vec1->RootID, vec2->RootID)))
-            return false; /* worse */
-        else if(0 > result)
-            return true; /* better */
-        /* The same. Check further. */
-        if(0 < (result = _ncmp(vec1->ExtRootPathCost, vec2->ExtRootPathCost)))
-            return false; /* worse */
-        else if(0 > result)
-            return true; /* better */
-        /* The same. Check further. */
-    }
-
-    if(0 < (result = _ncmp(vec1->RRootID, vec2->RRootID)))
-        return false; /* worse */
-    else if(0 > result)
-        return true; /* better */
-    /* The same. Check further. */
-
-    if(0 < (result = _ncmp(vec1->IntRootPathCost, vec2->IntRootPathCost)))
-        return false; /* worse */
-    else if(0 > result)
-        return true; /* better */
-    /* The same. Check further. */
-
-    if(0 < (result = _ncmp(vec1->DesignatedBridgeID, vec2->DesignatedBridgeID)))
-        return false; /* worse */
-    else if(0 > result)
-        return true; /* better */
-    /* The same. Check further. */
-
-    if(0 < (result = _ncmp(vec1->DesignatedPortID, vec2->DesignatedPortID)))
-        return false; /* worse */
-    else if(0 > result)
-        return true; /* better */
-    /* The same. Check further. */
-
-    /* Port ID is a tie-breaker */
-    return cmp(pId1, <=, pId2);
+    return samePriority(key1, ckey1, key2, ckey2);
 }
 
 /* 13.26.1 betterorsameInfo */
 static bool betterorsameInfo(per_tree_port_t *ptp, port_info_origin_t newInfoIs)
 {
     if((ioReceived == newInfoIs) && (ioReceived == ptp->infoIs))
-        return betterorsamePriority(&ptp->msgPriority,
-                                    &ptp->portPriority,
-                                    0, 0, (0 == ptp->MSTID));
+        return betterorsamePriority(PTP_KEY(ptp, msgKey),
+                                    PTP_KEY(ptp, portKey));
     else if((ioMine == newInfoIs) && (ioMine == ptp->infoIs))
-        return betterorsamePriority(&ptp->designatedPriority,
-                                    &ptp->portPriority,
-                                    0, 0, (0 == ptp->MSTID));
+        return betterorsamePriority(PTP_KEY(ptp, designatedKey),
+                                    PTP_KEY(ptp, portKey));
     return false;
 }
 
@@ -1784,20 +2344,20 @@ static bool clearAllRcvdMsgs(port_t *prt, bool dry_run)
 /* 13.26.3 clearReselectTree */
 static void clearReselectTree(tree_t *tree)
 {
-    per_tree_port_t *ptp;
+    per_tree_port_hot_t *hot;
 
-    FOREACH_PTP_IN_TREE(ptp, tree)
-        ptp->reselect = false;
+    FOREACH_HOT_IN_TREE(hot, tree)
+        hot->reselect = false;
 }
 
 /* 13.26.4 fromSameRegion */
 static bool fromSameRegion(port_t *prt)
 {
     /* Check for rcvdRSTP is superfluous here */
-    if((protoMSTP > prt->rcvdBpduData.protocolVersion)/* || (!prt->rcvdRSTP)*/)
+    if((protoMSTP > RCVD_BPDU(prt)->protocolVersion)/* || (!prt->rcvdRSTP)*/)
         return false;
-    return cmp(prt->bridge->MstConfigId,
-               ==, prt->rcvdBpduData.mstConfigurationIdentifier);
+    return cmp(*get_MstConfigId(prt->bridge),
+               ==, RCVD_BPDU(prt)->mstConfigurationIdentifier);
 }
 
 /* 13.26.5 newTcWhile */
@@ -1813,7 +2373,8 @@ static void newTcWhile(per_tree_port_t *ptp)
     {
         per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
 
-        ptp->tcWhile = cist->portTimes.Hello_Time + 1;
+        ptp->tcWhile = TICKS(cist->portTimes.Hello_Time + 1);
+        txBpdu_invalidate(prt);
         set_TopologyChange(tree, true, prt);
 
         if(0 == ptp->MSTID)
@@ -1825,7 +2386,8 @@ static void newTcWhile(per_tree_port_t *ptp)
 
     times_t *times = &tree->rootTimes;
 
-    ptp->tcWhile = times->Max_Age + times->Forward_Delay;
+    ptp->tcWhile = TICKS(times->Max_Age + times->Forward_Delay);
+    txBpdu_invalidate(prt);
     set_TopologyChange(tree, true, prt);
 }
 
@@ -1836,10 +2398,10 @@ static port_info_t rcvInfo(per_tree_port_t *ptp)
     per_tree_port_t *ptp_1;
     bool roleIsDesignated, cist;
     bool msg_Better_port, msg_SamePriorityAndTimers_port;
-    port_priority_vector_t *mPri = &(ptp->msgPriority);
+    port_priority_vector_t msgPriority, *mPri = &msgPriority;
     times_t *mTimes = &(ptp->msgTimes);
     port_t *prt = ptp->port;
-    bpdu_t *b = &(prt->rcvdBpduData);
+    bpdu_t *b = RCVD_BPDU(prt);
 
     if(bpduTypeTCN == b->bpduType)
     {
@@ -1952,19 +2514,22 @@ static port_info_t rcvInfo(per_tree_port_t *ptp)
         assign(mTimes->remainingHops, msti_msg->remainingHops);
     }
 
-    msg_Better_port = !betterorsamePriority(&(ptp->portPriority), mPri,
-                                            0, 0, cist);
+    SET_PTP_PRIORITY(ptp, msgKey, mPri, 0);
+    msg_Better_port = !betterorsamePriority(PTP_KEY(ptp, portKey),
+                                            PTP_KEY(ptp, msgKey));
     if(roleIsDesignated)
     {
-        /* a).1) */
+        /* a).1) Same MAC address of the DesignatedBridgeID
+         *       and port number of the DesignatedPortID */
         if(msg_Better_port
-           || ((0 == memcmp(mPri->DesignatedBridgeID.s.mac_address,
-                            ptp->portPriority.DesignatedBridgeID.s.mac_address,
-                            ETH_ALEN)
+           || ((0 == ((key_DesignatedBridgeID(&ptp->msgKey)
+                       ^ key_DesignatedBridgeID(&ptp->portKey)
+                      ) & 0xFFFFFFFFFFFFULL
+                     )
                )
-               && (0 == ((mPri->DesignatedPortID
-                          ^ ptp->portPriority.DesignatedPortID
-                         ) & __constant_cpu_to_be16(0x0FFF)
+               && (0 == ((key_DesignatedPortID(&ptp->msgKey)
+                          ^ key_DesignatedPortID(&ptp->portKey)
+                         ) & 0x0FFF
                         )
                   )
               )
@@ -1977,11 +2542,12 @@ static port_info_t rcvInfo(per_tree_port_t *ptp)
          *   msgPriority _IS_SAME_as portPriority.
         */
         msg_SamePriorityAndTimers_port =
-            samePriorityAndTimers(mPri, &(ptp->portPriority),
+            samePriorityAndTimers(PTP_KEY(ptp, msgKey), PTP_KEY(ptp, portKey),
                                   mTimes, &(ptp->portTimes),
                                   cist);
         if((!msg_SamePriorityAndTimers_port)
-           && betterorsamePriority(mPri, &(ptp->portPriority), 0, 0, cist)
+           && betterorsamePriority(PTP_KEY(ptp, msgKey),
+                                   PTP_KEY(ptp, portKey))
           )
             return SuperiorDesignatedInfo;
 
@@ -2005,9 +2571,11 @@ static void recordAgreement(per_tree_port_t *ptp)
 {
     bool cist_agreed, cist_proposing;
     per_tree_port_t *cist;
+    port_priority_vector_t cistPortPriority;
     port_t *prt = ptp->port;
-    bpdu_t *b = &(prt->rcvdBpduData);
+    bpdu_t *b = RCVD_BPDU(prt);
 
+    txBpdu_invalidate(prt);
     if(0 == ptp->MSTID)
     { /* CIST */
         if(rstpVersion(prt->bridge) && prt->operPointToPointMAC
@@ -2031,10 +2599,11 @@ static void recordAgreement(per_tree_port_t *ptp)
     }
     /* MSTI */
     cist = GET_CIST_PTP_FROM_PORT(prt);
+    PTP_PRIORITY(&cistPortPriority, cist, portKey);
     if(prt->operPointToPointMAC 
-       && cmp(b->cistRootID, ==, cist->portPriority.RootID)
-       && cmp(b->cistExtRootPathCost, ==, cist->portPriority.ExtRootPathCost)
-       && cmp(b->cistRRootID, ==, cist->portPriority.RRootID)
+       && cmp(b->cistRootID, ==, cistPortPriority.RootID)
+       && cmp(b->cistExtRootPathCost, ==, cistPortPriority.ExtRootPathCost)
+       && cmp(b->cistRRootID, ==, cistPortPriority.RRootID)
        && (ptp->rcvdMstiConfig->flags & (1 << offsetAgreement))
       )
     {
@@ -2062,7 +2631,7 @@ static void recordDispute(per_tree_port_t *ptp)
          *  setTcFlags() we do the same.
          * But that is only a guess and I could be wrong here ;)
          */
-        if(prt->rcvdBpduData.flags & (1 << offsetLearnig))
+        if(RCVD_BPDU(prt)->flags & (1 << offsetLearnig))
         {
             ptp->disputed = true;
             ptp->agreed = false;
@@ -2103,7 +2672,8 @@ static void recordMastered(per_tree_port_t *ptp)
 /* 13.26.f) recordPriority */
 static void recordPriority(per_tree_port_t *ptp)
 {
-    assign(ptp->portPriority, ptp->msgPriority);
+    COPY_PTP_KEY(ptp, portKey, msgKey);
+    rolesStale_ptp(ptp);
 }
 
 /* 13.26.10 recordProposal */
@@ -2124,7 +2694,7 @@ static void recordProposal(per_tree_port_t *ptp)
     if(0 == ptp->MSTID)
     { /* CIST */
         prt = ptp->port;
-        if(prt->rcvdBpduData.flags & (1 << offsetProposal))
+        if(RCVD_BPDU(prt)->flags & (1 << offsetProposal))
             ptp->proposed = true;
         cist_proposed = ptp->proposed;
         if(!prt->rcvdInternal)
@@ -2180,7 +2750,7 @@ static void set_fdbFlush(per_tree_port_t *ptp)
         unsigned int FwdDelay = cist->designatedTimes.Forward_Delay;
         /* Initiate rapid ageing */
         MSTP_OUT_set_ageing_time(prt, FwdDelay);
-        assign(prt->rapidAgeingWhile, FwdDelay);
+        assign(prt->rapidAgeingWhile, TICKS(FwdDelay));
         ptp->fdbFlush = false;
     }
 }
@@ -2198,7 +2768,7 @@ static void setRcvdMsgs(port_t *prt)
     /* 802.1Q-2005 says:
      *   "Make the received CST or CIST message available to the CIST Port
      *    Information state machines"
-     * No need to do something special here, we already have rcvdBpduData.
+     * No need to do something special here, we already have RCVD_BPDU(prt).
      */
 
     if(prt->rcvdInternal)
@@ -2207,8 +2777,8 @@ static void setRcvdMsgs(port_t *prt)
         {
             found = false;
             /* Find if message for this MSTI is conveyed in the BPDU */
-            for(i = 0, msti_msg = prt->rcvdBpduData.mstConfiguration;
-                i < prt->rcvdBpduNumOfMstis;
+            for(i = 0, msti_msg = RCVD_BPDU_ENTRY(prt)->mstis;
+                i < RCVD_BPDU_ENTRY(prt)->num_mstis;
                 ++i, ++msti_msg)
             {
                 msg_MSTID = msti_msg->mstiRRootID.s.priority
@@ -2230,7 +2800,7 @@ static void setRcvdMsgs(port_t *prt)
                  * We set pointer to the MSTI configuration message for
                  * fast access, while do not anything special for common
                  * parts of the message, as the whole message is available
-                 * in rcvdBpduData.
+                 * in RCVD_BPDU(prt).
                  */
                 ptp->rcvdMstiConfig = msti_msg;
             }
@@ -2241,16 +2811,17 @@ static void setRcvdMsgs(port_t *prt)
 /* 13.26.13 setReRootTree */
 static void setReRootTree(tree_t *tree)
 {
-    per_tree_port_t *ptp;
+    per_tree_port_hot_t *hot;
 
-    FOREACH_PTP_IN_TREE(ptp, tree)
-        ptp->reRoot = true;
+    FOREACH_HOT_IN_TREE(hot, tree)
+        hot->reRoot = true;
+    sm_mark_tree_ports(tree);
 }
 
 /* 13.26.14 setSelectedTree */
 static void setSelectedTree(tree_t *tree)
 {
-    per_tree_port_t *ptp;
+    per_tree_port_hot_t *hot;
 
     /*
      * 802.1Q-2005 says that I should check "reselect" var
@@ -2264,17 +2835,18 @@ static void setSelectedTree(tree_t *tree)
      * And we know that clearReselectTree resets "reselect" for all ports
      * and updtRolesTree() does not change value of "reselect".
      */
-    FOREACH_PTP_IN_TREE(ptp, tree)
-        ptp->selected = true;
+    FOREACH_HOT_IN_TREE(hot, tree)
+        hot->selected = true;
 }
 
 /* 13.26.15 setSyncTree */
 static void setSyncTree(tree_t *tree)
 {
-    per_tree_port_t *ptp;
+    per_tree_port_hot_t *hot;
 
-    FOREACH_PTP_IN_TREE(ptp, tree)
-        ptp->sync = true;
+    FOREACH_HOT_IN_TREE(hot, tree)
+        hot->sync = true;
+    sm_mark_tree_ports(tree);
 }
 
 /* 13.26.16 setTcFlags */
@@ -2286,7 +2858,7 @@ static void setTcFlags(per_tree_port_t *ptp)
     if(0 == ptp->MSTID)
     { /* CIST */
         prt = ptp->port;
-        cistFlags = prt->rcvdBpduData.flags;
+        cistFlags = RCVD_BPDU(prt)->flags;
         if(cistFlags & (1 << offsetTcAck))
             prt->rcvdTcAck = true;
         if(cistFlags & (1 << offsetTc))
@@ -2314,7 +2886,10 @@ static void setTcPropTree(per_tree_port_t *ptp)
     FOREACH_PTP_IN_TREE(ptp_1, ptp->tree)
     {
         if(ptp != ptp_1)
+        {
             ptp_1->tcProp = true;
+            sm_mark_port(ptp_1->port);
+        }
     }
 }
 
@@ -2332,10 +2907,12 @@ static void syncMaster(bridge_t *br)
             /* for each Port that has infoInternal set */
             if(ptp->port->infoInternal)
             {
+                txBpdu_invalidate(ptp->port);
                 ptp->agree = false;
                 ptp->agreed = false;
-                ptp->synced = false;
-                ptp->sync = true;
+                ptp->hot->synced = false;
+                ptp->hot->sync = true;
+                sm_mark_port(ptp->port);
             }
         }
     }
@@ -2346,8 +2923,9 @@ static void txConfig(port_t *prt)
 {
     bpdu_t b;
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
+    port_priority_vector_t designatedPriority;
 
-    if(prt->deleted || (roleDisabled == cist->role) || prt->dontTxmtBpdu)
+    if(prt->deleted || (roleDisabled == cist->hot->role) || prt->dontTxmtBpdu)
         return;
 
     b.protocolIdentifier = 0;
@@ -2360,10 +2938,11 @@ static void txConfig(port_t *prt)
     b.flags = (0 != cist->tcWhile) ? (1 << offsetTc) : 0;
     if(prt->tcAck)
         b.flags |= (1 << offsetTcAck);
-    assign(b.cistRootID, cist->designatedPriority.RootID);
-    assign(b.cistExtRootPathCost, cist->designatedPriority.ExtRootPathCost);
-    assign(b.cistRRootID, cist->designatedPriority.DesignatedBridgeID);
-    assign(b.cistPortID, cist->designatedPriority.DesignatedPortID);
+    PTP_PRIORITY(&designatedPriority, cist, designatedKey);
+    assign(b.cistRootID, designatedPriority.RootID);
+    assign(b.cistExtRootPathCost, designatedPriority.ExtRootPathCost);
+    assign(b.cistRRootID, designatedPriority.DesignatedBridgeID);
+    assign(b.cistPortID, designatedPriority.DesignatedPortID);
     b.MessageAge[0] = cist->designatedTimes.Message_Age;
     b.MessageAge[1] = 0;
     b.MaxAge[0] = cist->designatedTimes.Max_Age;
@@ -2378,7 +2957,7 @@ static void txConfig(port_t *prt)
 
 static inline __u8 message_role_from_port_role(per_tree_port_t *ptp)
 {
-    switch(ptp->role)
+    switch(ptp->hot->role)
     {
         case roleRoot:
             return encodedRoleRoot;
@@ -2401,67 +2980,78 @@ static inline __u8 message_role_from_port_role(per_tree_port_t *ptp)
  */
 static void txMstp(port_t *prt)
 {
-    bpdu_t b;
+    bpdu_t *b = &prt->txBpdu;
     bridge_t *br = prt->bridge;
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
+    port_priority_vector_t designatedPriority;
     int msti_msgs_total_size;
     per_tree_port_t *ptp;
     msti_configuration_message_t *msti_msg;
 
-    if(prt->deleted || (roleDisabled == cist->role) || prt->dontTxmtBpdu)
+    if(prt->deleted || (roleDisabled == cist->hot->role) || prt->dontTxmtBpdu)
         return;
 
-    b.protocolIdentifier = 0;
-    b.bpduType = bpduTypeRST;
+    /* Nothing has changed since the last BPDU, send it again */
+    if(prt->txBpduValid)
+    {
+        MSTP_OUT_tx_bpdu(prt, b, prt->txBpduSize);
+        return;
+    }
+
+    b->protocolIdentifier = 0;
+    b->bpduType = bpduTypeRST;
     /* Standard says "{tcWhile, agree, proposing} ... for the Port".
      * Which one {tcWhile, agree, proposing}?
      * I guess that this means {tcWhile, agree, proposing} for the CIST.
      * But that is only a guess and I could be wrong here ;)
      */
-    b.flags = BPDU_FLAGS_ROLE_SET(message_role_from_port_role(cist));
+    b->flags = BPDU_FLAGS_ROLE_SET(message_role_from_port_role(cist));
     if(0 != cist->tcWhile)
-        b.flags |= (1 << offsetTc);
+        b->flags |= (1 << offsetTc);
     if(cist->proposing)
-        b.flags |= (1 << offsetProposal);
+        b->flags |= (1 << offsetProposal);
     if(cist->learning)
-        b.flags |= (1 << offsetLearnig);
+        b->flags |= (1 << offsetLearnig);
     if(cist->forwarding)
-        b.flags |= (1 << offsetForwarding);
+        b->flags |= (1 << offsetForwarding);
     if(cist->agree)
-        b.flags |= (1 << offsetAgreement);
-    assign(b.cistRootID, cist->designatedPriority.RootID);
-    assign(b.cistExtRootPathCost, cist->designatedPriority.ExtRootPathCost);
-    assign(b.cistRRootID, cist->designatedPriority.RRootID);
-    assign(b.cistPortID, cist->designatedPriority.DesignatedPortID);
-    b.MessageAge[0] = cist->designatedTimes.Message_Age;
-    b.MessageAge[1] = 0;
-    b.MaxAge[0] = cist->designatedTimes.Max_Age;
-    b.MaxAge[1] = 0;
-    b.HelloTime[0] = cist->portTimes.Hello_Time; /* ! use portTimes ! */
-    b.HelloTime[1] = 0;
-    b.ForwardDelay[0] = cist->designatedTimes.Forward_Delay;
-    b.ForwardDelay[1] = 0;
-
-    b.version1_len = 0;
+        b->flags |= (1 << offsetAgreement);
+    PTP_PRIORITY(&designatedPriority, cist, designatedKey);
+    assign(b->cistRootID, designatedPriority.RootID);
+    assign(b->cistExtRootPathCost, designatedPriority.ExtRootPathCost);
+    assign(b->cistRRootID, designatedPriority.RRootID);
+    assign(b->cistPortID, designatedPriority.DesignatedPortID);
+    b->MessageAge[0] = cist->designatedTimes.Message_Age;
+    b->MessageAge[1] = 0;
+    b->MaxAge[0] = cist->designatedTimes.Max_Age;
+    b->MaxAge[1] = 0;
+    b->HelloTime[0] = cist->portTimes.Hello_Time; /* ! use portTimes ! */
+    b->HelloTime[1] = 0;
+    b->ForwardDelay[0] = cist->designatedTimes.Forward_Delay;
+    b->ForwardDelay[1] = 0;
+
+    b->version1_len = 0;
 
     if(br->ForceProtocolVersion < protoMSTP)
     {
-        b.protocolVersion = protoRSTP;
-        MSTP_OUT_tx_bpdu(prt, &b, RST_BPDU_SIZE);
+        b->protocolVersion = protoRSTP;
+        prt->txBpduSize = RST_BPDU_SIZE;
+        prt->txBpduValid = true;
+        MSTP_OUT_tx_bpdu(prt, b, prt->txBpduSize);
         return;
     }
 
-    b.protocolVersion = protoMSTP;
+    b->protocolVersion = protoMSTP;
 
     /* MST specific fields */
-    assign(b.mstConfigurationIdentifier, br->MstConfigId);
-    assign(b.cistIntRootPathCost, cist->designatedPriority.IntRootPathCost);
-    assign(b.cistBridgeID, cist->designatedPriority.DesignatedBridgeID);
-    assign(b.cistRemainingHops, cist->designatedTimes.remainingHops);
+    assign(b->mstConfigurationIdentifier, *get_MstConfigId(br));
+    assign(b->cistIntRootPathCost, designatedPriority.IntRootPathCost);
+    assign(b->cistBridgeID, designatedPriority.DesignatedBridgeID);
+    assign(b->cistRemainingHops, cist->designatedTimes.remainingHops);
 
     msti_msgs_total_size = 0;
     ptp = cist;
-    msti_msg = b.mstConfiguration;
+    msti_msg = b->mstConfiguration;
     /* 13.26.20.f) requires that msti configs should be inserted in
      * MSTID order. This is met by inserting trees in port's list of trees
      * in sorted (by MSTID) order (see MSTP_IN_create_msti) */
@@ -2481,23 +3071,25 @@ static void txMstp(port_t *prt)
             msti_msg->flags |= (1 << offsetAgreement);
         if(ptp->master)
             msti_msg->flags |= (1 << offsetMaster);
-        assign(msti_msg->mstiRRootID, ptp->designatedPriority.RRootID);
+        PTP_PRIORITY(&designatedPriority, ptp, designatedKey);
+        assign(msti_msg->mstiRRootID, designatedPriority.RRootID);
         assign(msti_msg->mstiIntRootPathCost,
-               ptp->designatedPriority.IntRootPathCost);
+               designatedPriority.IntRootPathCost);
         msti_msg->bridgeIdentifierPriority =
-            GET_PRIORITY_FROM_IDENTIFIER(ptp->designatedPriority.DesignatedBridgeID);
+            GET_PRIORITY_FROM_IDENTIFIER(designatedPriority.DesignatedBridgeID);
         msti_msg->portIdentifierPriority =
-            GET_PRIORITY_FROM_IDENTIFIER(ptp->designatedPriority.DesignatedPortID);
+            GET_PRIORITY_FROM_IDENTIFIER(designatedPriority.DesignatedPortID);
         assign(msti_msg->remainingHops, ptp->designatedTimes.remainingHops);
 
         msti_msgs_total_size += sizeof(msti_configuration_message_t);
         ++msti_msg;
     }
 
-    assign(b.version3_len, __cpu_to_be16(MST_BPDU_VER3LEN_WO_MSTI_MSGS
+    assign(b->version3_len, __cpu_to_be16(MST_BPDU_VER3LEN_WO_MSTI_MSGS
                                          + msti_msgs_total_size));
-    MSTP_OUT_tx_bpdu(prt, &b, MST_BPDU_SIZE_WO_MSTI_MSGS
-                              + msti_msgs_total_size);
+    prt->txBpduSize = MST_BPDU_SIZE_WO_MSTI_MSGS + msti_msgs_total_size;
+    prt->txBpduValid = true;
+    MSTP_OUT_tx_bpdu(prt, b, prt->txBpduSize);
 }
 
 /* 13.26.a) txTcn */
@@ -2506,7 +3098,7 @@ static void txTcn(port_t *prt)
     bpdu_t b;
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
 
-    if(prt->deleted || (roleDisabled == cist->role) || prt->dontTxmtBpdu)
+    if(prt->deleted || (roleDisabled == cist->hot->role) || prt->dontTxmtBpdu)
         return;
 
     b.protocolIdentifier = 0;
@@ -2519,7 +3111,7 @@ static void txTcn(port_t *prt)
 /* 13.26.21 updtBPDUVersion */
 static void updtBPDUVersion(port_t *prt)
 {
-    if(protoRSTP <= prt->rcvdBpduData.protocolVersion)
+    if(protoRSTP <= RCVD_BPDU(prt)->protocolVersion)
         prt->rcvdRSTP = true;
     else
         prt->rcvdSTP = true;
@@ -2561,7 +3153,7 @@ static void updtRcvdInfoWhile(per_tree_port_t *ptp)
     if((!prt->rcvdInternal && ((Message_Age + 1) <= Max_Age))
        || (prt->rcvdInternal && (ptp->portTimes.remainingHops > 1))
       )
-        ptp->rcvdInfoWhile = 3 * Hello_Time;
+        ptp->rcvdInfoWhile = TICKS(3 * Hello_Time);
     else
         ptp->rcvdInfoWhile = 0;
 }
@@ -2570,16 +3162,332 @@ static void updtbrAssuRcvdInfoWhile(port_t *prt)
 {
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
 
-    prt->brAssuRcvdInfoWhile = 3 * cist->portTimes.Hello_Time;
+    /* Can be called outside of the state machines run */
+    PTSM_advance(prt);
+    prt->brAssuRcvdInfoWhile = TICKS(3 * cist->portTimes.Hello_Time);
 }
 
 /* 13.26.24 updtRolesDisabledTree */
 static void updtRolesDisabledTree(tree_t *tree)
 {
-    per_tree_port_t *ptp;
+    per_tree_port_hot_t *hot;
+
+    FOREACH_HOT_IN_TREE(hot, tree)
+        hot->selectedRole = roleDisabled;
+
+    if(0 == tree->MSTID)
+        br_roles_invalidate(tree->bridge);
+    else
+        tree->rootHeapValid = false;
+}
+
+/* 13.26.23 b) root path priority vector of the port and its key.
+ * Returns false if the port can not be the Root Port.
+ */
+static bool calcRootPathPriority(per_tree_port_t *ptp)
+{
+    port_priority_vector_t rootPathPriority;
+    port_priority_vector_t *root_path_priority = &rootPathPriority;
+    port_t *prt = ptp->port;
+    tree_t *tree = ptp->tree;
+
+    /* 802.1Q says to calculate root priority vector only if port
+     * is not Disabled, but check (infoIs == ioReceived) covers
+     * the case (infoIs != ioDisabled).
+     */
+    if((ioReceived != ptp->infoIs) || prt->restrictedRole
+       || (key_DesignatedBridgeID(&ptp->portKey)
+           == __be64_to_cpu(tree->BridgeIdentifier.u))
+      )
+        return false;
+
+    PTP_PRIORITY(root_path_priority, ptp, portKey);
+    if(prt->rcvdInternal)
+    {
+        assign(root_path_priority->IntRootPathCost,
+               __cpu_to_be32(__be32_to_cpu(root_path_priority->IntRootPathCost)
+                             + ptp->InternalPortPathCost)
+              );
+    }
+    else if(0 == tree->MSTID) /* Yes, this check might be superfluous,
+                               * but I want to be on the safe side */
+    {
+        assign(root_path_priority->ExtRootPathCost,
+               __cpu_to_be32(__be32_to_cpu(root_path_priority->ExtRootPathCost)
+                             + prt->ExternalPortPathCost)
+              );
+        assign(root_path_priority->RRootID, tree->BridgeIdentifier);
+        assign(root_path_priority->IntRootPathCost,
+               __constant_cpu_to_be32(0));
+    }
+    SET_PTP_PRIORITY(ptp, rootPathKey, root_path_priority, ptp->portId);
+    return true;
+}
+
+/* Binary heap of the Root Port candidates (tree->rootHeap), the best
+ * root path priority vector is on the top. Port identifiers are unique
+ * in the bridge, so there are no ties.
+ */
+static inline bool rootHeap_better(per_tree_port_t *ptp1,
+                                   per_tree_port_t *ptp2)
+{
+    return betterorsamePriority(PTP_KEY(ptp1, rootPathKey),
+                                PTP_KEY(ptp2, rootPathKey));
+}
+
+static inline void rootHeap_set(tree_t *tree, unsigned int i,
+                                per_tree_port_t *ptp)
+{
+    tree->rootHeap[i] = ptp;
+    ptp->rootHeapIndex = i;
+}
+
+static void rootHeap_sift_up(tree_t *tree, unsigned int i)
+{
+    per_tree_port_t *ptp = tree->rootHeap[i];
+    unsigned int parent;
+
+    while(0 < i)
+    {
+        parent = (i - 1) / 2;
+        if(!rootHeap_better(ptp, tree->rootHeap[parent]))
+            break;
+        rootHeap_set(tree, i, tree->rootHeap[parent]);
+        i = parent;
+    }
+    rootHeap_set(tree, i, ptp);
+}
+
+static void rootHeap_sift_down(tree_t *tree, unsigned int i)
+{
+    per_tree_port_t *ptp = tree->rootHeap[i];
+    unsigned int child;
+
+    while((child = 2 * i + 1) < tree->rootHeapLen)
+    {
+        if((child + 1 < tree->rootHeapLen)
+           && rootHeap_better(tree->rootHeap[child + 1],
+                              tree->rootHeap[child]))
+            ++child;
+        if(!rootHeap_better(tree->rootHeap[child], ptp))
+            break;
+        rootHeap_set(tree, i, tree->rootHeap[child]);
+        i = child;
+    }
+    rootHeap_set(tree, i, ptp);
+}
+
+/* Recalculate the root path priority vector of the port and move it
+ * to its new place in the heap. Returns false if the heap has no room
+ * for the port (it is rebuilt then) */
+static bool rootHeap_update(tree_t *tree, per_tree_port_t *ptp)
+{
+    per_tree_port_t *last;
+    int i = ptp->rootHeapIndex;
+
+    if(!calcRootPathPriority(ptp))
+    {
+        if(0 > i)
+            return true;
+        /* Not a candidate anymore, put the last one in its place */
+        ptp->rootHeapIndex = -1;
+        last = tree->rootHeap[--tree->rootHeapLen];
+        if(last == ptp)
+            return true;
+        rootHeap_set(tree, i, last);
+        ptp = last;
+    }
+    else if(0 > i)
+    {
+        if(tree->rootHeapLen >= tree->rootHeapSize)
+            return false;
+        i = tree->rootHeapLen++;
+        rootHeap_set(tree, i, ptp);
+    }
+
+    rootHeap_sift_up(tree, i);
+    rootHeap_sift_down(tree, ptp->rootHeapIndex);
+    return true;
+}
+
+static bool rootHeap_rebuild(tree_t *tree)
+{
+    per_tree_port_t *ptp, **heap;
+    unsigned int count = 0;
 
     FOREACH_PTP_IN_TREE(ptp, tree)
-        ptp->selectedRole = roleDisabled;
+    {
+        ptp->rootHeapIndex = -1;
+        ++count;
+    }
+    tree->rootHeapLen = 0;
+
+    if(count > tree->rootHeapSize)
+    {
+        if(!(heap = realloc(tree->rootHeap, count * sizeof(*heap))))
+        {
+            ERROR_BRNAME(tree->bridge, "Out of memory");
+            return false;
+        }
+        tree->rootHeap = heap;
+        tree->rootHeapSize = count;
+    }
+
+    FOREACH_PTP_IN_TREE(ptp, tree)
+    {
+        if(!calcRootPathPriority(ptp))
+            continue;
+        rootHeap_set(tree, tree->rootHeapLen, ptp);
+        rootHeap_sift_up(tree, tree->rootHeapLen++);
+    }
+    assign(tree->rootHeapBridgeId, tree->BridgeIdentifier);
+    return true;
+}
+
+/* 13.26.23 d), e) designatedPriority and designatedTimes of the port */
+static void updtDesignatedPort(per_tree_port_t *ptp)
+{
+    port_t *prt = ptp->port;
+    tree_t *tree = ptp->tree;
+    port_priority_vector_t designatedPriority;
+
+    /* d) Set new designatedPriority */
+    designatedPriority = tree->rootPriority;
+    assign(designatedPriority.DesignatedBridgeID, tree->BridgeIdentifier);
+    assign(designatedPriority.DesignatedPortID, ptp->portId);
+    /* I am not sure which condition to check here, as 802.1Q-2005 says:
+     * "... If {Port} is attached to a LAN that has one or more STP Bridges
+     *  attached (as determined by the Port Protocol Migration state
+     * machine) ..." -- why not to mention explicit var name? Bad IEEE.
+     * But I guess that sendSTP (i.e. !sendRSTP) var will do ;)
+     */
+    if((0 == tree->MSTID) && !prt->sendRSTP)
+        assign(designatedPriority.RRootID, tree->BridgeIdentifier);
+    SET_PTP_PRIORITY(ptp, designatedKey, &designatedPriority, 0);
+
+    /* e) Set new designatedTimes */
+    assign(ptp->designatedTimes, tree->rootTimes);
+    /* Keep the configured Hello_Time for the port.
+     * NOTE: this is in accordance with the spirit of 802.1D-2004.
+     *    Also, this does not contradict 802.1Q-2005(-2011), as in these
+     *    standards both designatedTimes and rootTimes structures
+     *    don't have Hello_Time member.
+     */
+    assign(ptp->designatedTimes.Hello_Time, ptp->portTimes.Hello_Time);
+}
+
+/* 13.26.23 f) - m) selectedRole of the port */
+static void updtRolePort(per_tree_port_t *ptp, per_tree_port_t *root_ptp)
+{
+    port_t *prt = ptp->port;
+    tree_t *tree = ptp->tree;
+    per_tree_port_t *cist_tree = GET_CIST_PTP_FROM_PORT(prt);
+    bool cist = (0 == tree->MSTID);
+
+    /* f) Set Disabled role */
+    if(ioDisabled == ptp->infoIs)
+    {
+        ptp->hot->selectedRole = roleDisabled;
+        return;
+    }
+
+    if(!cist && (ioReceived == cist_tree->infoIs) && !prt->infoInternal)
+    {
+        /* g) Set role for the boundary port in MSTI */
+        if(roleRoot == cist_tree->hot->selectedRole)
+        {
+            ptp->hot->selectedRole = roleMaster;
+            if(!samePriorityAndTimers(PTP_KEY(ptp, portKey),
+                                      PTP_KEY(ptp, designatedKey),
+                                      &ptp->portTimes,
+                                      &ptp->designatedTimes,
+                                      /*cist*/ false))
+                ptp->hot->updtInfo = true;
+            return;
+        }
+        /* Bad IEEE again! It says in 13.26.23 g) 2) that
+         * MSTI state should follow CIST state only for the case of
+         * Alternate port. This is obviously wrong!
+         * In the descriptive clause 13.13 f) it says:
+         *  "At a Boundary Port frames allocated to the CIST and
+         *   all MSTIs are forwarded or not forwarded alike.
+         *   This is because Port Role assignments are such that
+         *   if the CIST Port Role is Root Port, the MSTI Port Role
+         *   will be Master Port, and if the CIST Port Role is
+         *   Designated Port, Alternate Port, Backup Port,
+         *   or Disabled Port, each MSTI’s Port Role will be the same."
+         * So, ignore wrong 13.26.23 g) 2) and do as stated in 13.13 f) !
+         */
+        /* if(roleAlternate == cist_tree->hot->selectedRole) */
+        {
+            ptp->hot->selectedRole = cist_tree->hot->selectedRole;
+            if(!samePriorityAndTimers(PTP_KEY(ptp, portKey),
+                                      PTP_KEY(ptp, designatedKey),
+                                      &ptp->portTimes,
+                                      &ptp->designatedTimes,
+                                      /*cist*/ false))
+                ptp->hot->updtInfo = true;
+            return;
+        }
+    }
+    else
+ /* if(cist || (ioReceived != cist_tree->infoIs) || prt->infoInternal) */
+    {
+        /* h) Set role for the aged info */
+        if(ioAged == ptp->infoIs)
+        {
+            ptp->hot->selectedRole = roleDesignated;
+            ptp->hot->updtInfo = true;
+            return;
+        }
+        /* i) Set role for the mine info */
+        if(ioMine == ptp->infoIs)
+        {
+            ptp->hot->selectedRole = roleDesignated;
+            if(!samePriorityAndTimers(PTP_KEY(ptp, portKey),
+                                      PTP_KEY(ptp, designatedKey),
+                                      &ptp->portTimes,
+                                      &ptp->designatedTimes,
+                                      cist))
+                ptp->hot->updtInfo = true;
+            return;
+        }
+        if(ioReceived == ptp->infoIs)
+        {
+            /* j) Set Root role */
+            if(root_ptp == ptp)
+            {
+                ptp->hot->selectedRole = roleRoot;
+                ptp->hot->updtInfo = false;
+            }
+            else
+            {
+                if(betterorsamePriority(PTP_KEY(ptp, portKey),
+                                        PTP_KEY(ptp, designatedKey)))
+                {
+                    if(key_DesignatedBridgeID(&ptp->portKey)
+                       != __be64_to_cpu(tree->BridgeIdentifier.u))
+                    {
+                        /* k) Set Alternate role */
+                        ptp->hot->selectedRole = roleAlternate;
+                    }
+                    else
+                    {
+                        /* l) Set Backup role */
+                        ptp->hot->selectedRole = roleBackup;
+                    }
+                    /* reset updtInfo for both k) and l) */
+                    ptp->hot->updtInfo = false;
+                }
+                else /* designatedPriority is better than portPriority */
+                {
+                    /* m) Set Designated role */
+                    ptp->hot->selectedRole = roleDesignated;
+                    ptp->hot->updtInfo = true;
+                }
+            }
+        }
+    }
 }
 
 /* Aux function, not in standard.
@@ -2591,64 +3499,76 @@ static void reselectMSTIs(port_t *prt)
 
     /* For each non-CIST ptp */
     list_for_each_entry_continue(ptp, &prt->trees, port_list)
-        ptp->reselect = true;
+        ptp->hot->reselect = true;
 }
 
-/* 13.26.23 updtRolesTree */
+/* 13.26.23 updtRolesTree
+ * Only the ports queued in tree->rolesStale are looked at, unless
+ * the root priority vector, root port or root times change
+ * (see rolesStale_ptp).
+ */
 static void updtRolesTree(tree_t *tree)
 {
-    per_tree_port_t *ptp, *root_ptp = NULL;
-    port_priority_vector_t root_path_priority;
+    per_tree_port_t *ptp, *nxt, *root_ptp = NULL;
     bridge_identifier_t prevRRootID = tree->rootPriority.RRootID;
     __be32 prevExtRootPathCost = tree->rootPriority.ExtRootPathCost;
+    priority_key_t prevRootKey = tree->rootKey;
+    cist_priority_key_t prevRootCistKey = tree->rootCistKey;
+    times_t prevRootTimes = tree->rootTimes;
+    port_role_t prevSelectedRole;
     bool cist = (0 == tree->MSTID);
+    bool all;
+
+    /* Update the heap of the Root Port candidates */
+    all = !tree->rootHeapValid
+          || cmp(tree->rootHeapBridgeId, !=, tree->BridgeIdentifier);
+    if(!all)
+    {
+        list_for_each_entry(ptp, &tree->rolesStale, rolesStale_list)
+        {
+            if(!rootHeap_update(tree, ptp))
+            {
+                all = true;
+                break;
+            }
+        }
+    }
+    if(all)
+        tree->rootHeapValid = rootHeap_rebuild(tree);
 
     /* a), b) Select new root priority vector = {rootPriority, rootPortId} */
       /* Initial value = bridge priority vector = {BridgePriority, 0} */
     assign(tree->rootPriority, tree->BridgePriority);
     assign(tree->rootPortId, __constant_cpu_to_be16(0));
       /* Now check root path priority vectors of all ports in tree and see if
-       * there is a better vector */
-    FOREACH_PTP_IN_TREE(ptp, tree)
+       * there is a better vector. The best one is on top of the heap */
+    if(tree->rootHeapValid)
     {
-        port_t *prt = ptp->port;
-        /* 802.1Q says to calculate root priority vector only if port
-         * is not Disabled, but check (infoIs == ioReceived) covers
-         * the case (infoIs != ioDisabled).
-         */
-        if((ioReceived == ptp->infoIs) && !prt->restrictedRole
-           && cmp(ptp->portPriority.DesignatedBridgeID, !=,
-                  tree->BridgeIdentifier)
-          )
+        if(tree->rootHeapLen)
+            root_ptp = tree->rootHeap[0];
+    }
+    else
+    { /* No memory for the heap, check all the ports */
+        FOREACH_PTP_IN_TREE(ptp, tree)
         {
-            root_path_priority = ptp->portPriority;
-            if(prt->rcvdInternal)
-            {
-                assign(root_path_priority.IntRootPathCost,
-                       __cpu_to_be32(__be32_to_cpu(root_path_priority.IntRootPathCost)
-                                     + ptp->InternalPortPathCost)
-                      );
-            }
-            else if(cist) /* Yes, this check might be superfluous,
-                           * but I want to be on the safe side */
-            {
-                assign(root_path_priority.ExtRootPathCost,
-                       __cpu_to_be32(__be32_to_cpu(root_path_priority.ExtRootPathCost)
-                                     + prt->ExternalPortPathCost)
-                      );
-                assign(root_path_priority.RRootID, tree->BridgeIdentifier);
-                assign(root_path_priority.IntRootPathCost,
-                       __constant_cpu_to_be32(0));
-            }
-            if(betterorsamePriority(&root_path_priority, &tree->rootPriority,
-                                    ptp->portId, tree->rootPortId, cist))
-            {
-                assign(tree->rootPriority, root_path_priority);
-                assign(tree->rootPortId, ptp->portId);
+            if(calcRootPathPriority(ptp)
+               && (!root_ptp || rootHeap_better(ptp, root_ptp)))
                 root_ptp = ptp;
-            }
         }
     }
+    priority_key(TREE_ROOT_KEY(tree), &tree->rootPriority, 0);
+    if(root_ptp
+       && betterorsamePriority(PTP_KEY(root_ptp, rootPathKey),
+                               TREE_ROOT_KEY(tree)))
+    {
+        PTP_PRIORITY(&tree->rootPriority, root_ptp, rootPathKey);
+        assign(tree->rootPortId, root_ptp->portId);
+        tree->rootKey = root_ptp->rootPathKey;
+        if(cist)
+            tree->rootCistKey = root_ptp->ext->rootPathKey;
+    }
+    else
+        root_ptp = NULL;
 
     /* 802.1q-2005 says, that at some point we need compare portTimes with
      * "... one for the Root Port ...". Bad IEEE! Why not mention explicit
@@ -2680,33 +3600,24 @@ static void updtRolesTree(tree_t *tree)
         assign(tree->rootTimes, tree->BridgeTimes);
     }
 
-    FOREACH_PTP_IN_TREE(ptp, tree)
-    {
-        port_t *prt = ptp->port;
+    /* designatedPriority, designatedTimes and roles of all the ports
+     * depend on these */
+    if(!samePriorityAndTimers(TREE_ROOT_KEY(tree),
+                              &prevRootKey, cist ? &prevRootCistKey : NULL,
+                              &tree->rootTimes, &prevRootTimes,
+                              /*cist*/ true))
+        all = true;
 
-        /* d) Set new designatedPriority */
-        assign(ptp->designatedPriority, tree->rootPriority);
-        assign(ptp->designatedPriority.DesignatedBridgeID,
-               tree->BridgeIdentifier);
-        assign(ptp->designatedPriority.DesignatedPortID, ptp->portId);
-        /* I am not sure which condition to check here, as 802.1Q-2005 says:
-         * "... If {Port} is attached to a LAN that has one or more STP Bridges
-         *  attached (as determined by the Port Protocol Migration state
-         * machine) ..." -- why not to mention explicit var name? Bad IEEE.
-         * But I guess that sendSTP (i.e. !sendRSTP) var will do ;)
-         */
-        if(cist && !prt->sendRSTP)
-            assign(ptp->designatedPriority.RRootID, tree->BridgeIdentifier);
-
-        /* e) Set new designatedTimes */
-        assign(ptp->designatedTimes, tree->rootTimes);
-        /* Keep the configured Hello_Time for the port.
-         * NOTE: this is in accordance with the spirit of 802.1D-2004.
-         *    Also, this does not contradict 802.1Q-2005(-2011), as in these
-         *    standards both designatedTimes and rootTimes structures
-         *    don't have Hello_Time member.
-         */
-        assign(ptp->designatedTimes.Hello_Time, ptp->portTimes.Hello_Time);
+    /* d), e) */
+    if(all)
+    {
+        FOREACH_PTP_IN_TREE(ptp, tree)
+            updtDesignatedPort(ptp);
+    }
+    else
+    {
+        list_for_each_entry(ptp, &tree->rolesStale, rolesStale_list)
+            updtDesignatedPort(ptp);
     }
 
     /* syncMaster */
@@ -2717,164 +3628,217 @@ static void updtRolesTree(tree_t *tree)
       )
         syncMaster(tree->bridge);
 
-    FOREACH_PTP_IN_TREE(ptp, tree)
+    /* f) - m)
+     * MSTI roles of the boundary ports follow the CIST roles (clause g),
+     * so the MSTIs must look at the ports whose CIST role changed.
+     * Updating the lists of the MSTIs is safe here, as the CIST is not
+     * run in parallel with the MSTIs (see PRSSM_run_mstis) */
+    if(all)
     {
-        port_t *prt = ptp->port;
-        per_tree_port_t *cist_tree = GET_CIST_PTP_FROM_PORT(prt);
-
-        /* f) Set Disabled role */
-        if(ioDisabled == ptp->infoIs)
+        FOREACH_PTP_IN_TREE(ptp, tree)
         {
-            ptp->selectedRole = roleDisabled;
-            continue;
+            prevSelectedRole = ptp->hot->selectedRole;
+            updtRolePort(ptp, root_ptp);
+            if(cist && (ptp->hot->selectedRole != prevSelectedRole))
+                rolesStale_port(ptp->port);
         }
-
-        if(!cist && (ioReceived == cist_tree->infoIs) && !prt->infoInternal)
+    }
+    else
+    {
+        list_for_each_entry(ptp, &tree->rolesStale, rolesStale_list)
         {
-            /* g) Set role for the boundary port in MSTI */
-            if(roleRoot == cist_tree->selectedRole)
-            {
-                ptp->selectedRole = roleMaster;
-                if(!samePriorityAndTimers(&ptp->portPriority,
-                                          &ptp->designatedPriority,
-                                          &ptp->portTimes,
-                                          &ptp->designatedTimes,
-                                          /*cist*/ false))
-                    ptp->updtInfo = true;
-                continue;
-            }
-            /* Bad IEEE again! It says in 13.26.23 g) 2) that
-             * MSTI state should follow CIST state only for the case of
-             * Alternate port. This is obviously wrong!
-             * In the descriptive clause 13.13 f) it says:
-             *  "At a Boundary Port frames allocated to the CIST and
-             *   all MSTIs are forwarded or not forwarded alike.
-             *   This is because Port Role assignments are such that
-             *   if the CIST Port Role is Root Port, the MSTI Port Role
-             *   will be Master Port, and if the CIST Port Role is
-             *   Designated Port, Alternate Port, Backup Port,
-             *   or Disabled Port, each MSTI’s Port Role will be the same."
-             * So, ignore wrong 13.26.23 g) 2) and do as stated in 13.13 f) !
-             */
-            /* if(roleAlternate == cist_tree->selectedRole) */
-            {
-                ptp->selectedRole = cist_tree->selectedRole;
-                if(!samePriorityAndTimers(&ptp->portPriority,
-                                          &ptp->designatedPriority,
-                                          &ptp->portTimes,
-                                          &ptp->designatedTimes,
-                                          /*cist*/ false))
-                    ptp->updtInfo = true;
-                continue;
-            }
+            prevSelectedRole = ptp->hot->selectedRole;
+            updtRolePort(ptp, root_ptp);
+            if(cist && (ptp->hot->selectedRole != prevSelectedRole))
+                rolesStale_port(ptp->port);
         }
-        else
-     /* if(cist || (ioReceived != cist_tree->infoIs) || prt->infoInternal) */
+    }
+    list_for_each_entry_safe(ptp, nxt, &tree->rolesStale, rolesStale_list)
+        list_del_init(&ptp->rolesStale_list);
+
+    /* This is not in standard. But we really should set here
+     * reselect for all MSTIs so that updtRolesTree is called
+     * for each MSTI and due to above clause g) MSTI role is
+     * changed to Master or reflects CIST port role.
+     * Because in 802.1Q-2005 this will not happen when BPDU arrives
+     * at boundary port - the rcvdMsg is not set for the MSTIs and
+     * updtRolesTree is not called.
+     * Bad IEEE !!!
+     */
+    if(cist)
+    {
+        FOREACH_PTP_IN_TREE(ptp, tree)
         {
-            /* h) Set role for the aged info */
-            if(ioAged == ptp->infoIs)
-            {
-                ptp->selectedRole = roleDesignated;
-                ptp->updtInfo = true;
-                continue;
-            }
-            /* i) Set role for the mine info */
-            if(ioMine == ptp->infoIs)
-            {
-                ptp->selectedRole = roleDesignated;
-                if(!samePriorityAndTimers(&ptp->portPriority,
-                                          &ptp->designatedPriority,
-                                          &ptp->portTimes,
-                                          &ptp->designatedTimes,
-                                          cist))
-                    ptp->updtInfo = true;
-                continue;
-            }
-            if(ioReceived == ptp->infoIs)
-            {
-                /* j) Set Root role */
-                if(root_ptp == ptp)
-                {
-                    ptp->selectedRole = roleRoot;
-                    ptp->updtInfo = false;
-                }
-                else
-                {
-                    if(betterorsamePriority(&ptp->portPriority,
-                                             &ptp->designatedPriority,
-                                             0, 0, cist))
-                    {
-                        if(cmp(ptp->portPriority.DesignatedBridgeID, !=,
-                               tree->BridgeIdentifier))
-                        {
-                            /* k) Set Alternate role */
-                            ptp->selectedRole = roleAlternate;
-                        }
-                        else
-                        {
-                            /* l) Set Backup role */
-                            ptp->selectedRole = roleBackup;
-                        }
-                        /* reset updtInfo for both k) and l) */
-                        ptp->updtInfo = false;
-                    }
-                    else /* designatedPriority is better than portPriority */
-                    {
-                        /* m) Set Designated role */
-                        ptp->selectedRole = roleDesignated;
-                        ptp->updtInfo = true;
-                    }
-                }
-                /* This is not in standard. But we really should set here
-                 * reselect for all MSTIs so that updtRolesTree is called
-                 * for each MSTI and due to above clause g) MSTI role is
-                 * changed to Master or reflects CIST port role.
-                 * Because in 802.1Q-2005 this will not happen when BPDU arrives
-                 * at boundary port - the rcvdMsg is not set for the MSTIs and
-                 * updtRolesTree is not called.
-                 * Bad IEEE !!!
-                 */
-                if(cist && (ptp->selectedRole != ptp->role))
-                    reselectMSTIs(prt);
-                continue;
-            }
+            if((ioReceived == ptp->infoIs)
+               && (ptp->hot->selectedRole != ptp->hot->role))
+                reselectMSTIs(ptp->port);
         }
     }
 }
 
 /* 13.27  The Port Timers state machine */
 
-static void PTSM_tick(port_t *prt)
+/* Ports are not visited on every tick. Instead, all the ticks elapsed since
+ * the last visit are applied at once by PTSM_advance() right before the
+ * state machines look at the timers, and the port's tick_timer is armed
+ * to fire when the nearest of its timers reaches zero.
+ *
+ * Some state machines restart a timer whenever it differs from its initial
+ * value, i.e. hold it for as long as they stay in the particular state
+ * (e.g. PRTSM keeps fdWhile == forwardDelay in the ALTERNATE_PORT state).
+ * With the per-tick sweep such timer was decremented and restarted on the
+ * very same tick. Without the sweep nobody would restart it, so these
+ * timers are not run down at all while they are held.
+ */
+static inline bool PRTSM_holds_timers(per_tree_port_t *ptp,
+                                      PRTSM_states_t state)
+{
+    return (state == ptp->PRTSM_state) && ptp->hot->selected && !ptp->hot->updtInfo;
+}
+
+static inline bool edgeDelayWhile_held(port_t *prt)
+{
+    /* PRSM re-enters DISCARD */
+    return !prt->portEnabled;
+}
+
+static inline bool mdelayWhile_held(port_t *prt)
+{
+    /* PPMSM re-enters CHECKING_RSTP */
+    return !prt->portEnabled && (PPMSM_CHECKING_RSTP == prt->PPMSM_state);
+}
+
+static inline bool fdWhile_held(per_tree_port_t *ptp)
+{
+    return PRTSM_holds_timers(ptp, PRTSM_DISABLED_PORT)
+           || PRTSM_holds_timers(ptp, PRTSM_ALTERNATE_PORT);
+}
+
+static inline bool rrWhile_held(per_tree_port_t *ptp)
+{
+    return PRTSM_holds_timers(ptp, PRTSM_ROOT_PORT);
+}
+
+static inline bool rbWhile_held(per_tree_port_t *ptp)
+{
+    return PRTSM_holds_timers(ptp, PRTSM_ALTERNATE_PORT)
+           && (roleBackup == ptp->hot->role);
+}
+
+static void PTSM_advance(port_t *prt)
 {
+    bridge_t *br = prt->bridge;
     per_tree_port_t *ptp;
+    unsigned int now = wheel_now();
+    unsigned int ticks = now - prt->last_tick;
+    unsigned int TxHoldCount;
+    bool txHeld, expired = false;
+
+    prt->last_tick = now;
+    if(!ticks || !br->bridgeEnabled)
+        return;
 
-    if(prt->helloWhen)
-        --(prt->helloWhen);
-    if(prt->mdelayWhile)
-        --(prt->mdelayWhile);
-    if(prt->edgeDelayWhile)
-        --(prt->edgeDelayWhile);
-    if(prt->txCount)
-        --(prt->txCount);
-    if(prt->brAssuRcvdInfoWhile)
-        --(prt->brAssuRcvdInfoWhile);
+    /* State machines only look whether the timers have run down to zero,
+     * so the port needs a run only when some of them does */
+#define TIMER_ADVANCE(timer) \
+    ((timer) = ((timer) > ticks) ? ((timer) - ticks) \
+                                 : ((timer) ? (expired = true, 0) : 0))
+
+    TIMER_ADVANCE(prt->helloWhen);
+    if(!mdelayWhile_held(prt))
+        TIMER_ADVANCE(prt->mdelayWhile);
+    if(!edgeDelayWhile_held(prt))
+        TIMER_ADVANCE(prt->edgeDelayWhile);
+    /* PTSM can be waiting for the txCount to drop below TxHoldCount */
+    TxHoldCount = TICKS(br->Transmit_Hold_Count);
+    txHeld = prt->txCount >= TxHoldCount;
+    TIMER_ADVANCE(prt->txCount);
+    if(txHeld && (prt->txCount < TxHoldCount))
+        expired = true;
+    TIMER_ADVANCE(prt->brAssuRcvdInfoWhile);
+    /* support for rapid ageing */
+    if(prt->rapidAgeingWhile && (0 == TIMER_ADVANCE(prt->rapidAgeingWhile)))
+    {
+        if(!prt->deleted)
+            MSTP_OUT_set_ageing_time(prt, br->Ageing_Time);
+    }
 
     FOREACH_PTP_IN_PORT(ptp, prt)
     {
-        if(ptp->fdWhile)
-            --(ptp->fdWhile);
-        if(ptp->rrWhile)
-            --(ptp->rrWhile);
-        if(ptp->rbWhile)
-            --(ptp->rbWhile);
-        if(ptp->tcWhile)
+        if(!fdWhile_held(ptp))
+            TIMER_ADVANCE(ptp->fdWhile);
+        if(!rrWhile_held(ptp))
+            TIMER_ADVANCE(ptp->hot->rrWhile);
+        if(!rbWhile_held(ptp))
+            TIMER_ADVANCE(ptp->rbWhile);
+        if(ptp->tcWhile && (0 == TIMER_ADVANCE(ptp->tcWhile)))
         {
-            if(0 == --(ptp->tcWhile))
-                set_TopologyChange(ptp->tree, false, prt);
+            txBpdu_invalidate(prt);
+            set_TopologyChange(ptp->tree, false, prt);
         }
-        if(ptp->rcvdInfoWhile)
-            --(ptp->rcvdInfoWhile);
+        TIMER_ADVANCE(ptp->rcvdInfoWhile);
+    }
+#undef TIMER_ADVANCE
+
+    if(expired)
+        sm_mark_port(prt);
+}
+
+static void br_timers_advance(bridge_t *br)
+{
+    port_t *prt;
+
+    FOREACH_PORT_IN_BRIDGE(prt, br)
+        PTSM_advance(prt);
+}
+
+/* Must be called right after PTSM_advance(), i.e. when port timers
+ * are up to date */
+static void PTSM_schedule(port_t *prt)
+{
+    per_tree_port_t *ptp;
+    unsigned int TxHoldCount = TICKS(prt->bridge->Transmit_Hold_Count);
+    unsigned int next = 0;
+
+#define TIMER_NEXT(ticks) \
+    if((ticks) && (!next || ((ticks) < next))) next = (ticks)
+
+    TIMER_NEXT(prt->helloWhen);
+    if(!mdelayWhile_held(prt))
+        TIMER_NEXT(prt->mdelayWhile);
+    if(!edgeDelayWhile_held(prt))
+        TIMER_NEXT(prt->edgeDelayWhile);
+    /* PTSM can be waiting for the txCount to drop below TxHoldCount */
+    if(prt->txCount && (prt->txCount >= TxHoldCount))
+        TIMER_NEXT(prt->txCount - TxHoldCount + 1);
+    TIMER_NEXT(prt->brAssuRcvdInfoWhile);
+    TIMER_NEXT(prt->rapidAgeingWhile);
+
+    FOREACH_PTP_IN_PORT(ptp, prt)
+    {
+        if(!fdWhile_held(ptp))
+            TIMER_NEXT(ptp->fdWhile);
+        if(!rrWhile_held(ptp))
+            TIMER_NEXT(ptp->hot->rrWhile);
+        if(!rbWhile_held(ptp))
+            TIMER_NEXT(ptp->rbWhile);
+        TIMER_NEXT(ptp->tcWhile);
+        TIMER_NEXT(ptp->rcvdInfoWhile);
     }
+#undef TIMER_NEXT
+
+    if(next)
+        wheel_timer_mod(&prt->tick_timer, next);
+    else
+        wheel_timer_del(&prt->tick_timer);
+}
+
+static void PTSM_timer_expired(struct wheel_timer *t)
+{
+    port_t *prt = container_of(t, port_t, tick_timer);
+
+    sm_mark_port(prt);
+    prt->bridge->run_pending = true;
 }
 
 /* 13.28  Port Receive state machine */
@@ -2885,17 +3849,18 @@ static bool PRSM_to_DISCARD(port_t *prt, bool dry_run)
     {
         return (prt->PRSM_state != PRSM_DISCARD)
                || prt->rcvdBpdu || prt->rcvdRSTP || prt->rcvdSTP
-               || (prt->edgeDelayWhile != prt->bridge->Migrate_Time)
+               || (prt->edgeDelayWhile != TICKS(prt->bridge->Migrate_Time))
                || clearAllRcvdMsgs(prt, dry_run);
     }
 
     prt->PRSM_state = PRSM_DISCARD;
+    sm_mark_port(prt);
 
     prt->rcvdBpdu = false;
     prt->rcvdRSTP = false;
     prt->rcvdSTP = false;
     clearAllRcvdMsgs(prt, false /* actual run */);
-    assign(prt->edgeDelayWhile, prt->bridge->Migrate_Time);
+    assign(prt->edgeDelayWhile, TICKS(prt->bridge->Migrate_Time));
 
     /* No need to run, no one condition will be met
      * if(!begin)
@@ -2906,13 +3871,19 @@ static bool PRSM_to_DISCARD(port_t *prt, bool dry_run)
 static void PRSM_to_RECEIVE(port_t *prt)
 {
     prt->PRSM_state = PRSM_RECEIVE;
+    sm_mark_port(prt);
 
     updtBPDUVersion(prt);
-    prt->rcvdInternal = fromSameRegion(prt);
+    bool rcvdInternal = fromSameRegion(prt);
+    if(prt->rcvdInternal != rcvdInternal)
+    {
+        prt->rcvdInternal = rcvdInternal;
+        rolesStale_port(prt);
+    }
     setRcvdMsgs(prt);
     prt->operEdge = false;
     prt->rcvdBpdu = false;
-    assign(prt->edgeDelayWhile, prt->bridge->Migrate_Time);
+    assign(prt->edgeDelayWhile, TICKS(prt->bridge->Migrate_Time));
 
     /* No need to run, no one condition will be met
       PRSM_run(prt, false); */
@@ -2923,7 +3894,7 @@ static bool PRSM_run(port_t *prt, bool dry_run)
     per_tree_port_t *ptp;
     bool rcvdAnyMsg;
 
-    if((prt->rcvdBpdu || (prt->edgeDelayWhile != prt->bridge->Migrate_Time))
+    if((prt->rcvdBpdu || (prt->edgeDelayWhile != TICKS(prt->bridge->Migrate_Time)))
        && !prt->portEnabled)
     {
         return PRSM_to_DISCARD(prt, dry_run);
@@ -2968,11 +3939,16 @@ static bool PPMSM_run(port_t *prt, bool dry_run);
 static void PPMSM_to_CHECKING_RSTP(port_t *prt/*, bool begin*/)
 {
     prt->PPMSM_state = PPMSM_CHECKING_RSTP;
+    sm_mark_port(prt);
 
     bridge_t *br = prt->bridge;
     prt->mcheck = false;
-    prt->sendRSTP = rstpVersion(br);
-    assign(prt->mdelayWhile, br->Migrate_Time);
+    if(prt->sendRSTP != rstpVersion(br))
+    {
+        prt->sendRSTP = rstpVersion(br);
+        rolesStale_ptp(GET_CIST_PTP_FROM_PORT(prt));
+    }
+    assign(prt->mdelayWhile, TICKS(br->Migrate_Time));
 
     /* No need to run, no one condition will be met
      * if(!begin)
@@ -2982,9 +3958,14 @@ static void PPMSM_to_CHECKING_RSTP(port_t *prt/*, bool begin*/)
 static void PPMSM_to_SELECTING_STP(port_t *prt)
 {
     prt->PPMSM_state = PPMSM_SELECTING_STP;
+    sm_mark_port(prt);
 
-    prt->sendRSTP = false;
-    assign(prt->mdelayWhile, prt->bridge->Migrate_Time);
+    if(prt->sendRSTP)
+    {
+        prt->sendRSTP = false;
+        rolesStale_ptp(GET_CIST_PTP_FROM_PORT(prt));
+    }
+    assign(prt->mdelayWhile, TICKS(prt->bridge->Migrate_Time));
 
     PPMSM_run(prt, false /* actual run */);
 }
@@ -2992,6 +3973,7 @@ static void PPMSM_to_SELECTING_STP(port_t *prt)
 static void PPMSM_to_SENSING(port_t *prt)
 {
     prt->PPMSM_state = PPMSM_SENSING;
+    sm_mark_port(prt);
 
     prt->rcvdRSTP = false;
     prt->rcvdSTP = false;
@@ -3006,7 +3988,7 @@ static bool PPMSM_run(port_t *prt, bool dry_run)
     switch(prt->PPMSM_state)
     {
         case PPMSM_CHECKING_RSTP:
-            if((prt->mdelayWhile != br->Migrate_Time)
+            if((prt->mdelayWhile != TICKS(br->Migrate_Time))
                && !prt->portEnabled)
             {
                 if(dry_run) /* at least mdelayWhile will change */
@@ -3054,6 +4036,7 @@ static bool PPMSM_run(port_t *prt, bool dry_run)
 static void BDSM_to_EDGE(port_t *prt/*, bool begin*/)
 {
     prt->BDSM_state = BDSM_EDGE;
+    sm_mark_port(prt);
 
     prt->operEdge = true;
 
@@ -3065,6 +4048,7 @@ static void BDSM_to_EDGE(port_t *prt/*, bool begin*/)
 static void BDSM_to_NOT_EDGE(port_t *prt/*, bool begin*/)
 {
     prt->BDSM_state = BDSM_NOT_EDGE;
+    sm_mark_port(prt);
 
     prt->operEdge = false;
 
@@ -3134,6 +4118,7 @@ static bool PTSM_to_TRANSMIT_INIT(port_t *prt, bool begin, bool dry_run)
     }
 
     prt->PTSM_state = PTSM_TRANSMIT_INIT;
+    sm_mark_port(prt);
 
     prt->newInfo = true;
     prt->newInfoMsti = true;
@@ -3147,10 +4132,11 @@ static bool PTSM_to_TRANSMIT_INIT(port_t *prt, bool begin, bool dry_run)
 static void PTSM_to_TRANSMIT_CONFIG(port_t *prt)
 {
     prt->PTSM_state = PTSM_TRANSMIT_CONFIG;
+    sm_mark_port(prt);
 
     prt->newInfo = false;
     txConfig(prt);
-    ++(prt->txCount);
+    prt->txCount += TICKS(1);
     prt->tcAck = false;
 
     PTSM_run(prt, false /* actual run */);
@@ -3159,10 +4145,11 @@ static void PTSM_to_TRANSMIT_CONFIG(port_t *prt)
 static void PTSM_to_TRANSMIT_TCN(port_t *prt)
 {
     prt->PTSM_state = PTSM_TRANSMIT_TCN;
+    sm_mark_port(prt);
 
     prt->newInfo = false;
     txTcn(prt);
-    ++(prt->txCount);
+    prt->txCount += TICKS(1);
 
     PTSM_run(prt, false /* actual run */);
 }
@@ -3170,11 +4157,12 @@ static void PTSM_to_TRANSMIT_TCN(port_t *prt)
 static void PTSM_to_TRANSMIT_RSTP(port_t *prt)
 {
     prt->PTSM_state = PTSM_TRANSMIT_RSTP;
+    sm_mark_port(prt);
 
     prt->newInfo = false;
     prt->newInfoMsti = false;
     txMstp(prt);
-    ++(prt->txCount);
+    prt->txCount += TICKS(1);
     prt->tcAck = false;
 
     PTSM_run(prt, false /* actual run */);
@@ -3183,18 +4171,19 @@ static void PTSM_to_TRANSMIT_RSTP(port_t *prt)
 static void PTSM_to_TRANSMIT_PERIODIC(port_t *prt)
 {
     prt->PTSM_state = PTSM_TRANSMIT_PERIODIC;
+    sm_mark_port(prt);
 
     per_tree_port_t *ptp = GET_CIST_PTP_FROM_PORT(prt);
     bool cistDesignatedOrTCpropagatingRootPort =
-        (roleDesignated == ptp->role)
-        || ((roleRoot == ptp->role) && (0 != ptp->tcWhile));
+        (roleDesignated == ptp->hot->role)
+        || ((roleRoot == ptp->hot->role) && (0 != ptp->tcWhile));
     bool mstiDesignatedOrTCpropagatingRootPort;
 
     mstiDesignatedOrTCpropagatingRootPort = false;
     list_for_each_entry_continue(ptp, &prt->trees, port_list)
     {
-        if((roleDesignated == ptp->role)
-           || ((roleRoot == ptp->role) && (0 != ptp->tcWhile))
+        if((roleDesignated == ptp->hot->role)
+           || ((roleRoot == ptp->hot->role) && (0 != ptp->tcWhile))
           )
         {
             mstiDesignatedOrTCpropagatingRootPort = true;
@@ -3212,9 +4201,10 @@ static void PTSM_to_TRANSMIT_PERIODIC(port_t *prt)
 static void PTSM_to_IDLE(port_t *prt)
 {
     prt->PTSM_state = PTSM_IDLE;
+    sm_mark_port(prt);
 
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
-    prt->helloWhen = cist->portTimes.Hello_Time;
+    prt->helloWhen = TICKS(cist->portTimes.Hello_Time);
 
     PTSM_run(prt, false /* actual run */);
 }
@@ -3228,6 +4218,10 @@ static bool PTSM_run(port_t *prt, bool dry_run)
 
     if(!prt->portEnabled)
     {
+        /* Do not re-enter TRANSMIT_INIT again and again while the port
+         * is disabled, that would keep the port dirty forever */
+        if(!dry_run && !PTSM_to_TRANSMIT_INIT(prt, false, true))
+            return false;
         return PTSM_to_TRANSMIT_INIT(prt, false, dry_run);
     }
 
@@ -3249,21 +4243,21 @@ static bool PTSM_run(port_t *prt, bool dry_run)
         case PTSM_IDLE:
             /* allTransmitReady = true; */
             ptp = GET_CIST_PTP_FROM_PORT(prt);
-            if(!ptp->selected || ptp->updtInfo)
+            if(!ptp->hot->selected || ptp->hot->updtInfo)
             {
                 /* allTransmitReady = false; */
                 return false;
             }
-            cistRole = ptp->role;
+            cistRole = ptp->hot->role;
             mstiMasterPort = false;
             list_for_each_entry_continue(ptp, &prt->trees, port_list)
             {
-                if(!ptp->selected || ptp->updtInfo)
+                if(!ptp->hot->selected || ptp->hot->updtInfo)
                 {
                     /* allTransmitReady = false; */
                     return false;
                 }
-                if(roleMaster == ptp->role)
+                if(roleMaster == ptp->hot->role)
                     mstiMasterPort = true;
             }
             if(0 == prt->helloWhen)
@@ -3273,7 +4267,7 @@ static bool PTSM_run(port_t *prt, bool dry_run)
                 PTSM_to_TRANSMIT_PERIODIC(prt);
                 return false;
             }
-            if(!(prt->txCount < prt->bridge->Transmit_Hold_Count))
+            if(!(prt->txCount < TICKS(prt->bridge->Transmit_Hold_Count)))
                 return false;
 
             if(prt->bpduFilterPort)
@@ -3329,16 +4323,19 @@ static void PISM_to_DISABLED(per_tree_port_t *ptp, bool begin)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_DISABLED;
+    sm_mark_port(ptp->port);
 
     ptp->rcvdMsg = false;
     ptp->proposing = false;
     ptp->proposed = false;
     ptp->agree = false;
+    txBpdu_invalidate(ptp->port);
     ptp->agreed = false;
     assign(ptp->rcvdInfoWhile, 0u);
     ptp->infoIs = ioDisabled;
-    ptp->reselect = true;
-    ptp->selected = false;
+    rolesStale_info(ptp);
+    ptp->hot->reselect = true;
+    ptp->hot->selected = false;
 
     if(!begin)
         PISM_run(ptp, false /* actual run */);
@@ -3348,10 +4345,12 @@ static void PISM_to_AGED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_AGED;
+    sm_mark_port(ptp->port);
 
     ptp->infoIs = ioAged;
-    ptp->reselect = true;
-    ptp->selected = false;
+    rolesStale_info(ptp);
+    ptp->hot->reselect = true;
+    ptp->hot->selected = false;
 
     PISM_run(ptp, false /* actual run */);
 }
@@ -3360,15 +4359,18 @@ static void PISM_to_UPDATE(per_tree_port_t *ptp)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_UPDATE;
+    sm_mark_port(ptp->port);
 
+    txBpdu_invalidate(ptp->port);
     ptp->proposing = false;
     ptp->proposed = false;
     ptp->agreed = ptp->agreed && betterorsameInfo(ptp, ioMine);
-    ptp->synced = ptp->synced && ptp->agreed;
-    assign(ptp->portPriority, ptp->designatedPriority);
+    ptp->hot->synced = ptp->hot->synced && ptp->agreed;
+    COPY_PTP_KEY(ptp, portKey, designatedKey);
     assign(ptp->portTimes, ptp->designatedTimes);
-    ptp->updtInfo = false;
+    ptp->hot->updtInfo = false;
     ptp->infoIs = ioMine;
+    rolesStale_info(ptp);
     /* newInfoXst = TRUE; */
     port_t *prt = ptp->port;
     if(0 == ptp->MSTID)
@@ -3383,23 +4385,30 @@ static void PISM_to_SUPERIOR_DESIGNATED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_SUPERIOR_DESIGNATED;
+    sm_mark_port(ptp->port);
 
     port_t *prt = ptp->port;
 
-    prt->infoInternal = prt->rcvdInternal;
+    if(prt->infoInternal != prt->rcvdInternal)
+    {
+        prt->infoInternal = prt->rcvdInternal;
+        rolesStale_port(prt);
+    }
+    txBpdu_invalidate(prt);
     ptp->agreed = false;
     ptp->proposing = false;
     recordProposal(ptp);
     setTcFlags(ptp);
     ptp->agree = ptp->agree && betterorsameInfo(ptp, ioReceived);
     recordAgreement(ptp);
-    ptp->synced = ptp->synced && ptp->agreed;
+    ptp->hot->synced = ptp->hot->synced && ptp->agreed;
     recordPriority(ptp);
     recordTimes(ptp);
     updtRcvdInfoWhile(ptp);
     ptp->infoIs = ioReceived;
-    ptp->reselect = true;
-    ptp->selected = false;
+    rolesStale_info(ptp);
+    ptp->hot->reselect = true;
+    ptp->hot->selected = false;
     ptp->rcvdMsg = false;
 
     PISM_run(ptp, false /* actual run */);
@@ -3409,10 +4418,15 @@ static void PISM_to_REPEATED_DESIGNATED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_REPEATED_DESIGNATED;
+    sm_mark_port(ptp->port);
 
     port_t *prt = ptp->port;
 
-    prt->infoInternal = prt->rcvdInternal;
+    if(prt->infoInternal != prt->rcvdInternal)
+    {
+        prt->infoInternal = prt->rcvdInternal;
+        rolesStale_port(prt);
+    }
     recordProposal(ptp);
     setTcFlags(ptp);
     recordAgreement(ptp);
@@ -3426,6 +4440,7 @@ static void PISM_to_INFERIOR_DESIGNATED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_INFERIOR_DESIGNATED;
+    sm_mark_port(ptp->port);
 
     recordDispute(ptp);
     ptp->rcvdMsg = false;
@@ -3437,6 +4452,7 @@ static void PISM_to_NOT_DESIGNATED(per_tree_port_t *ptp)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_NOT_DESIGNATED;
+    sm_mark_port(ptp->port);
 
     recordAgreement(ptp);
     setTcFlags(ptp);
@@ -3449,6 +4465,7 @@ static void PISM_to_OTHER(per_tree_port_t *ptp)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_OTHER;
+    sm_mark_port(ptp->port);
 
     ptp->rcvdMsg = false;
 
@@ -3459,6 +4476,7 @@ static void PISM_to_CURRENT(per_tree_port_t *ptp)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_CURRENT;
+    sm_mark_port(ptp->port);
 
     PISM_run(ptp, false /* actual run */);
 }
@@ -3467,6 +4485,7 @@ static void PISM_to_RECEIVE(per_tree_port_t *ptp)
 {
     PISM_LOG("");
     ptp->PISM_state = PISM_RECEIVE;
+    sm_mark_port(ptp->port);
 
     ptp->rcvdInfo = rcvInfo(ptp);
     recordMastered(ptp);
@@ -3505,7 +4524,7 @@ static bool PISM_run(per_tree_port_t *ptp, bool dry_run)
             }
             return false;
         case PISM_AGED:
-            if(ptp->selected && ptp->updtInfo)
+            if(ptp->hot->selected && ptp->hot->updtInfo)
             {
                 if(dry_run) /* state change */
                     return true;
@@ -3539,13 +4558,13 @@ static bool PISM_run(per_tree_port_t *ptp, bool dry_run)
             if(0 == ptp->MSTID)
             { /* CIST */
                 rcvdXstMsg = ptp->rcvdMsg; /* 13.25.12 */
-                updtXstInfo = ptp->updtInfo; /* 13.25.16 */
+                updtXstInfo = ptp->hot->updtInfo; /* 13.25.16 */
             }
             else
             { /* MSTI */
                 per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(prt);
                 rcvdXstMsg = !cist->rcvdMsg && ptp->rcvdMsg; /* 13.25.13 */
-                updtXstInfo = ptp->updtInfo || cist->updtInfo; /* 13.25.17 */
+                updtXstInfo = ptp->hot->updtInfo || cist->hot->updtInfo; /* 13.25.17 */
             }
             if(rcvdXstMsg && !updtXstInfo)
             {
@@ -3555,14 +4574,14 @@ static bool PISM_run(per_tree_port_t *ptp, bool dry_run)
                 return false;
             }
             if((ioReceived == ptp->infoIs) && (0 == ptp->rcvdInfoWhile)
-               && !ptp->updtInfo && !rcvdXstMsg)
+               && !ptp->hot->updtInfo && !rcvdXstMsg)
             {
                 if(dry_run) /* state change */
                     return true;
                 PISM_to_AGED(ptp);
                 return false;
             }
-            if(ptp->selected && ptp->updtInfo)
+            if(ptp->hot->selected && ptp->hot->updtInfo)
             {
                 if(dry_run) /* state change */
                     return true;
@@ -3612,6 +4631,7 @@ static bool PRSSM_run(tree_t *tree, bool dry_run);
 static void PRSSM_to_INIT_TREE(tree_t *tree/*, bool begin*/)
 {
     tree->PRSSM_state = PRSSM_INIT_TREE;
+    sm_mark_tree_ports(tree);
 
     updtRolesDisabledTree(tree);
 
@@ -3622,13 +4642,35 @@ static void PRSSM_to_INIT_TREE(tree_t *tree/*, bool begin*/)
      *     PRSSM_run(prt, false); */
 }
 
-static void PRSSM_to_ROLE_SELECTION(tree_t *tree)
+/* The part of the ROLE_SELECTION state which changes nothing outside
+ * the tree itself. For an MSTI it also depends on nothing but the CIST
+ * roles, so it may be run for several MSTIs in parallel
+ * (see PRSSM_run_mstis) */
+static void PRSSM_select_roles(tree_t *tree)
 {
-    tree->PRSSM_state = PRSSM_ROLE_SELECTION;
-
     clearReselectTree(tree);
     updtRolesTree(tree);
     setSelectedTree(tree);
+}
+
+/* Bookkeeping part of the ROLE_SELECTION state, it must be done
+ * before PRSSM_select_roles() */
+static void PRSSM_enter_ROLE_SELECTION(tree_t *tree)
+{
+    per_tree_port_t *ptp;
+
+    tree->PRSSM_state = PRSSM_ROLE_SELECTION;
+    sm_mark_tree_ports(tree);
+
+    /* designatedPriority and designatedTimes are going to change */
+    FOREACH_PTP_IN_TREE(ptp, tree)
+        txBpdu_invalidate(ptp->port);
+}
+
+static void PRSSM_to_ROLE_SELECTION(tree_t *tree)
+{
+    PRSSM_enter_ROLE_SELECTION(tree);
+    PRSSM_select_roles(tree);
 
     /* No need to run, no one condition will be met
       PRSSM_run(tree, false); */
@@ -3636,7 +4678,7 @@ static void PRSSM_to_ROLE_SELECTION(tree_t *tree)
 
 static bool PRSSM_run(tree_t *tree, bool dry_run)
 {
-    per_tree_port_t *ptp;
+    per_tree_port_hot_t *hot;
 
     switch(tree->PRSSM_state)
     {
@@ -3646,8 +4688,8 @@ static bool PRSSM_run(tree_t *tree, bool dry_run)
             PRSSM_to_ROLE_SELECTION(tree);
             return false;
         case PRSSM_ROLE_SELECTION:
-            FOREACH_PTP_IN_TREE(ptp, tree)
-                if(ptp->reselect)
+            FOREACH_HOT_IN_TREE(hot, tree)
+                if(hot->reselect)
                 {
                     if(dry_run) /* at least reselect will change */
                         return true;
@@ -3678,21 +4720,23 @@ static void PRTSM_to_INIT_PORT(per_tree_port_t *ptp/*, bool begin*/)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_INIT_PORT;
+    sm_mark_port(ptp->port);
 
     unsigned int MaxAge, FwdDelay;
     per_tree_port_t *cist = GET_CIST_PTP_FROM_PORT(ptp->port);
 
-    ptp->role = roleDisabled;
+    ptp->hot->role = roleDisabled;
+    txBpdu_invalidate(ptp->port);
     ptp->learn = false;
     ptp->forward = false;
-    ptp->synced = false;
-    ptp->sync = true;
-    ptp->reRoot = true;
+    ptp->hot->synced = false;
+    ptp->hot->sync = true;
+    ptp->hot->reRoot = true;
     /* 13.25.6 */
-    FwdDelay = cist->designatedTimes.Forward_Delay;
-    assign(ptp->rrWhile, FwdDelay);
+    FwdDelay = TICKS(cist->designatedTimes.Forward_Delay);
+    assign(ptp->hot->rrWhile, FwdDelay);
     /* 13.25.8 */
-    MaxAge = cist->designatedTimes.Max_Age;
+    MaxAge = TICKS(cist->designatedTimes.Max_Age);
     assign(ptp->fdWhile, MaxAge);
     assign(ptp->rbWhile, 0u);
 
@@ -3707,6 +4751,7 @@ static void PRTSM_to_DISABLE_PORT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DISABLE_PORT;
+    sm_mark_port(ptp->port);
 
     /* Although 802.1Q-2005 says here to do role = selectedRole
      * I have difficulties with it in the next scenario:
@@ -3727,7 +4772,8 @@ static void PRTSM_to_DISABLE_PORT(per_tree_port_t *ptp)
      * Solution: do not follow the standard, and do role = roleDisabled
      *  instead of role = selectedRole.
      */
-    ptp->role = roleDisabled;
+    ptp->hot->role = roleDisabled;
+    txBpdu_invalidate(ptp->port);
     ptp->learn = false;
     ptp->forward = false;
 
@@ -3738,12 +4784,13 @@ static void PRTSM_to_DISABLED_PORT(per_tree_port_t *ptp, unsigned int MaxAge)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DISABLED_PORT;
+    sm_mark_port(ptp->port);
 
     assign(ptp->fdWhile, MaxAge);
-    ptp->synced = true;
-    assign(ptp->rrWhile, 0u);
-    ptp->sync = false;
-    ptp->reRoot = false;
+    ptp->hot->synced = true;
+    assign(ptp->hot->rrWhile, 0u);
+    ptp->hot->sync = false;
+    ptp->hot->reRoot = false;
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3754,6 +4801,7 @@ static void PRTSM_to_MASTER_PROPOSED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_MASTER_PROPOSED;
+    sm_mark_port(ptp->port);
 
     setSyncTree(ptp->tree);
     ptp->proposed = false;
@@ -3765,10 +4813,12 @@ static void PRTSM_to_MASTER_AGREED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_MASTER_AGREED;
+    sm_mark_port(ptp->port);
 
     ptp->proposed = false;
-    ptp->sync = false;
+    ptp->hot->sync = false;
     ptp->agree = true;
+    txBpdu_invalidate(ptp->port);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3777,10 +4827,11 @@ static void PRTSM_to_MASTER_SYNCED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_MASTER_SYNCED;
+    sm_mark_port(ptp->port);
 
-    assign(ptp->rrWhile, 0u);
-    ptp->synced = true;
-    ptp->sync = false;
+    assign(ptp->hot->rrWhile, 0u);
+    ptp->hot->synced = true;
+    ptp->hot->sync = false;
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3789,8 +4840,9 @@ static void PRTSM_to_MASTER_RETIRED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_MASTER_RETIRED;
+    sm_mark_port(ptp->port);
 
-    ptp->reRoot = false;
+    ptp->hot->reRoot = false;
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3799,6 +4851,7 @@ static void PRTSM_to_MASTER_FORWARD(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_MASTER_FORWARD;
+    sm_mark_port(ptp->port);
 
     ptp->forward = true;
     assign(ptp->fdWhile, 0u);
@@ -3811,6 +4864,7 @@ static void PRTSM_to_MASTER_LEARN(per_tree_port_t *ptp, unsigned int forwardDela
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_MASTER_LEARN;
+    sm_mark_port(ptp->port);
 
     ptp->learn = true;
     assign(ptp->fdWhile, forwardDelay);
@@ -3822,6 +4876,7 @@ static void PRTSM_to_MASTER_DISCARD(per_tree_port_t *ptp, unsigned int forwardDe
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_MASTER_DISCARD;
+    sm_mark_port(ptp->port);
 
     ptp->learn = false;
     ptp->forward = false;
@@ -3835,8 +4890,10 @@ static void PRTSM_to_MASTER_PORT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_MASTER_PORT;
+    sm_mark_port(ptp->port);
 
-    ptp->role = roleMaster;
+    ptp->hot->role = roleMaster;
+    txBpdu_invalidate(ptp->port);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3847,6 +4904,7 @@ static void PRTSM_to_ROOT_PROPOSED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_ROOT_PROPOSED;
+    sm_mark_port(ptp->port);
 
     setSyncTree(ptp->tree);
     ptp->proposed = false;
@@ -3858,10 +4916,12 @@ static void PRTSM_to_ROOT_AGREED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_ROOT_AGREED;
+    sm_mark_port(ptp->port);
 
     ptp->proposed = false;
-    ptp->sync = false;
+    ptp->hot->sync = false;
     ptp->agree = true;
+    txBpdu_invalidate(ptp->port);
     /* newInfoXst = TRUE; */
     port_t *prt = ptp->port;
     if(0 == ptp->MSTID)
@@ -3876,9 +4936,10 @@ static void PRTSM_to_ROOT_SYNCED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_ROOT_SYNCED;
+    sm_mark_port(ptp->port);
 
-    ptp->synced = true;
-    ptp->sync = false;
+    ptp->hot->synced = true;
+    ptp->hot->sync = false;
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3887,6 +4948,7 @@ static void PRTSM_to_REROOT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_REROOT;
+    sm_mark_port(ptp->port);
 
     setReRootTree(ptp->tree);
 
@@ -3897,6 +4959,7 @@ static void PRTSM_to_ROOT_FORWARD(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_ROOT_FORWARD;
+    sm_mark_port(ptp->port);
 
     assign(ptp->fdWhile, 0u);
     ptp->forward = true;
@@ -3908,6 +4971,7 @@ static void PRTSM_to_ROOT_LEARN(per_tree_port_t *ptp, unsigned int forwardDelay)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_ROOT_LEARN;
+    sm_mark_port(ptp->port);
 
     assign(ptp->fdWhile, forwardDelay);
     ptp->learn = true;
@@ -3919,8 +4983,9 @@ static void PRTSM_to_REROOTED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_REROOTED;
+    sm_mark_port(ptp->port);
 
-    ptp->reRoot = false;
+    ptp->hot->reRoot = false;
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3929,9 +4994,11 @@ static void PRTSM_to_ROOT_PORT(per_tree_port_t *ptp, unsigned int FwdDelay)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_ROOT_PORT;
+    sm_mark_port(ptp->port);
 
-    ptp->role = roleRoot;
-    assign(ptp->rrWhile, FwdDelay);
+    ptp->hot->role = roleRoot;
+    txBpdu_invalidate(ptp->port);
+    assign(ptp->hot->rrWhile, FwdDelay);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3942,10 +5009,12 @@ static void PRTSM_to_DESIGNATED_PROPOSE(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DESIGNATED_PROPOSE;
+    sm_mark_port(ptp->port);
 
     port_t *prt = ptp->port;
 
     ptp->proposing = true;
+    txBpdu_invalidate(ptp->port);
     /* newInfoXst = TRUE; */
     if(0 == ptp->MSTID)
     { /* CIST */
@@ -3955,7 +5024,7 @@ static void PRTSM_to_DESIGNATED_PROPOSE(per_tree_port_t *ptp)
         unsigned int EdgeDelay = prt->operPointToPointMAC ?
                                    prt->bridge->Migrate_Time
                                  : MaxAge;
-        assign(prt->edgeDelayWhile, EdgeDelay);
+        assign(prt->edgeDelayWhile, TICKS(EdgeDelay));
         prt->newInfo = true;
     }
     else
@@ -3968,10 +5037,12 @@ static void PRTSM_to_DESIGNATED_AGREED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DESIGNATED_AGREED;
+    sm_mark_port(ptp->port);
 
     ptp->proposed = false;
-    ptp->sync = false;
+    ptp->hot->sync = false;
     ptp->agree = true;
+    txBpdu_invalidate(ptp->port);
     /* newInfoXst = TRUE; */
     port_t *prt = ptp->port;
     if(0 == ptp->MSTID)
@@ -3986,10 +5057,11 @@ static void PRTSM_to_DESIGNATED_SYNCED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DESIGNATED_SYNCED;
+    sm_mark_port(ptp->port);
 
-    assign(ptp->rrWhile, 0u);
-    ptp->synced = true;
-    ptp->sync = false;
+    assign(ptp->hot->rrWhile, 0u);
+    ptp->hot->synced = true;
+    ptp->hot->sync = false;
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -3998,8 +5070,9 @@ static void PRTSM_to_DESIGNATED_RETIRED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DESIGNATED_RETIRED;
+    sm_mark_port(ptp->port);
 
-    ptp->reRoot = false;
+    ptp->hot->reRoot = false;
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -4008,6 +5081,7 @@ static void PRTSM_to_DESIGNATED_FORWARD(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DESIGNATED_FORWARD;
+    sm_mark_port(ptp->port);
 
     ptp->forward = true;
     assign(ptp->fdWhile, 0u);
@@ -4020,6 +5094,7 @@ static void PRTSM_to_DESIGNATED_LEARN(per_tree_port_t *ptp, unsigned int forward
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DESIGNATED_LEARN;
+    sm_mark_port(ptp->port);
 
     ptp->learn = true;
     assign(ptp->fdWhile, forwardDelay);
@@ -4031,6 +5106,7 @@ static void PRTSM_to_DESIGNATED_DISCARD(per_tree_port_t *ptp, unsigned int forwa
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DESIGNATED_DISCARD;
+    sm_mark_port(ptp->port);
 
     ptp->learn = false;
     ptp->forward = false;
@@ -4044,8 +5120,10 @@ static void PRTSM_to_DESIGNATED_PORT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_DESIGNATED_PORT;
+    sm_mark_port(ptp->port);
 
-    ptp->role = roleDesignated;
+    ptp->hot->role = roleDesignated;
+    txBpdu_invalidate(ptp->port);
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
@@ -4056,8 +5134,10 @@ static void PRTSM_to_BLOCK_PORT(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_BLOCK_PORT;
+    sm_mark_port(ptp->port);
 
-    ptp->role = ptp->selectedRole;
+    ptp->hot->role = ptp->hot->selectedRole;
+    txBpdu_invalidate(ptp->port);
     ptp->learn = false;
     ptp->forward = false;
 
@@ -4068,6 +5148,7 @@ static void PRTSM_to_BACKUP_PORT(per_tree_port_t *ptp, unsigned int HelloTime)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_BACKUP_PORT;
+    sm_mark_port(ptp->port);
 
     assign(ptp->rbWhile, 2 * HelloTime);
 
@@ -4078,6 +5159,7 @@ static void PRTSM_to_ALTERNATE_PROPOSED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_ALTERNATE_PROPOSED;
+    sm_mark_port(ptp->port);
 
     setSyncTree(ptp->tree);
     ptp->proposed = false;
@@ -4089,9 +5171,11 @@ static void PRTSM_to_ALTERNATE_AGREED(per_tree_port_t *ptp)
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_ALTERNATE_AGREED;
+    sm_mark_port(ptp->port);
 
     ptp->proposed = false;
     ptp->agree = true;
+    txBpdu_invalidate(ptp->port);
     /* newInfoXst = TRUE; */
     port_t *prt = ptp->port;
     if(0 == ptp->MSTID)
@@ -4106,27 +5190,29 @@ static void PRTSM_to_ALTERNATE_PORT(per_tree_port_t *ptp, unsigned int forwardDe
 {
     PRTSM_LOG("");
     ptp->PRTSM_state = PRTSM_ALTERNATE_PORT;
+    sm_mark_port(ptp->port);
 
     assign(ptp->fdWhile, forwardDelay);
-    ptp->synced = true;
-    assign(ptp->rrWhile, 0u);
-    ptp->sync = false;
-    ptp->reRoot = false;
+    ptp->hot->synced = true;
+    assign(ptp->hot->rrWhile, 0u);
+    ptp->hot->sync = false;
+    ptp->hot->reRoot = false;
 
     PRTSM_runr(ptp, true, false /* actual run */);
 }
 
 static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
 {
-    /* Following vars do not need recalculating on recursive calls */
-    static unsigned int MaxAge, FwdDelay, forwardDelay, HelloTime;
-    static port_t *prt;
-    static tree_t *tree;
-    static per_tree_port_t *cist;
+    /* Following vars do not need recalculating on recursive calls.
+     * Bridges may be run in parallel, so they are per thread */
+    static __thread unsigned int MaxAge, FwdDelay, forwardDelay, HelloTime;
+    static __thread port_t *prt;
+    static __thread tree_t *tree;
+    static __thread per_tree_port_t *cist;
     /* Following vars are recalculated on each state transition */
     bool allSynced, reRooted;
     /* Following vars are auxiliary and don't depend on recursive_call */
-    per_tree_port_t *ptp_1;
+    per_tree_port_hot_t *hot_1;
 
     if(!recursive_call)
     { /* calculate these intermediate vars only first time in chain of
@@ -4137,23 +5223,23 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
         cist = GET_CIST_PTP_FROM_PORT(prt);
 
         /* 13.25.6 */
-        FwdDelay = cist->designatedTimes.Forward_Delay;
+        FwdDelay = TICKS(cist->designatedTimes.Forward_Delay);
 
         /* 13.25.7 */
-        HelloTime = cist->portTimes.Hello_Time;
+        HelloTime = TICKS(cist->portTimes.Hello_Time);
 
         /* 13.25.d) -> 17.20.5 of 802.1D */
         forwardDelay = prt->sendRSTP ? HelloTime : FwdDelay;
 
         /* 13.25.8 */
-        MaxAge = cist->designatedTimes.Max_Age;
+        MaxAge = TICKS(cist->designatedTimes.Max_Age);
     }
 
     PRTSM_LOG("role = %d, selectedRole = %d, selected = %d, updtInfo = %d",
-              ptp->role, ptp->selectedRole, ptp->selected, ptp->updtInfo);
-    if((ptp->role != ptp->selectedRole) && ptp->selected && !ptp->updtInfo)
+              ptp->hot->role, ptp->hot->selectedRole, ptp->hot->selected, ptp->hot->updtInfo);
+    if((ptp->hot->role != ptp->hot->selectedRole) && ptp->hot->selected && !ptp->hot->updtInfo)
     {
-        switch(ptp->selectedRole)
+        switch(ptp->hot->selectedRole)
         {
             case roleDisabled:
                 if(dry_run) /* at least role will change */
@@ -4186,12 +5272,12 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
 
     /* 13.25.1 */
     allSynced = true;
-    FOREACH_PTP_IN_TREE(ptp_1, tree)
+    FOREACH_HOT_IN_TREE(hot_1, tree)
     {
         /* a) */
-        if(!ptp_1->selected
-           || (ptp_1->role != ptp_1->selectedRole)
-           || ptp_1->updtInfo
+        if(!hot_1->selected
+           || (hot_1->role != hot_1->selectedRole)
+           || hot_1->updtInfo
           )
         {
             allSynced = false;
@@ -4199,16 +5285,16 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
         }
 
         /* b) */
-        switch(ptp->role)
+        switch(ptp->hot->role)
         {
             case roleRoot:
             case roleAlternate:
-                if((roleRoot != ptp_1->role) && !ptp_1->synced)
+                if((roleRoot != hot_1->role) && !hot_1->synced)
                     allSynced = false;
                 break;
             case roleDesignated:
             case roleMaster:
-                if((ptp != ptp_1) && !ptp_1->synced)
+                if((ptp->hot != hot_1) && !hot_1->synced)
                     allSynced = false;
                 break;
             default:
@@ -4227,7 +5313,7 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
             PRTSM_to_DISABLE_PORT(ptp);
             return false;
         case PRTSM_DISABLE_PORT:
-            if(ptp->selected && !ptp->updtInfo
+            if(ptp->hot->selected && !ptp->hot->updtInfo
                && !ptp->learning && !ptp->forwarding
               )
             {
@@ -4237,8 +5323,8 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
             }
             return false;
         case PRTSM_DISABLED_PORT:
-            if(ptp->selected && !ptp->updtInfo
-               && (ptp->sync || ptp->reRoot || !ptp->synced
+            if(ptp->hot->selected && !ptp->hot->updtInfo
+               && (ptp->hot->sync || ptp->hot->reRoot || !ptp->hot->synced
                    || (ptp->fdWhile != MaxAge))
               )
             {
@@ -4266,19 +5352,19 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
             PRTSM_to_MASTER_PORT(ptp);
             return false;
         case PRTSM_MASTER_PORT:
-            if(!(ptp->selected && !ptp->updtInfo))
+            if(!(ptp->hot->selected && !ptp->hot->updtInfo))
                 return false;
-            if(ptp->reRoot && (0 == ptp->rrWhile))
+            if(ptp->hot->reRoot && (0 == ptp->hot->rrWhile))
             {
                 if(dry_run) /* state change */
                     return true;
                 PRTSM_to_MASTER_RETIRED(ptp);
                 return false;
             }
-            if((!ptp->learning && !ptp->forwarding && !ptp->synced)
-               || (ptp->agreed && !ptp->synced)
-               || (prt->operEdge && !ptp->synced)
-               || (ptp->sync && ptp->synced)
+            if((!ptp->learning && !ptp->forwarding && !ptp->hot->synced)
+               || (ptp->agreed && !ptp->hot->synced)
+               || (prt->operEdge && !ptp->hot->synced)
+               || (ptp->hot->sync && ptp->hot->synced)
               )
             {
                 if(dry_run) /* state change */
@@ -4320,8 +5406,8 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
                 PRTSM_to_MASTER_LEARN(ptp, forwardDelay);
                 return false;
             }
-            if(((ptp->sync && !ptp->synced)
-                || (ptp->reRoot && (0 != ptp->rrWhile))
+            if(((ptp->hot->sync && !ptp->hot->synced)
+                || (ptp->hot->reRoot && (0 != ptp->hot->rrWhile))
                 || ptp->disputed
                )
                && !prt->operEdge && (ptp->learn || ptp->forward)
@@ -4352,16 +5438,16 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
             PRTSM_to_ROOT_PORT(ptp, FwdDelay);
             return false;
         case PRTSM_ROOT_PORT:
-            if(!(ptp->selected && !ptp->updtInfo))
+            if(!(ptp->hot->selected && !ptp->hot->updtInfo))
                 return false;
-            if(!ptp->forward && !ptp->reRoot)
+            if(!ptp->forward && !ptp->hot->reRoot)
             {
                 if(dry_run) /* state change */
                     return true;
                 PRTSM_to_REROOT(ptp);
                 return false;
             }
-            if((ptp->agreed && !ptp->synced) || (ptp->sync && ptp->synced))
+            if((ptp->agreed && !ptp->hot->synced) || (ptp->hot->sync && ptp->hot->synced))
             {
                 if(dry_run) /* state change */
                     return true;
@@ -4384,9 +5470,9 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
             }
             /* 17.20.10 of 802.1D : reRooted */
             reRooted = true;
-            FOREACH_PTP_IN_TREE(ptp_1, tree)
+            FOREACH_HOT_IN_TREE(hot_1, tree)
             {
-                if((ptp != ptp_1) && (0 != ptp_1->rrWhile))
+                if((ptp->hot != hot_1) && (0 != hot_1->rrWhile))
                 {
                     reRooted = false;
                     break;
@@ -4411,14 +5497,14 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
                     return false;
                 }
             }
-            if(ptp->reRoot && ptp->forward)
+            if(ptp->hot->reRoot && ptp->forward)
             {
                 if(dry_run) /* state change */
                     return true;
                 PRTSM_to_REROOTED(ptp);
                 return false;
             }
-            if(ptp->rrWhile != FwdDelay)
+            if(ptp->hot->rrWhile != FwdDelay)
             {
                 if(dry_run) /* state change */
                     return true;
@@ -4445,19 +5531,19 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
             PRTSM_to_DESIGNATED_PORT(ptp);
             return false;
         case PRTSM_DESIGNATED_PORT:
-            if(!(ptp->selected && !ptp->updtInfo))
+            if(!(ptp->hot->selected && !ptp->hot->updtInfo))
                 return false;
-            if(ptp->reRoot && (0 == ptp->rrWhile))
+            if(ptp->hot->reRoot && (0 == ptp->hot->rrWhile))
             {
                 if(dry_run) /* state change */
                     return true;
                 PRTSM_to_DESIGNATED_RETIRED(ptp);
                 return false;
             }
-            if((!ptp->learning && !ptp->forwarding && !ptp->synced)
-               || (ptp->agreed && !ptp->synced)
-               || (prt->operEdge && !ptp->synced)
-               || (ptp->sync && ptp->synced)
+            if((!ptp->learning && !ptp->forwarding && !ptp->hot->synced)
+               || (ptp->agreed && !ptp->hot->synced)
+               || (prt->operEdge && !ptp->hot->synced)
+               || (ptp->hot->sync && ptp->hot->synced)
               )
             {
                 if(dry_run) /* state change */
@@ -4482,7 +5568,7 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
             }
             /* Dont transition to learn/forward when BA inconsistent */
             if(((0 == ptp->fdWhile) || ptp->agreed || prt->operEdge)
-               && ((0 == ptp->rrWhile) || !ptp->reRoot) && !ptp->sync
+               && ((0 == ptp->hot->rrWhile) || !ptp->hot->reRoot) && !ptp->hot->sync
                && !ptp->port->BaInconsistent
               )
             {
@@ -4502,8 +5588,8 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
                 }
             }
             /* Transition to discarding when BA inconsistent */
-            if(((ptp->sync && !ptp->synced)
-                || (ptp->reRoot && (0 != ptp->rrWhile))
+            if(((ptp->hot->sync && !ptp->hot->synced)
+                || (ptp->hot->reRoot && (0 != ptp->hot->rrWhile))
                 || ptp->disputed
                 || ptp->port->BaInconsistent
                )
@@ -4518,7 +5604,7 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
             return false;
      /* AlternatePort and BackupPort role transitions */
         case PRTSM_BLOCK_PORT:
-            if(ptp->selected && !ptp->updtInfo
+            if(ptp->hot->selected && !ptp->hot->updtInfo
                && !ptp->learning && !ptp->forwarding
               )
             {
@@ -4537,7 +5623,7 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
             PRTSM_to_ALTERNATE_PORT(ptp, forwardDelay);
             return false;
         case PRTSM_ALTERNATE_PORT:
-            if(!(ptp->selected && !ptp->updtInfo))
+            if(!(ptp->hot->selected && !ptp->hot->updtInfo))
                 return false;
             if((allSynced && !ptp->agree) || (ptp->proposed && ptp->agree))
             {
@@ -4553,15 +5639,15 @@ static bool PRTSM_runr(per_tree_port_t *ptp, bool recursive_call, bool dry_run)
                 PRTSM_to_ALTERNATE_PROPOSED(ptp);
                 return false;
             }
-            if((ptp->rbWhile != 2 * HelloTime) && (roleBackup == ptp->role))
+            if((ptp->rbWhile != 2 * HelloTime) && (roleBackup == ptp->hot->role))
             {
                 if(dry_run) /* state change */
                     return true;
                 PRTSM_to_BACKUP_PORT(ptp, HelloTime);
                 return false;
             }
-            if((ptp->fdWhile != forwardDelay) || ptp->sync || ptp->reRoot
-               || !ptp->synced)
+            if((ptp->fdWhile != forwardDelay) || ptp->hot->sync || ptp->hot->reRoot
+               || !ptp->hot->synced)
             {
                 if(dry_run) /* state change */
                     return true;
@@ -4582,6 +5668,7 @@ static bool PSTSM_run(per_tree_port_t *ptp, bool dry_run);
 static void PSTSM_to_DISCARDING(per_tree_port_t *ptp, bool begin)
 {
     ptp->PSTSM_state = PSTSM_DISCARDING;
+    sm_mark_port(ptp->port);
 
     /* This effectively sets BLOCKING state:
     disableLearning();
@@ -4594,6 +5681,7 @@ static void PSTSM_to_DISCARDING(per_tree_port_t *ptp, bool begin)
     }
     ptp->learning = false;
     ptp->forwarding = false;
+    txBpdu_invalidate(ptp->port);
 
     if(!begin)
         PSTSM_run(ptp, false /* actual run */);
@@ -4602,6 +5690,7 @@ static void PSTSM_to_DISCARDING(per_tree_port_t *ptp, bool begin)
 static void PSTSM_to_LEARNING(per_tree_port_t *ptp)
 {
     ptp->PSTSM_state = PSTSM_LEARNING;
+    sm_mark_port(ptp->port);
 
     /* enableLearning(); */
     if(BR_STATE_LEARNING != ptp->state)
@@ -4610,6 +5699,7 @@ static void PSTSM_to_LEARNING(per_tree_port_t *ptp)
             MSTP_OUT_set_state(ptp, BR_STATE_LEARNING);
     }
     ptp->learning = true;
+    txBpdu_invalidate(ptp->port);
 
     PSTSM_run(ptp, false /* actual run */);
 }
@@ -4617,6 +5707,7 @@ static void PSTSM_to_LEARNING(per_tree_port_t *ptp)
 static void PSTSM_to_FORWARDING(per_tree_port_t *ptp)
 {
     ptp->PSTSM_state = PSTSM_FORWARDING;
+    sm_mark_port(ptp->port);
 
     /* enableForwarding(); */
     if(BR_STATE_FORWARDING != ptp->state)
@@ -4625,6 +5716,7 @@ static void PSTSM_to_FORWARDING(per_tree_port_t *ptp)
             MSTP_OUT_set_state(ptp, BR_STATE_FORWARDING);
     }
     ptp->forwarding = true;
+    txBpdu_invalidate(ptp->port);
 
     /* No need to run, no one condition will be met
       PSTSM_run(ptp, false); */
@@ -4676,9 +5768,11 @@ static bool PSTSM_run(per_tree_port_t *ptp, bool dry_run)
 static void TCSM_to_INACTIVE(per_tree_port_t *ptp, bool begin)
 {
     ptp->TCSM_state = TCSM_INACTIVE;
+    sm_mark_port(ptp->port);
 
     set_fdbFlush(ptp);
     assign(ptp->tcWhile, 0u);
+    txBpdu_invalidate(ptp->port);
     set_TopologyChange(ptp->tree, false, ptp->port);
     if(0 == ptp->MSTID) /* CIST */
         ptp->port->tcAck = false;
@@ -4703,6 +5797,7 @@ static bool TCSM_to_LEARNING(per_tree_port_t *ptp, bool dry_run)
     }
 
     ptp->TCSM_state = TCSM_LEARNING;
+    sm_mark_port(ptp->port);
 
     if(0 == ptp->MSTID) /* CIST */
     {
@@ -4720,6 +5815,7 @@ static bool TCSM_to_LEARNING(per_tree_port_t *ptp, bool dry_run)
 static void TCSM_to_DETECTED(per_tree_port_t *ptp)
 {
     ptp->TCSM_state = TCSM_DETECTED;
+    sm_mark_port(ptp->port);
 
     newTcWhile(ptp);
     setTcPropTree(ptp);
@@ -4736,6 +5832,7 @@ static void TCSM_to_DETECTED(per_tree_port_t *ptp)
 static void TCSM_to_NOTIFIED_TCN(per_tree_port_t *ptp)
 {
     ptp->TCSM_state = TCSM_NOTIFIED_TCN;
+    sm_mark_port(ptp->port);
 
     newTcWhile(ptp);
 
@@ -4745,13 +5842,14 @@ static void TCSM_to_NOTIFIED_TCN(per_tree_port_t *ptp)
 static void TCSM_to_NOTIFIED_TC(per_tree_port_t *ptp)
 {
     ptp->TCSM_state = TCSM_NOTIFIED_TC;
+    sm_mark_port(ptp->port);
 
     ptp->rcvdTc = false;
     if(0 == ptp->MSTID) /* CIST */
     {
         port_t *prt = ptp->port;
         prt->rcvdTcn = false;
-        if(roleDesignated == ptp->role)
+        if(roleDesignated == ptp->hot->role)
             prt->tcAck = true;
     }
     setTcPropTree(ptp);
@@ -4762,6 +5860,7 @@ static void TCSM_to_NOTIFIED_TC(per_tree_port_t *ptp)
 static void TCSM_to_PROPAGATING(per_tree_port_t *ptp)
 {
     ptp->TCSM_state = TCSM_PROPAGATING;
+    sm_mark_port(ptp->port);
 
     newTcWhile(ptp);
     set_fdbFlush(ptp);
@@ -4773,8 +5872,10 @@ static void TCSM_to_PROPAGATING(per_tree_port_t *ptp)
 static void TCSM_to_ACKNOWLEDGED(per_tree_port_t *ptp)
 {
     ptp->TCSM_state = TCSM_ACKNOWLEDGED;
+    sm_mark_port(ptp->port);
 
     assign(ptp->tcWhile, 0u);
+    txBpdu_invalidate(ptp->port);
     set_TopologyChange(ptp->tree, false, ptp->port);
     ptp->port->rcvdTcAck = false;
 
@@ -4784,6 +5885,7 @@ static void TCSM_to_ACKNOWLEDGED(per_tree_port_t *ptp)
 static void TCSM_to_ACTIVE(per_tree_port_t *ptp)
 {
     ptp->TCSM_state = TCSM_ACTIVE;
+    sm_mark_port(ptp->port);
 
     TCSM_run(ptp, false /* actual run */);
 }
@@ -4804,9 +5906,9 @@ static bool TCSM_run(per_tree_port_t *ptp, bool dry_run)
             }
             return false;
         case TCSM_LEARNING:
-            active_port = (roleRoot == ptp->role)
-                          || (roleDesignated == ptp->role)
-                          || (roleMaster == ptp->role);
+            active_port = (roleRoot == ptp->hot->role)
+                          || (roleDesignated == ptp->hot->role)
+                          || (roleMaster == ptp->hot->role);
             if(active_port && ptp->forward && !prt->operEdge)
             {
                 if(dry_run) /* state change */
@@ -4842,9 +5944,9 @@ static bool TCSM_run(per_tree_port_t *ptp, bool dry_run)
             TCSM_to_ACTIVE(ptp);
             return false;
         case TCSM_ACTIVE:
-            active_port = (roleRoot == ptp->role)
-                          || (roleDesignated == ptp->role)
-                          || (roleMaster == ptp->role);
+            active_port = (roleRoot == ptp->hot->role)
+                          || (roleDesignated == ptp->hot->role)
+                          || (roleMaster == ptp->hot->role);
             if(!active_port || prt->operEdge)
             {
                 if(dry_run) /* state change */
@@ -4899,6 +6001,8 @@ static void tree_state_machines_begin(tree_t *tree)
     if(!br->bridgeEnabled)
         return;
 
+    br_timers_advance(br);
+
     /* 13.32  Port Information state machine */
     FOREACH_PTP_IN_TREE(ptp, tree)
     {
@@ -4931,6 +6035,8 @@ static void prt_state_machines_begin(port_t *prt)
     if(!br->bridgeEnabled)
         return;
 
+    PTSM_advance(prt);
+
     /* 13.28  Port Receive state machine */
     PRSM_begin(prt);
     /* 13.29  Port Protocol Migration state machine */
@@ -4972,6 +6078,13 @@ static void br_state_machines_begin(bridge_t *br)
 
     if(!br->bridgeEnabled)
         return;
+    if(br->config_txn)
+    {
+        br->config_txn_begin = true;
+        return;
+    }
+
+    br_timers_advance(br);
 
     /* 13.28  Port Receive state machine */
     FOREACH_PORT_IN_BRIDGE(prt, br)
@@ -5022,107 +6135,150 @@ static void br_state_machines_begin(bridge_t *br)
     br_state_machines_run(br);
 }
 
-/* Run each state machine.
- * Return false iff all state machines in dry run indicate that
- * state will not be changed. Otherwise return true.
+#define FOREACH_DIRTY_PORT_IN_BRIDGE(port, bridge) \
+    list_for_each_entry((port), &(bridge)->sm_ports, sm_list)
+#define FOREACH_DIRTY_TREE_IN_BRIDGE(tree, bridge) \
+    list_for_each_entry((tree), &(bridge)->sm_trees, sm_list)
+
+static void PRSSM_select_roles_job(void *arg, int i)
+{
+    PRSSM_select_roles(((tree_t **)arg)[i]);
+}
+
+/* Run PRSSM for the dirty MSTIs.
+ * When there are worker threads (see worker_pool.h), the MSTIs which are
+ * about to re-enter ROLE_SELECTION first do all the bookkeeping in the main
+ * thread, in the order of the dirty list, and then select their roles in
+ * parallel. Role selection of an MSTI only touches the MSTI itself,
+ * so the result does not depend on the number of threads.
  */
-static bool __br_state_machines_run(bridge_t *br, bool dry_run)
+static void PRSSM_run_mstis(bridge_t *br)
 {
-    port_t *prt;
-    per_tree_port_t *ptp;
     tree_t *tree;
+    tree_t *batch[MAX_IMPLEMENTATION_MSTIS];
+    int i, n = 0;
+
+    FOREACH_DIRTY_TREE_IN_BRIDGE(tree, br)
+    {
+        if(0 == tree->MSTID)
+            continue;
+        if(!worker_pool_size() || (PRSSM_ROLE_SELECTION != tree->PRSSM_state))
+        {
+            PRSSM_run(tree, false /* actual run */);
+            continue;
+        }
+        if(PRSSM_run(tree, true /* dry run */))
+            batch[n++] = tree;
+    }
+    if(!n)
+        return;
+
+    for(i = 0; i < n; ++i)
+        PRSSM_enter_ROLE_SELECTION(batch[i]);
+    worker_pool_run(PRSSM_select_roles_job, batch, n);
+}
+
+/* Run each state machine of the dirty ports and trees once.
+ * Ports and trees marked during the run are run again on the next pass.
+ * Ports marked for the first time during the run are appended to the
+ * list, so they are also visited by the rest of this pass.
+ */
+static void __br_state_machines_run(bridge_t *br)
+{
+    port_t *prt, *nxt_prt;
+    per_tree_port_t *ptp;
+    tree_t *tree, *nxt_tree;
+
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
+    {
+        prt->sm_dirty = false;
+        PTSM_advance(prt);
+    }
+    FOREACH_DIRTY_TREE_IN_BRIDGE(tree, br)
+        tree->sm_dirty = false;
 
     /* Check if bridge assurance timer expires */
-    FOREACH_PORT_IN_BRIDGE(prt, br)
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
     {
         if(prt->portEnabled && assurancePort(prt)
            && (0 == prt->brAssuRcvdInfoWhile) && !prt->BaInconsistent
           )
         {
-            if(dry_run) /* state change */
-                return true;
             prt->BaInconsistent = true;
+            sm_mark_port(prt);
             ERROR_PRTNAME(prt->bridge, prt, "Bridge assurance inconsistent");
         }
     }
 
     /* 13.28  Port Receive state machine */
-    FOREACH_PORT_IN_BRIDGE(prt, br)
-    {
-        if(PRSM_run(prt, dry_run) && dry_run)
-            return true;
-    }
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
+        PRSM_run(prt, false /* actual run */);
     /* 13.29  Port Protocol Migration state machine */
-    FOREACH_PORT_IN_BRIDGE(prt, br)
-    {
-        if(PPMSM_run(prt, dry_run) && dry_run)
-            return true;
-    }
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
+        PPMSM_run(prt, false /* actual run */);
     /* 13.30  Bridge Detection state machine */
-    FOREACH_PORT_IN_BRIDGE(prt, br)
-    {
-        if(BDSM_run(prt, dry_run) && dry_run)
-            return true;
-    }
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
+        BDSM_run(prt, false /* actual run */);
     /* 13.31  Port Transmit state machine */
-    FOREACH_PORT_IN_BRIDGE(prt, br)
-    {
-        if(PTSM_run(prt, dry_run) && dry_run)
-            return true;
-    }
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
+        PTSM_run(prt, false /* actual run */);
 
     /* 13.32  Port Information state machine */
-    FOREACH_PORT_IN_BRIDGE(prt, br)
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
     {
         FOREACH_PTP_IN_PORT(ptp, prt)
-        {
-            if(PISM_run(ptp, dry_run) && dry_run)
-                return true;
-        }
+            PISM_run(ptp, false /* actual run */);
+        sm_publish(prt);
     }
 
-    /* 13.33  Port Role Selection state machine */
-    FOREACH_TREE_IN_BRIDGE(tree, br)
-    {
-        if(PRSSM_run(tree, dry_run) && dry_run)
-            return true;
-    }
+    /* 13.33  Port Role Selection state machine.
+     * MSTI roles depend on the CIST roles, so CIST goes first */
+    tree = GET_CIST_TREE(br);
+    if(!list_empty(&tree->sm_list))
+        PRSSM_run(tree, false /* actual run */);
+    PRSSM_run_mstis(br);
 
     /* 13.34  Port Role Transitions state machine */
-    FOREACH_PORT_IN_BRIDGE(prt, br)
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
     {
         FOREACH_PTP_IN_PORT(ptp, prt)
-        {
-            if(PRTSM_run(ptp, dry_run) && dry_run)
-                return true;
-        }
+            PRTSM_run(ptp, false /* actual run */);
     }
     /* 13.35  Port State Transition state machine */
-    FOREACH_PORT_IN_BRIDGE(prt, br)
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
     {
         FOREACH_PTP_IN_PORT(ptp, prt)
-        {
-            if(PSTSM_run(ptp, dry_run) && dry_run)
-                return true;
-        }
+            PSTSM_run(ptp, false /* actual run */);
     }
     /* 13.36  Topology Change state machine */
-    FOREACH_PORT_IN_BRIDGE(prt, br)
+    FOREACH_DIRTY_PORT_IN_BRIDGE(prt, br)
     {
         FOREACH_PTP_IN_PORT(ptp, prt)
-        {
-            if(TCSM_run(ptp, dry_run) && dry_run)
-                return true;
-        }
+            TCSM_run(ptp, false /* actual run */);
+        sm_publish(prt);
     }
 
-    return false;
+    /* Ports which are done with the received BPDU take the next one,
+     * the rest of the clean ports and trees leave the lists */
+    list_for_each_entry_safe(prt, nxt_prt, &br->sm_ports, sm_list)
+    {
+        rcvdBpdu_next(prt);
+        if(prt->sm_dirty)
+            continue;
+        list_del_init(&prt->sm_list);
+        PTSM_schedule(prt);
+    }
+    list_for_each_entry_safe(tree, nxt_tree, &br->sm_trees, sm_list)
+    {
+        if(!tree->sm_dirty)
+            list_del_init(&tree->sm_list);
+    }
 }
 
-/* Run state machines until their state stabilizes.
- * Do not consume more than 1 second.
+/* Run state machines of the dirty ports and trees until their state
+ * stabilizes. Do not consume more than 1 second.
  */
-static void br_state_machines_run(bridge_t *br)
+static void br_dirty_state_machines_run(bridge_t *br)
 {
     struct timespec tv, tv_end;
     signed long delta;
@@ -5133,20 +6289,40 @@ static void br_state_machines_run(bridge_t *br)
     clock_gettime(CLOCK_MONOTONIC, &tv_end);
     ++(tv_end.tv_sec);
 
-    do {
-        if(!__br_state_machines_run(br, true /* dry run */))
-            return;
-        __br_state_machines_run(br, false /* actual run */);
+    while(!list_empty(&br->sm_ports) || !list_empty(&br->sm_trees))
+    {
+        __br_state_machines_run(br);
 
         /* Check for the timeout */
         clock_gettime(CLOCK_MONOTONIC, &tv);
-        if(0 < (delta = tv.tv_sec - tv_end.tv_sec))
-            return;
+        delta = tv.tv_sec - tv_end.tv_sec;
         if(0 == delta)
-        {
             delta = tv.tv_nsec - tv_end.tv_nsec;
-            if(0 < delta)
-                return;
+        if(0 < delta)
+        {
+            /* Not stable yet, continue on the next tick */
+            br->run_pending = true;
+            break;
         }
-    } while(true);
+    }
+}
+
+/* Run all state machines of the bridge until their state stabilizes.
+ * Used when some input of unknown scope has changed (configuration,
+ * port or bridge state and so on).
+ */
+static void br_state_machines_run(bridge_t *br)
+{
+    br_roles_invalidate(br);
+    if(!br->bridgeEnabled)
+        return;
+    if(br->config_txn)
+    {
+        br->config_txn_run = true;
+        return;
+    }
+
+    br_timers_advance(br);
+    br_sm_mark_all(br);
+    br_dirty_state_machines_run(br);
 }
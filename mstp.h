@@ -16,7 +16,9 @@
 #include <stdlib.h>
 
 #include "bridge_ctl.h"
+#include "epoll_loop.h"
 #include "list.h"
+#include "obj_pool.h"
 
 /* #define HMAC_MDS_TEST_FUNCTIONS */
 
@@ -107,6 +109,28 @@ typedef struct
     __be32 ExtRootPathCost;
 } port_priority_vector_t;
 
+/* Priority vector (and port identifier as the tie-breaker) packed into
+ * host order integers, the most significant component first, so that
+ * vectors compare as their keys do (see priority_key() in mstp.c).
+ * priority_key_t holds the components used by both the CIST and the MSTIs:
+ *   w[0] = RRootID
+ *   w[1] = IntRootPathCost, upper half of DesignatedBridgeID
+ *   w[2] = lower half of DesignatedBridgeID, DesignatedPortID, portId
+ * The CIST-only components, which are more significant, are kept apart
+ * in cist_priority_key_t:
+ *   w[0] = RootID
+ *   w[1] = ExtRootPathCost
+ */
+typedef struct
+{
+    __u64 w[3];
+} priority_key_t;
+
+typedef struct
+{
+    __u64 w[2];
+} cist_priority_key_t;
+
 typedef struct
 {
     __u8 remainingHops;
@@ -399,13 +423,55 @@ typedef struct
 
     __u16 vid2fid[MAX_VID + 1];
     __be16 fid2mstid[MAX_FID + 1];
+    /* VIDs allocated to each FID, as doubly linked lists threaded through
+     * vid_next and vid_prev (0 terminates the list) */
+    __u16 fid_first_vid[MAX_FID + 1];
+    __u16 vid_next[MAX_VID + 1], vid_prev[MAX_VID + 1];
+    /* fid2mstid[vid2fid[vid]] of all VIDs, the MST Configuration Table
+     * (13.7), vid2mstid[0] and vid2mstid[MAX_VID + 1] are always 0 */
+    __be16 vid2mstid[MAX_VID + 2];
+    /* MstConfigId.s.configuration_digest is recalculated on demand,
+     * see get_MstConfigId() */
+    bool configDigestValid;
 
     /* not in standard */
     unsigned int uptime;
+    bool run_pending; /* state machines should be run on the next tick */
+    /* Nesting depth of the open configuration transactions, see
+     * MSTP_IN_config_begin(). While it is not 0 the restart and the run
+     * of the state machines are only recorded in the two flags below */
+    unsigned int config_txn;
+    bool config_txn_begin, config_txn_run;
+    /* Ports and trees whose state machines have to be run again,
+     * see sm_mark_port() and sm_mark_tree() */
+    struct list_head sm_ports;
+    struct list_head sm_trees;
+    /* Ports occupy slots [0, num_slots) of the per-tree arrays
+     * (see per_tree_port_hot_t), arrays have room for slots_alloc slots */
+    unsigned int num_slots, slots_alloc;
+    /* Ports, trees and per-tree-ports of the bridge are allocated from
+     * these pools, so that port and MSTI churn does not fragment the heap.
+     * The ports are allocated by the caller of
+     * MSTP_IN_port_create_and_add_tail() from port_pool */
+    obj_pool_t port_pool, tree_pool, ptp_pool, cist_ptp_pool;
 
     sysdep_br_data_t sysdeps;
 } bridge_t;
 
+/* Per-port per-tree variables which the state machines look at across all
+ * the ports of the tree (allSynced, reRooted, the tree-wide sweeps).
+ * They are kept apart from the rest of per_tree_port_t, in a dense per-tree
+ * array indexed by the port slot, so that the tree is swept linearly
+ * over 8 bytes per port instead of chasing the list of the per-tree ports.
+ */
+typedef struct
+{
+    unsigned int rrWhile;
+    __u8 role, selectedRole; /* port_role_t */
+    bool present:1; /* the slot is occupied by a port */
+    bool reRoot:1, reselect:1, selected:1, updtInfo:1, sync:1, synced:1;
+} per_tree_port_hot_t;
+
 typedef struct
 {
     struct list_head bridge_list; /* anchor in bridge's list of trees */
@@ -414,11 +480,16 @@ typedef struct
 
     /* List of the per-port data structures for this tree instance */
     struct list_head ports;
+    /* Their hot variables, indexed by port slot */
+    per_tree_port_hot_t *hot;
 
     /* 13.23.(c,f,g) Per-bridge per-tree variables */
     bridge_identifier_t BridgeIdentifier;
     port_identifier_t rootPortId;
     port_priority_vector_t rootPriority;
+    /* Key of {rootPriority, rootPortId}, rootCistKey is for the CIST only */
+    priority_key_t rootKey;
+    cist_priority_key_t rootCistKey;
 
     /* 13.23.d This is totally calculated from BridgeIdentifier */
     port_priority_vector_t BridgePriority;
@@ -437,14 +508,40 @@ typedef struct
 
     /* State machines */
     PRSSM_states_t PRSSM_state;
+    struct list_head sm_list; /* anchor in bridge's list of dirty trees */
+    bool sm_dirty;
+
+    /* Root Port candidates ordered by their root path priority vectors
+     * and the per-tree ports whose role inputs changed since the last
+     * updtRolesTree() (see rootHeap_update) */
+    struct per_tree_port **rootHeap;
+    unsigned int rootHeapLen, rootHeapSize;
+    bool rootHeapValid;
+    bridge_identifier_t rootHeapBridgeId; /* BridgeIdentifier of the heap */
+    struct list_head rolesStale;
 
 } tree_t;
 
+/* Received BPDU. Only its fixed part is kept in hdr, it is accessed
+ * as bpdu_t via RCVD_BPDU(). The MSTI Configuration Messages present
+ * in the BPDU are kept densely in mstis */
+typedef struct
+{
+    __u8 hdr[sizeof(bpdu_t) - sizeof(((bpdu_t *)0)->mstConfiguration)];
+    msti_configuration_message_t *mstis;
+    int num_mstis;
+    int mstis_alloc; /* number of messages mstis has room for */
+} rcvd_bpdu_t;
+
+/* Max number of received BPDUs waiting for the state machines per port */
+#define RCVD_BPDU_QUEUE_LEN 4
+
 typedef struct
 {
     struct list_head br_list; /* anchor in bridge's list of ports */
     bridge_t * bridge;
     __be16 port_number;
+    unsigned int slot; /* index in tree->hot */
 
     /* List of all tree instances, first in list (trees.next) is CIST.
      * List is sorted by MSTID (by insertion procedure MSTP_IN_create_msti).
@@ -457,7 +554,7 @@ typedef struct
     unsigned int mdelayWhile, helloWhen, edgeDelayWhile;
 
     /* 13.24.(b,c,e,f,g,j,k,l,m,n,o,p,q,r,aw) Per-port variables */
-    unsigned int txCount;
+    unsigned int txCount; /* in ticks: each BPDU adds one second worth */
     bool operEdge, portEnabled, infoInternal, rcvdInternal;
     bool mcheck, rcvdBpdu, rcvdRSTP, rcvdSTP, rcvdTcAck, rcvdTcn, sendRSTP;
     bool tcAck, newInfo, newInfoMsti;
@@ -482,15 +579,32 @@ typedef struct
     unsigned int rapidAgeingWhile;
     unsigned int brAssuRcvdInfoWhile;
 
+    /* Timers of the port and of all its per-tree ports are brought up to
+     * date lazily (see PTSM_advance). tick_timer fires when the nearest
+     * of them expires. */
+    struct wheel_timer tick_timer;
+    unsigned int last_tick;
+
     /* State machines */
     PRSM_states_t PRSM_state;
     PPMSM_states_t PPMSM_state;
     BDSM_states_t BDSM_state;
     PTSM_states_t PTSM_state;
-
-    /* Copy of the received BPDU */
-    bpdu_t rcvdBpduData;
-    int rcvdBpduNumOfMstis;
+    struct list_head sm_list; /* anchor in bridge's list of dirty ports */
+    bool sm_dirty;
+
+    /* Last RST/MST BPDU built by txMstp. It is sent again as is until
+     * some of the information it carries changes (see txBpdu_invalidate) */
+    bpdu_t txBpdu;
+    int txBpduSize;
+    bool txBpduValid;
+
+    /* Queue of the received BPDUs. The entry at the head is the one being
+     * processed by the state machines, the rest wait for their turn */
+    rcvd_bpdu_t rcvdBpduQueue[RCVD_BPDU_QUEUE_LEN];
+    unsigned int rcvdBpduHead, rcvdBpduCount;
+#define RCVD_BPDU_ENTRY(prt) (&(prt)->rcvdBpduQueue[(prt)->rcvdBpduHead])
+#define RCVD_BPDU(prt) ((bpdu_t *)RCVD_BPDU_ENTRY(prt)->hdr)
 
     bool deleted;
 
@@ -500,45 +614,47 @@ typedef struct
     unsigned int num_rx_tcn;
     unsigned int num_tx_bpdu;
     unsigned int num_tx_tcn;
+    unsigned int num_tx_failed;
     unsigned int num_trans_fwd;
     unsigned int num_trans_blk;
 } port_t;
 
-typedef struct
+typedef struct per_tree_port
 {
     struct list_head port_list; /* anchor in port's list of trees */
     struct list_head tree_list; /* anchor in tree's list of per-port data */
     port_t *port;
     tree_t *tree;
     __be16 MSTID; /* 0 == CIST */
+    port_identifier_t portId;
 
     int state; /* BR_STATE_xxx */
 
-    /* 13.21.(d,e,f,g,h) Per-port per-tree timers */
-    unsigned int fdWhile, rrWhile, rbWhile, tcWhile, rcvdInfoWhile;
+    /* Variables looked at by the other ports of the tree,
+     * hot == &tree->hot[port->slot] */
+    per_tree_port_hot_t *hot;
 
-    /* 13.24.(s,t,u,v,w,x,y,z,aa,ab,ac,ad,ae,af,ag,ai,aj,ak,ap,as,at,au,av)
-     * Per-port per-tree variables */
-    bool agree, agreed, disputed, forward, forwarding, learn, learning;
-    port_info_t rcvdInfo;
-    port_info_origin_t infoIs;
-    bool proposed, proposing, rcvdMsg, rcvdTc, reRoot, reselect, selected;
-    bool fdbFlush, tcProp, updtInfo, sync, synced;
-    port_identifier_t portId;
-    port_role_t role, selectedRole;
+    /* 13.21.(d,e,f,g,h) Per-port per-tree timers, rrWhile is in hot */
+    unsigned int fdWhile, rbWhile, tcWhile, rcvdInfoWhile;
 
-    /* 13.24.(al,an,aq) Some waste of space here, as MSTIs don't use
-     * RootID and ExtRootPathCost members of the struct port_priority_vector_t,
-     * but saves extra checks and improves readability */
-    port_priority_vector_t designatedPriority, msgPriority, portPriority;
+    /* 13.24.(s,t,u,v,w,x,y,z,aa,ab,ac,ad,ae,af,ag,ai,aj,ak,ap,as,at,au,av)
+     * Per-port per-tree variables, the rest of them is in hot */
+    bool agree:1, agreed:1, disputed:1, forward:1, forwarding:1, learn:1,
+         learning:1;
+    bool proposed:1, proposing:1, rcvdMsg:1, rcvdTc:1;
+    bool fdbFlush:1, tcProp:1;
+    /* 13.24.(ax,ay) Per-port per-MSTI variables, not applicable to CIST */
+    bool master:1, mastered:1;
+    /* Auxiliary flag, helps preventing infinite recursion */
+    bool calledFromFlushRoutine:1;
 
     /* 13.24.(am,ao,ar) Some waste of space here, as MSTIs only use
      * remainingHops member of the struct times_t,
      * but saves extra checks and improves readability */
     times_t designatedTimes, msgTimes, portTimes;
 
-    /* 13.24.(ax,ay) Per-port per-MSTI variables, not applicable to CIST */
-    bool master, mastered;
+    port_info_t rcvdInfo;
+    port_info_origin_t infoIs;
 
     /* Per-port per-tree configuration parameters */
     __u32 InternalPortPathCost; /* 13.22.q */
@@ -547,18 +663,38 @@ typedef struct
     /* not in standard, used for calculation of port uptime */
     unsigned int start_time;
 
+    /* 13.24.(al,an,aq) designatedPriority, msgPriority and portPriority.
+     * Only the keys of the vectors are kept, the CIST-only parts of them
+     * are in ext. Use PTP_PRIORITY() to unpack the vector */
+    priority_key_t designatedKey, msgKey, portKey;
+
+    /* Key of the root path priority vector as placed in tree->rootHeap,
+     * includes portId */
+    priority_key_t rootPathKey;
+    int rootHeapIndex; /* -1 if not a Root Port candidate */
+
     /* State machines */
     PISM_states_t PISM_state;
     PRTSM_states_t PRTSM_state;
     PSTSM_states_t PSTSM_state;
     TCSM_states_t TCSM_state;
+    /* Variables which the state machines of the other ports of the tree
+     * look at, as seen last time (see sm_publish) */
+    unsigned int sm_shared;
 
-    /* Auxiliary flag, helps preventing infinite recursion */
-    bool calledFromFlushRoutine;
+    struct list_head rolesStale_list; /* anchor in tree's rolesStale list */
 
     /* Pointer to the corresponding MSTI Configuration Message
-     * in the port->rcvdBpduData */
+     * in the head entry of port->rcvdBpduQueue */
     msti_configuration_message_t *rcvdMstiConfig;
+
+    /* CIST-only parts of the keys above. Present only in the CIST
+     * per-tree ports, which are allocated from bridge->cist_ptp_pool;
+     * the MSTI ones are allocated without it */
+    struct
+    {
+        cist_priority_key_t designatedKey, msgKey, portKey, rootPathKey;
+    } ext[];
 } per_tree_port_t;
 
 /* External events (inputs) */
@@ -569,9 +705,10 @@ void MSTP_IN_delete_bridge(bridge_t *br);
 void MSTP_IN_set_bridge_address(bridge_t *br, __u8 *macaddr);
 void MSTP_IN_set_bridge_enable(bridge_t *br, bool up);
 void MSTP_IN_set_port_enable(port_t *prt, bool up, int speed, int duplex);
-void MSTP_IN_one_second(bridge_t *br);
+void MSTP_IN_seconds_elapsed(bridge_t *br, unsigned int seconds);
+void MSTP_IN_run_pending(bridge_t *br);
 void MSTP_IN_all_fids_flushed(per_tree_port_t *ptp);
-void MSTP_IN_rx_bpdu(port_t *prt, bpdu_t *bpdu, int size);
+void MSTP_IN_rx_bpdu(port_t *prt, const bpdu_t *bpdu, int size);
 
 bool MSTP_IN_set_vid2fid(bridge_t *br, __u16 vid, __u16 fid);
 bool MSTP_IN_set_all_vids2fids(bridge_t *br, __u16 *vids2fids);
@@ -581,6 +718,17 @@ bool MSTP_IN_get_mstilist(bridge_t *br, int *num_mstis, __u16 *mstids);
 bool MSTP_IN_create_msti(bridge_t *br, __u16 mstid);
 bool MSTP_IN_delete_msti(bridge_t *br, __u16 mstid);
 void MSTP_IN_set_mst_config_id(bridge_t *br, __u16 revision, __u8 *name);
+void MSTP_IN_get_mst_config_id(bridge_t *br,
+                               mst_configuration_identifier_t *cfg);
+int MSTP_IN_get_tree_vids(bridge_t *br, __be16 MSTID, __u16 *vids,
+                          int max_vids);
+
+/* Configuration transaction: the configuration calls between
+ * MSTP_IN_config_begin() and MSTP_IN_config_commit() neither restart nor
+ * run the state machines, commit does it once for all of them.
+ * Transactions may nest, only the outermost commit takes effect */
+void MSTP_IN_config_begin(bridge_t *br);
+void MSTP_IN_config_commit(bridge_t *br);
 
 /* External actions (outputs) */
 void MSTP_OUT_set_state(per_tree_port_t *ptp, int new_state);
@@ -588,6 +736,7 @@ void MSTP_OUT_flush_all_fids(per_tree_port_t *ptp);
 void MSTP_OUT_set_ageing_time(port_t *prt, unsigned int ageingTime);
 void MSTP_OUT_tx_bpdu(port_t *prt, bpdu_t *bpdu, int size);
 void MSTP_OUT_shutdown_port(port_t *prt);
+void MSTP_OUT_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid);
 
 /* Structures for communicating with user */
  /* 12.8.1.1 Read CIST Bridge Protocol Parameters */
@@ -664,6 +813,8 @@ typedef struct
 } CIST_BridgeConfig;
 
 int MSTP_IN_set_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg);
+int MSTP_IN_check_cist_bridge_config(bridge_t *br, CIST_BridgeConfig *cfg,
+                                     __u8 *max_age, __u8 *forward_delay);
 
 /* 12.8.1.4 Set MSTI Bridge Protocol Parameters */
     /* No need in special structure for single parameter Bridge Priority */
@@ -710,6 +861,7 @@ typedef struct
     unsigned int num_rx_tcn;
     unsigned int num_tx_bpdu;
     unsigned int num_tx_tcn;
+    unsigned int num_tx_failed;
     unsigned int num_trans_fwd;
     unsigned int num_trans_blk;
     bool rcvdBpdu;
@@ -784,6 +936,7 @@ typedef struct
 } CIST_PortConfig;
 
 int MSTP_IN_set_cist_port_config(port_t *prt, CIST_PortConfig *cfg);
+int MSTP_IN_check_cist_port_config(port_t *prt, CIST_PortConfig *cfg);
 
 /* 12.8.2.4 Set MSTI port parameters */
 typedef struct
@@ -796,6 +949,8 @@ typedef struct
 } MSTI_PortConfig;
 
 int MSTP_IN_set_msti_port_config(per_tree_port_t *ptp, MSTI_PortConfig *cfg);
+int MSTP_IN_check_msti_port_config(port_t *prt, __u16 mstid,
+                                   MSTI_PortConfig *cfg);
 
 /* 12.8.2.5 Force BPDU Migration Check */
 int MSTP_IN_port_mcheck(port_t *prt);
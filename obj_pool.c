@@ -0,0 +1,95 @@
+/*
+ * obj_pool.c    Pools of fixed-size objects for the bridge, port
+ *               and tree structures.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version
+ *  2 of the License, or (at your option) any later version.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "obj_pool.h"
+
+/* Header of the slab, objects follow it */
+struct obj_slab
+{
+    struct obj_slab *next;
+} __attribute__((aligned(__BIGGEST_ALIGNMENT__)));
+
+#define OBJ_ALIGN(size) \
+    (((size) + __BIGGEST_ALIGNMENT__ - 1) & ~(size_t)(__BIGGEST_ALIGNMENT__ - 1))
+
+void obj_pool_init(obj_pool_t *pool, size_t obj_size,
+                   unsigned int objs_per_slab)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->obj_size = obj_size;
+    pool->objs_per_slab = objs_per_slab;
+}
+
+static bool obj_pool_grow(obj_pool_t *pool)
+{
+    size_t size = OBJ_ALIGN(pool->obj_size);
+    struct obj_slab *slab;
+    char *obj;
+    unsigned int i;
+
+    if(!(slab = malloc(sizeof(*slab) + size * pool->objs_per_slab)))
+        return false;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    /* Thread the new objects onto the free list in address order,
+     * so that consecutive allocations are adjacent in memory */
+    obj = (char *)(slab + 1) + size * pool->objs_per_slab;
+    for(i = 0; i < pool->objs_per_slab; ++i)
+    {
+        obj -= size;
+        *(void **)obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    return true;
+}
+
+void *obj_pool_alloc(obj_pool_t *pool)
+{
+    void *obj;
+
+    if(!pool->free_list && !obj_pool_grow(pool))
+        return NULL;
+    obj = pool->free_list;
+    pool->free_list = *(void **)obj;
+    ++pool->in_use;
+    memset(obj, 0, pool->obj_size);
+    return obj;
+}
+
+void obj_pool_free(obj_pool_t *pool, void *obj)
+{
+    if(!obj)
+        return;
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    if(0 == --pool->in_use)
+        obj_pool_destroy(pool);
+}
+
+void obj_pool_destroy(obj_pool_t *pool)
+{
+    struct obj_slab *slab, *next;
+
+    for(slab = pool->slabs; slab; slab = next)
+    {
+        next = slab->next;
+        free(slab);
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->in_use = 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * obj_pool.h    Pools of fixed-size objects for the bridge, port
+ *               and tree structures.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version
+ *  2 of the License, or (at your option) any later version.
+ */
+
+#ifndef OBJ_POOL_H
+#define OBJ_POOL_H
+
+#include <stddef.h>
+
+/* Objects are carved from slabs of objs_per_slab objects each, freed
+ * objects go to the free list of the pool and are reused by the next
+ * allocations. Slabs are returned to the heap when the last object of
+ * the pool is freed, or by obj_pool_destroy().
+ * Pools are not thread-safe.
+ */
+typedef struct
+{
+    size_t obj_size;
+    unsigned int objs_per_slab;
+    unsigned int in_use; /* number of allocated objects */
+    void *free_list;
+    void *slabs;
+} obj_pool_t;
+
+#define OBJ_POOL_INITIALIZER(type, n) \
+    { .obj_size = sizeof(type), .objs_per_slab = (n) }
+
+void obj_pool_init(obj_pool_t *pool, size_t obj_size,
+                   unsigned int objs_per_slab);
+
+/* Returns zeroed object or NULL if out of memory */
+void *obj_pool_alloc(obj_pool_t *pool);
+
+void obj_pool_free(obj_pool_t *pool, void *obj);
+
+/* Free all the slabs. All objects of the pool become invalid */
+void obj_pool_destroy(obj_pool_t *pool);
+
+#endif /* OBJ_POOL_H */
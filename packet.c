@@ -29,6 +29,8 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <linux/if_packet.h>
 #include <linux/filter.h>
@@ -42,6 +44,40 @@
 
 static struct epoll_event_handler packet_event;
 
+/* Frames are drained from the socket by batches of PACKET_RX_BATCH */
+#define PACKET_RX_BATCH     32
+#define PACKET_RX_FRAME_LEN 2048
+
+static unsigned char rx_frames[PACKET_RX_BATCH][PACKET_RX_FRAME_LEN];
+static struct sockaddr_ll rx_addrs[PACKET_RX_BATCH];
+static struct iovec rx_iovs[PACKET_RX_BATCH];
+static struct mmsghdr rx_msgs[PACKET_RX_BATCH];
+
+/* Outgoing frames are queued by packet_send() and sent by sendmmsg()
+ * in one go from packet_tx_flush(). The bridges can be run on the worker
+ * threads (see bridge_run_pending), hence the lock */
+#define PACKET_TX_QUEUE_LEN 128
+#define PACKET_TX_FRAME_LEN 2048
+
+static unsigned char tx_frames[PACKET_TX_QUEUE_LEN][PACKET_TX_FRAME_LEN];
+static struct sockaddr_ll tx_addrs[PACKET_TX_QUEUE_LEN];
+static struct iovec tx_iovs[PACKET_TX_QUEUE_LEN];
+static struct mmsghdr tx_msgs[PACKET_TX_QUEUE_LEN];
+static int tx_queued;
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Optional TPACKET_V3 receive ring, shared with the kernel */
+#define RX_RING_BLOCK_SIZE  (1 << 16)
+#define RX_RING_BLOCK_NR    16
+#define RX_RING_RETIRE_TOV  10 /* ms */
+
+static struct
+{
+    unsigned char *map;
+    size_t map_len;
+    unsigned int cur; /* next block to look at */
+} rx_ring;
+
 #ifdef PACKET_DEBUG
 static void dump_packet(const unsigned char *buf, int cc)
 {
@@ -61,78 +97,264 @@ static void dump_packet(const unsigned char *buf, int cc)
  * To send/receive Spanning Tree packets we use PF_PACKET because
  * it allows the filtering we want but gives raw data
  */
+
+/* Send all queued frames. Frames are sent in the order they were queued,
+ * so per-port ordering is preserved; a frame that fails is dropped and
+ * reported to the owner of the port, the rest of the queue still goes.
+ */
+static void __packet_tx_flush(void)
+{
+    int i, r, sent = 0;
+
+    while(sent < tx_queued)
+    {
+        r = sendmmsg(packet_event.fd, &tx_msgs[sent], tx_queued - sent, 0);
+        if(r < 0)
+        {
+            if(EINTR == errno)
+                continue;
+            /* The first frame of the remaining ones has failed */
+            if(errno != EWOULDBLOCK)
+                ERROR("send failed: %m");
+            bridge_bpdu_tx_failed(tx_addrs[sent].sll_ifindex);
+            ++sent;
+            continue;
+        }
+        for(i = sent; i < sent + r; ++i)
+        {
+            if(tx_msgs[i].msg_len != tx_iovs[i].iov_len)
+            {
+                ERROR("short write in sendmmsg: %u instead of %zu",
+                      tx_msgs[i].msg_len, tx_iovs[i].iov_len);
+                bridge_bpdu_tx_failed(tx_addrs[i].sll_ifindex);
+            }
+        }
+        sent += r;
+    }
+    tx_queued = 0;
+}
+
+void packet_tx_flush(void)
+{
+    pthread_mutex_lock(&tx_lock);
+    __packet_tx_flush();
+    pthread_mutex_unlock(&tx_lock);
+}
+
 void packet_send(int ifindex, const struct iovec *iov, int iov_count, int len)
 {
-    int l;
-    struct sockaddr_ll sl =
+    int i;
+    struct sockaddr_ll *sl;
+    unsigned char *frame;
+
+    if(len > PACKET_TX_FRAME_LEN)
     {
-        .sll_family = AF_PACKET,
-        .sll_protocol = __constant_cpu_to_be16(ETH_P_802_2),
-        .sll_ifindex = ifindex,
-        .sll_halen = ETH_ALEN,
-    };
+        ERROR("frame too long: %d", len);
+        bridge_bpdu_tx_failed(ifindex);
+        return;
+    }
+    pthread_mutex_lock(&tx_lock);
+    if(PACKET_TX_QUEUE_LEN == tx_queued)
+        __packet_tx_flush();
+
+    sl = &tx_addrs[tx_queued];
+    memset(sl, 0, sizeof(*sl));
+    sl->sll_family = AF_PACKET;
+    sl->sll_protocol = __constant_cpu_to_be16(ETH_P_802_2);
+    sl->sll_ifindex = ifindex;
+    sl->sll_halen = ETH_ALEN;
 
     if(iov_count > 0 && iov[0].iov_len > ETH_ALEN)
-        memcpy(&sl.sll_addr, iov[0].iov_base, ETH_ALEN);
+        memcpy(&sl->sll_addr, iov[0].iov_base, ETH_ALEN);
 
-    struct msghdr msg =
+    frame = tx_frames[tx_queued];
+    for(i = 0; i < iov_count; ++i)
     {
-        .msg_name = &sl,
-        .msg_namelen = sizeof(sl),
-        .msg_iov = (struct iovec *)iov,
-        .msg_iovlen = iov_count,
-        .msg_control = NULL,
-        .msg_controllen = 0,
-        .msg_flags = 0,
-    };
+        memcpy(frame, iov[i].iov_base, iov[i].iov_len);
+        frame += iov[i].iov_len;
+    }
+
+    tx_iovs[tx_queued].iov_base = tx_frames[tx_queued];
+    tx_iovs[tx_queued].iov_len = len;
+    memset(&tx_msgs[tx_queued], 0, sizeof(tx_msgs[tx_queued]));
+    tx_msgs[tx_queued].msg_hdr.msg_name = sl;
+    tx_msgs[tx_queued].msg_hdr.msg_namelen = sizeof(*sl);
+    tx_msgs[tx_queued].msg_hdr.msg_iov = &tx_iovs[tx_queued];
+    tx_msgs[tx_queued].msg_hdr.msg_iovlen = 1;
 
 #ifdef PACKET_DEBUG
-    printf("Transmit Dst index %d %02x:%02x:%02x:%02x:%02x:%02x\n",
-           sl.sll_ifindex,
-           sl.sll_addr[0], sl.sll_addr[1], sl.sll_addr[2],
-           sl.sll_addr[3], sl.sll_addr[4], sl.sll_addr[5]);
-    {
-        int i;
-        for(i = 0; i < iov_count; ++i)
-            dump_packet(iov[i].iov_base, iov[i].iov_len);
-    }
+    printf("Queue for transmit Dst index %d %02x:%02x:%02x:%02x:%02x:%02x\n",
+           sl->sll_ifindex,
+           sl->sll_addr[0], sl->sll_addr[1], sl->sll_addr[2],
+           sl->sll_addr[3], sl->sll_addr[4], sl->sll_addr[5]);
+    dump_packet(tx_frames[tx_queued], len);
 #endif
 
-    l = sendmsg(packet_event.fd, &msg, 0);
+    ++tx_queued;
+    pthread_mutex_unlock(&tx_lock);
+}
 
-    if(l < 0)
+static void packet_rx_batch_init(void)
+{
+    int i;
+
+    for(i = 0; i < PACKET_RX_BATCH; ++i)
     {
-        if(errno != EWOULDBLOCK)
-            ERROR("send failed: %m");
+        rx_iovs[i].iov_base = rx_frames[i];
+        rx_iovs[i].iov_len = PACKET_RX_FRAME_LEN;
+        rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+        rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        rx_msgs[i].msg_hdr.msg_name = &rx_addrs[i];
     }
-    else if(l != len)
-        ERROR("short write in sendto: %d instead of %d", l, len);
 }
 
 static void packet_rcv(uint32_t events, struct epoll_event_handler *h)
 {
-    int cc;
-    unsigned char buf[2048];
-    struct sockaddr_ll sl;
-    socklen_t salen = sizeof sl;
+    int r, i, cc;
+    struct sockaddr_ll *sl;
+
+    do {
+        for(i = 0; i < PACKET_RX_BATCH; ++i)
+            rx_msgs[i].msg_hdr.msg_namelen = sizeof(rx_addrs[i]);
+
+        r = recvmmsg(h->fd, rx_msgs, PACKET_RX_BATCH, 0, NULL);
+        if(r < 0)
+        {
+            if(errno != EAGAIN && errno != EINTR)
+                ERROR("recvmmsg failed: %m");
+            return;
+        }
+
+        for(i = 0; i < r; ++i)
+        {
+            sl = &rx_addrs[i];
+            cc = rx_msgs[i].msg_len;
+            if(cc <= 0)
+                continue;
+
+#ifdef PACKET_DEBUG
+            printf("Receive Src ifindex %d %02x:%02x:%02x:%02x:%02x:%02x\n",
+                   sl->sll_ifindex,
+                   sl->sll_addr[0], sl->sll_addr[1], sl->sll_addr[2],
+                   sl->sll_addr[3], sl->sll_addr[4], sl->sll_addr[5]);
+
+            dump_packet(rx_frames[i], cc);
+#endif
+
+            bridge_bpdu_rcv(sl->sll_ifindex, rx_frames[i], cc);
+        }
+    /* Full batch means there can be more frames waiting in the socket */
+    } while(PACKET_RX_BATCH == r);
+}
+
+/* Walk all blocks the kernel has handed over to us and parse BPDUs
+ * right in the ring memory */
+static void packet_rcv_ring(uint32_t events, struct epoll_event_handler *h)
+{
+    struct tpacket_block_desc *bd;
+    struct tpacket3_hdr *th;
+    struct sockaddr_ll *sl;
+    unsigned int i, num_pkts;
 
-    cc = recvfrom(h->fd, &buf, sizeof(buf), 0, (struct sockaddr *) &sl, &salen);
-    if(cc <= 0)
+    while(true)
     {
-        ERROR("recvfrom failed: %m");
-        return;
-    }
+        bd = (struct tpacket_block_desc *)
+                (rx_ring.map + rx_ring.cur * RX_RING_BLOCK_SIZE);
+        if(!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+            break;
+        __sync_synchronize();
+
+        num_pkts = bd->hdr.bh1.num_pkts;
+        th = (struct tpacket3_hdr *)
+                ((unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        for(i = 0; i < num_pkts; ++i)
+        {
+            sl = (struct sockaddr_ll *)
+                    ((unsigned char *)th + TPACKET_ALIGN(sizeof(*th)));
 
 #ifdef PACKET_DEBUG
-    printf("Receive Src ifindex %d %02x:%02x:%02x:%02x:%02x:%02x\n",
-           sl.sll_ifindex,
-           sl.sll_addr[0], sl.sll_addr[1], sl.sll_addr[2],
-           sl.sll_addr[3], sl.sll_addr[4], sl.sll_addr[5]);
+            printf("Receive Src ifindex %d %02x:%02x:%02x:%02x:%02x:%02x\n",
+                   sl->sll_ifindex,
+                   sl->sll_addr[0], sl->sll_addr[1], sl->sll_addr[2],
+                   sl->sll_addr[3], sl->sll_addr[4], sl->sll_addr[5]);
 
-    dump_packet(buf, cc);
+            dump_packet((unsigned char *)th + th->tp_mac, th->tp_snaplen);
 #endif
 
-    bridge_bpdu_rcv(sl.sll_ifindex, buf, cc);
+            bridge_bpdu_rcv(sl->sll_ifindex,
+                            (unsigned char *)th + th->tp_mac, th->tp_snaplen);
+            th = (struct tpacket3_hdr *)
+                    ((unsigned char *)th + th->tp_next_offset);
+        }
+
+        __sync_synchronize();
+        bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        rx_ring.cur = (rx_ring.cur + 1) % RX_RING_BLOCK_NR;
+    }
+}
+
+/* Detach the ring (if it was attached) and put the socket back into
+ * TPACKET_V1 mode, so that it can be read with recvmmsg() */
+static int packet_rx_ring_detach(int s, bool attached)
+{
+    int version = TPACKET_V1;
+    struct tpacket_req3 req;
+
+    memset(&req, 0, sizeof(req));
+    if(attached
+       && (setsockopt(s, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0))
+    {
+        ERROR("setsockopt PACKET_RX_RING (detach) failed: %m");
+        return -1;
+    }
+    if(setsockopt(s, SOL_PACKET, PACKET_VERSION,
+                  &version, sizeof(version)) < 0)
+    {
+        ERROR("setsockopt PACKET_VERSION (restore) failed: %m");
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns 0 if the ring is set up, -1 if it is not and the socket is
+ * left as it was, -2 if the socket could not be restored */
+static int packet_rx_ring_init(int s)
+{
+    int version = TPACKET_V3;
+    struct tpacket_req3 req =
+    {
+        .tp_block_size = RX_RING_BLOCK_SIZE,
+        .tp_block_nr = RX_RING_BLOCK_NR,
+        .tp_frame_size = PACKET_RX_FRAME_LEN,
+        .tp_frame_nr = (RX_RING_BLOCK_SIZE / PACKET_RX_FRAME_LEN)
+                       * RX_RING_BLOCK_NR,
+        .tp_retire_blk_tov = RX_RING_RETIRE_TOV,
+    };
+    size_t map_len = (size_t)RX_RING_BLOCK_SIZE * RX_RING_BLOCK_NR;
+    void *map;
+
+    if(setsockopt(s, SOL_PACKET, PACKET_VERSION,
+                  &version, sizeof(version)) < 0)
+    {
+        ERROR("setsockopt PACKET_VERSION failed: %m");
+        return -1;
+    }
+    if(setsockopt(s, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        ERROR("setsockopt PACKET_RX_RING failed: %m");
+        return packet_rx_ring_detach(s, false) ? -2 : -1;
+    }
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, s, 0);
+    if(MAP_FAILED == map)
+    {
+        ERROR("mmap of the rx ring failed: %m");
+        return packet_rx_ring_detach(s, true) ? -2 : -1;
+    }
+
+    rx_ring.map = map;
+    rx_ring.map_len = map_len;
+    rx_ring.cur = 0;
+    return 0;
 }
 
 /* Berkeley Packet filter code to filter out spanning tree packets.
@@ -154,7 +376,7 @@ static struct sock_filter stp_filter[] = {
  * Since any bridged devices are already in promiscious mode
  * no need to add multicast address.
  */
-int packet_sock_init(void)
+static int packet_sock_open(void)
 {
     int s;
     struct sock_fprog prog =
@@ -175,14 +397,57 @@ int packet_sock_init(void)
     else if(fcntl(s, F_SETFL, O_NONBLOCK) < 0)
         ERROR("fcntl set nonblock failed: %m");
     else
+        return s;
+
+    close(s);
+    return -1;
+}
+
+static void packet_sock_close(void)
+{
+    if(rx_ring.map)
     {
-        packet_event.fd = s;
-        packet_event.handler = packet_rcv;
+        munmap(rx_ring.map, rx_ring.map_len);
+        rx_ring.map = NULL;
+    }
+    close(packet_event.fd);
+}
+
+int packet_sock_init(bool rx_ring)
+{
+    int s, r;
 
-        if(0 == add_epoll(&packet_event))
-            return 0;
+    if(0 > (s = packet_sock_open()))
+        return -1;
+
+    packet_event.handler = packet_rcv;
+    packet_rx_batch_init();
+    if(rx_ring)
+    {
+        if(0 == (r = packet_rx_ring_init(s)))
+            packet_event.handler = packet_rcv_ring;
+        else
+        {
+            INFO("Falling back to the socket receive path");
+            if(-2 == r)
+            { /* Socket is stuck in the ring mode, start over */
+                close(s);
+                if(0 > (s = packet_sock_open()))
+                    return -1;
+            }
+        }
     }
+    packet_event.fd = s;
 
-    close(s);
+    if(0 == add_epoll(&packet_event))
+        return 0;
+
+    packet_sock_close();
     return -1;
 }
+
+void packet_sock_cleanup(void)
+{
+    remove_epoll(&packet_event);
+    packet_sock_close();
+}
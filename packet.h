@@ -26,8 +26,11 @@
 #define PACKET_SOCK_H
 
 #include <sys/uio.h>
+#include <stdbool.h>
 
 void packet_send(int ifindex, const struct iovec *iov, int iov_count, int len);
-int packet_sock_init(void);
+void packet_tx_flush(void);
+int packet_sock_init(bool rx_ring);
+void packet_sock_cleanup(void);
 
 #endif /* PACKET_SOCK_H */
@@ -0,0 +1,311 @@
+/*
+ * mstp_bench.c Benchmark of the MSTP state machines.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version
+ *  2 of the License, or (at your option) any later version.
+ *
+ * Drives mstp.c directly, without the kernel bridge and without the
+ * event loop: timers are kept on a plain list and advanced one second
+ * at a time, transmitted BPDUs are only counted.
+ *
+ * Usage: mstp_bench [threads [ports [mstis [bpdus]]]]
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <asm/byteorder.h>
+
+#include "mstp.h"
+#include "log.h"
+#include "worker_pool.h"
+
+#ifdef MISC_TEST_FUNCS
+
+#define BENCH_MAX_PORTS     4094
+#define BENCH_SETTLE_SECS   40
+
+int log_level = LOG_LEVEL_ERROR;
+int ctl_in_handler = 0;
+
+static int nports = BENCH_MAX_PORTS;
+static int nmstis = MAX_IMPLEMENTATION_MSTIS;
+static int nbpdus = 20;
+
+static bridge_t br;
+static port_t *ports[BENCH_MAX_PORTS];
+static unsigned long tx_count;
+
+/*********************** Stubs for mstpd *********************/
+
+void vDprintf(int level, const char *fmt, va_list ap)
+{
+    if(level > log_level)
+        return;
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+}
+
+void Dprintf(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vDprintf(level, fmt, ap);
+    va_end(ap);
+}
+
+void _ctl_err_log(char *fmt, ...)
+{
+}
+
+/* One tick per second, so that the timers can be stepped by hand */
+static unsigned int now;
+static LIST_HEAD(timers);
+
+unsigned int ticks_per_second(void)
+{
+    return 1;
+}
+
+unsigned int wheel_now(void)
+{
+    return now;
+}
+
+void wheel_timer_init(struct wheel_timer *t,
+                      void (*handler)(struct wheel_timer *))
+{
+    INIT_LIST_HEAD(&t->list);
+    t->handler = handler;
+}
+
+void wheel_timer_del(struct wheel_timer *t)
+{
+    list_del_init(&t->list);
+}
+
+void wheel_timer_mod(struct wheel_timer *t, unsigned int ticks)
+{
+    list_del_init(&t->list);
+    t->expires = now + (ticks ? ticks : 1);
+    list_add_tail(&t->list, &timers);
+}
+
+static void fire_timers(void)
+{
+    struct wheel_timer *t, *nxt;
+    LIST_HEAD(expired);
+
+    list_for_each_entry_safe(t, nxt, &timers, list)
+        if((int)(t->expires - now) <= 0)
+            list_move_tail(&t->list, &expired);
+    list_for_each_entry_safe(t, nxt, &expired, list)
+    {
+        list_del_init(&t->list);
+        t->handler(t);
+    }
+}
+
+void MSTP_OUT_set_state(per_tree_port_t *ptp, int new_state)
+{
+    ptp->state = new_state;
+}
+
+void MSTP_OUT_flush_all_fids(per_tree_port_t *ptp)
+{
+    MSTP_IN_all_fids_flushed(ptp);
+}
+
+void MSTP_OUT_set_ageing_time(port_t *prt, unsigned int ageingTime)
+{
+}
+
+void MSTP_OUT_tx_bpdu(port_t *prt, bpdu_t *bpdu, int size)
+{
+    ++tx_count;
+}
+
+void MSTP_OUT_shutdown_port(port_t *prt)
+{
+}
+
+void MSTP_OUT_set_vid2mstid(bridge_t *br, __u16 vid, __u16 mstid)
+{
+}
+
+/*********************** Benchmark *********************/
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - start->tv_sec) + (t.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+#define PHASE(name, code) do {                               \
+    struct timespec _start;                                  \
+    clock_gettime(CLOCK_MONOTONIC, &_start);                 \
+    code;                                                    \
+    printf("%-16s %8.3f s\n", name, elapsed(&_start));       \
+} while(0)
+
+static void run_pending(void)
+{
+    while(br.run_pending)
+        MSTP_IN_run_pending(&br);
+}
+
+static void run_seconds(int secs)
+{
+    while(secs-- > 0)
+    {
+        ++now;
+        fire_timers();
+        run_pending();
+    }
+}
+
+/* Designated MST BPDU from a better root, as received on ports[0] */
+static int make_root_bpdu(bpdu_t *b)
+{
+    bridge_identifier_t id;
+    __u8 flags = BPDU_FLAGS_ROLE_SET(encodedRoleDesignated)
+                 | (1 << offsetLearnig) | (1 << offsetForwarding);
+    int i;
+
+    memset(b, 0, sizeof(*b));
+    memset(&id, 0, sizeof(id));
+    id.s.priority = __cpu_to_be16(0x1000);
+    id.s.mac_address[0] = 0x02;
+    id.s.mac_address[5] = 0x99;
+
+    b->protocolIdentifier = 0;
+    b->protocolVersion = protoMSTP;
+    b->bpduType = bpduTypeRST;
+    b->flags = flags;
+    b->cistRootID = id;
+    b->cistRRootID = id;
+    b->cistBridgeID = id;
+    b->cistPortID = __cpu_to_be16(0x8001);
+    b->MaxAge[0] = 20;
+    b->HelloTime[0] = 2;
+    b->ForwardDelay[0] = 15;
+    MSTP_IN_get_mst_config_id(&br, &b->mstConfigurationIdentifier);
+    b->cistRemainingHops = 20;
+    for(i = 0; i < nmstis; ++i)
+    {
+        msti_configuration_message_t *m = &b->mstConfiguration[i];
+        m->flags = flags;
+        m->mstiRRootID = id;
+        m->mstiRRootID.s.priority = __cpu_to_be16(0x1000 | (i + 1));
+        m->portIdentifierPriority = 0x80;
+        m->remainingHops = 20;
+    }
+    b->version3_len = __cpu_to_be16(MST_BPDU_VER3LEN_WO_MSTI_MSGS
+                                    + nmstis * sizeof(msti_configuration_message_t));
+    return MST_BPDU_SIZE_WO_MSTI_MSGS
+           + nmstis * sizeof(msti_configuration_message_t);
+}
+
+static void print_roles(void)
+{
+    int roles[8] = {0};
+    tree_t *tree;
+    per_tree_port_t *ptp;
+    int i;
+
+    list_for_each_entry(tree, &br.trees, bridge_list)
+        list_for_each_entry(ptp, &tree->ports, tree_list)
+            ++roles[ptp->hot->role & 7];
+    printf("roles:");
+    for(i = 0; i < 8; ++i)
+        printf(" %d", roles[i]);
+    printf(" tx %lu\n", tx_count);
+}
+
+int main(int argc, char *argv[])
+{
+    __u8 macaddr[ETH_ALEN] = {0x02, 0, 0, 0, 0, 0x01};
+    CIST_BridgeConfig cfg;
+    bpdu_t bpdu;
+    int i, size;
+
+    /* Report each phase as soon as it is done, the big runs are slow */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if(argc > 1 && worker_pool_init(atoi(argv[1])))
+        return 1;
+    if(argc > 2)
+        nports = atoi(argv[2]);
+    if(argc > 3)
+        nmstis = atoi(argv[3]);
+    if(argc > 4)
+        nbpdus = atoi(argv[4]);
+    if(nports < 1 || nports > BENCH_MAX_PORTS)
+    {
+        fprintf(stderr, "ports must be 1..%d\n", BENCH_MAX_PORTS);
+        return 1;
+    }
+    if(nmstis < 0 || nmstis > MAX_IMPLEMENTATION_MSTIS)
+    {
+        fprintf(stderr, "mstis must be 0..%d\n", MAX_IMPLEMENTATION_MSTIS);
+        return 1;
+    }
+    printf("%d ports, CIST + %d MSTIs\n", nports, nmstis);
+
+    strcpy(br.sysdeps.name, "br0");
+    if(!MSTP_IN_bridge_create(&br, macaddr))
+        return 1;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.protocol_version = protoMSTP;
+    cfg.set_protocol_version = true;
+    MSTP_IN_set_cist_bridge_config(&br, &cfg);
+    for(i = 1; i <= nmstis; ++i)
+        MSTP_IN_create_msti(&br, i);
+
+    PHASE("add ports",
+        for(i = 0; i < nports; ++i)
+        {
+            ports[i] = obj_pool_alloc(&br.port_pool);
+            ports[i]->bridge = &br;
+            sprintf(ports[i]->sysdeps.name, "p%d", i);
+            if(!MSTP_IN_port_create_and_add_tail(ports[i], i + 1))
+                return 1;
+        }
+    );
+    PHASE("enable ports",
+        for(i = 0; i < nports; ++i)
+            MSTP_IN_set_port_enable(ports[i], true, 10000, 1);
+    );
+    PHASE("enable bridge",
+        MSTP_IN_set_bridge_enable(&br, true);
+        run_pending();
+    );
+    PHASE("settle timers", run_seconds(BENCH_SETTLE_SECS));
+
+    size = make_root_bpdu(&bpdu);
+    PHASE("root change",
+        MSTP_IN_rx_bpdu(ports[0], &bpdu, size);
+        run_pending();
+    );
+    PHASE("converge timers", run_seconds(BENCH_SETTLE_SECS));
+    PHASE("repeated bpdus",
+        for(i = 0; i < nbpdus; ++i)
+        {
+            MSTP_IN_rx_bpdu(ports[0], &bpdu, size);
+            run_pending();
+        }
+    );
+
+    print_roles();
+    return 0;
+}
+
+#endif /* MISC_TEST_FUNCS */
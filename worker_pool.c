@@ -0,0 +1,155 @@
+/*
+ * worker_pool.c    Pool of worker threads for the parallel parts
+ *                  of the state machines.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version
+ *  2 of the License, or (at your option) any later version.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "worker_pool.h"
+
+#define MAX_WORKER_THREADS 64
+
+static struct
+{
+    pthread_t threads[MAX_WORKER_THREADS];
+    int nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start; /* new job is posted */
+    pthread_cond_t done;  /* all workers are done with the job */
+    unsigned int generation; /* incremented on every posted job */
+    int busy; /* number of workers still running the job */
+
+    void (*job)(void *arg, int i);
+    void *arg;
+    int count;
+    int next; /* next index to run, taken atomically */
+} pool =
+{
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Set while the thread runs a job. A job may call worker_pool_run() too
+ * (e.g. parallel MSTIs inside of the bridges run in parallel), then the
+ * nested job is run in place */
+static __thread bool in_job;
+
+static void run_job(void (*job)(void *arg, int i), void *arg, int count)
+{
+    int i;
+
+    in_job = true;
+    while((i = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED)) < count)
+        job(arg, i);
+    in_job = false;
+}
+
+static void *worker_thread(void *unused)
+{
+    unsigned int generation = 0;
+    void (*job)(void *arg, int i);
+    void *arg;
+    int count;
+
+    while(1)
+    {
+        pthread_mutex_lock(&pool.lock);
+        while(generation == pool.generation)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        generation = pool.generation;
+        job = pool.job;
+        arg = pool.arg;
+        count = pool.count;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_job(job, arg, count);
+
+        pthread_mutex_lock(&pool.lock);
+        if(0 == --pool.busy)
+            pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    return NULL;
+}
+
+int worker_pool_init(int nthreads)
+{
+    sigset_t all, old;
+    int err = 0;
+
+    if(nthreads > MAX_WORKER_THREADS)
+    {
+        ERROR("Too many worker threads %d, maximum is %d",
+              nthreads, MAX_WORKER_THREADS);
+        return -1;
+    }
+
+    /* Signals are handled by the main thread only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for(pool.nthreads = 0; pool.nthreads < nthreads; ++pool.nthreads)
+    {
+        err = pthread_create(&pool.threads[pool.nthreads], NULL,
+                             worker_thread, NULL);
+        if(err)
+        {
+            ERROR("Couldn't create worker thread: %s", strerror(err));
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(pool.nthreads)
+        INFO("Started %d worker threads", pool.nthreads);
+    return err ? -1 : 0;
+}
+
+int worker_pool_size(void)
+{
+    return pool.nthreads;
+}
+
+void worker_pool_run(void (*job)(void *arg, int i), void *arg, int count)
+{
+    if(!pool.nthreads || (count < 2) || in_job)
+    {
+        int i;
+
+        for(i = 0; i < count; ++i)
+            job(arg, i);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = job;
+    pool.arg = arg;
+    pool.count = count;
+    pool.next = 0;
+    pool.busy = pool.nthreads;
+    ++pool.generation;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    /* Do our share of the work */
+    run_job(job, arg, count);
+
+    pthread_mutex_lock(&pool.lock);
+    while(pool.busy)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
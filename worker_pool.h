@@ -0,0 +1,27 @@
+/*
+ * worker_pool.h    Pool of worker threads for the parallel parts
+ *                  of the state machines.
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version
+ *  2 of the License, or (at your option) any later version.
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/* Start nthreads worker threads. Should be called before any bridge
+ * is created. Without it (or with nthreads == 0) everything runs
+ * in the main thread */
+int worker_pool_init(int nthreads);
+
+/* Number of worker threads, 0 if the pool is not used */
+int worker_pool_size(void);
+
+/* Call job(arg, i) for each i in [0, count), spreading the calls over the
+ * worker threads and the calling thread. Returns when all calls are done.
+ * The calls for different i must not touch the same data. */
+void worker_pool_run(void (*job)(void *arg, int i), void *arg, int count);
+
+#endif /* WORKER_POOL_H */